@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "randstate.h"
+#include "numtheory.h"
+#include "mbexp.h"
+#include "pipeline.h"
+#include "rsa.h"
+
+#define ITEMS "b:r:s:f:t:o:h"
+
+char *help_message
+    = "SYNOPSIS\n"
+      "   Times the RSA primitives, key generation and file throughput, prints JSON.\n\n"
+      "USAGE\n"
+      "   ./bench [-h] [-b bits] [-r trials] [-s seed] [-f bytes] [-t threads] [-o outfile]\n\n"
+      "OPTIONS\n"
+      "   -h              Display program help and usage.\n"
+      "   -b bits         Only benchmark moduli of this size (default: 1024 to 8192).\n"
+      "   -r trials       Timed trials of every operation (default: 5).\n"
+      "   -s seed         Random seed, each trial reseeds from it (default: 1).\n"
+      "   -f bytes        Size of the file encrypted and decrypted (default: 65536).\n"
+      "   -t threads      Threads for key generation and the file functions (default: 1).\n"
+      "   -o outfile      Output file for the results (default: stdout).\n";
+
+//modulus sizes benchmarked by default
+static const uint64_t default_bits[] = { 1024, 2048, 4096, 8192 };
+
+//primality confidence, the keygen default
+#define ITERS 50
+
+//seconds on a monotonic clock
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+//nearest-rank percentile pct of count sorted samples
+static double percentile(double *sorted, uint64_t count, double pct) {
+    uint64_t rank = (uint64_t) ((pct / 100.0) * (double) count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[rank - 1];
+}
+
+//writes one result object, the samples are sorted in place
+static void report(FILE *outfile, bool *first, uint64_t bits, const char *op, const char *unit,
+    double *samples, uint64_t count) {
+    qsort(samples, count, sizeof(double), cmp_double);
+    fprintf(outfile,
+        "%s    {\"bits\": %" PRIu64 ", \"op\": \"%s\", \"unit\": \"%s\", \"median\": %.9g, "
+        "\"p10\": %.9g, \"p90\": %.9g, \"min\": %.9g, \"max\": %.9g}",
+        *first ? "" : ",\n", bits, op, unit, percentile(samples, count, 50),
+        percentile(samples, count, 10), percentile(samples, count, 90), samples[0],
+        samples[count - 1]);
+    *first = false;
+    fflush(outfile);
+    return;
+}
+
+//reseeds the global random state so trial i always sees the same numbers
+static void reseed(uint64_t seed, uint64_t bits, uint64_t i) {
+    randstate_clear();
+    randstate_init(seed * 1000003 + bits * 101 + i);
+    return;
+}
+
+//empties file and moves back to its start
+static void reset_file(FILE *file) {
+    fflush(file);
+    if (ftruncate(fileno(file), 0) != 0) {
+        fprintf(stderr, "ERROR: unable to truncate temporary file - %d\n", errno);
+    }
+    rewind(file);
+    return;
+}
+
+//runs every benchmark for moduli bits long
+static void bench_bits(FILE *outfile, bool *first, uint64_t bits, uint64_t trials,
+    uint64_t seed, uint64_t file_bytes, uint64_t threads) {
+    double *samples = (double *) malloc(trials * sizeof(double));
+    mpz_t p, q, n, e, d, dp, dq, qinv, a, b, out, totient;
+    mpz_init(p);
+    mpz_init(q);
+    mpz_init(n);
+    mpz_init(e);
+    mpz_init(d);
+    mpz_init(dp);
+    mpz_init(dq);
+    mpz_init(qinv);
+    mpz_init(a);
+    mpz_init(b);
+    mpz_init(out);
+    mpz_init(totient);
+
+    //full key generation, the key of the last trial is used by the rest
+    for (uint64_t i = 0; i < trials; i++) {
+        reseed(seed, bits, i);
+        double start = now();
+        rsa_make_pub(p, q, NULL, n, e, bits, ITERS, 65537, threads);
+        rsa_make_priv(d, e, p, q, NULL);
+        rsa_make_crt(dp, dq, qinv, d, p, q, NULL);
+        samples[i] = now() - start;
+    }
+    report(outfile, first, bits, "keygen", "s", samples, trials);
+
+    for (uint64_t i = 0; i < trials; i++) {
+        reseed(seed, bits, i);
+        double start = now();
+        make_prime(out, bits / 2, ITERS);
+        samples[i] = now() - start;
+    }
+    report(outfile, first, bits, "make_prime", "s", samples, trials);
+
+    //a prime runs every test and Miller-Rabin round, the worst case
+    for (uint64_t i = 0; i < trials; i++) {
+        reseed(seed, bits, i);
+        double start = now();
+        is_prime(p, ITERS);
+        samples[i] = now() - start;
+    }
+    report(outfile, first, bits, "is_prime", "s", samples, trials);
+
+    //private exponent, the cost of a decryption without CRT
+    for (uint64_t i = 0; i < trials; i++) {
+        reseed(seed, bits, i);
+        mpz_urandomm(a, state, n);
+        double start = now();
+        pow_mod(out, a, d, n);
+        samples[i] = now() - start;
+    }
+    report(outfile, first, bits, "pow_mod", "s", samples, trials);
+
+    //the same exponentiation through the multi-buffer kernel, a full batch per trial reported
+    //per exponentiation, left out when the kernel would not be used at this size
+    mbexp_t mb;
+    mbexp_init(&mb, n, mbexp_select(bits));
+    if (mb.isa != MBEXP_SCALAR) {
+        mpz_t base[MBEXP_LANES];
+        mpz_ptr ptrs[MBEXP_LANES];
+        nt_recoding_t rec;
+        nt_recode(&rec, d);
+        uint64_t *ws = mbexp_ws_alloc(mbexp_ws_size(&mb));
+        for (uint64_t l = 0; l < mb.lanes; l++) {
+            mpz_init(base[l]);
+            ptrs[l] = base[l];
+        }
+        for (uint64_t i = 0; i < trials; i++) {
+            reseed(seed, bits, i);
+            for (uint64_t l = 0; l < mb.lanes; l++) {
+                mpz_urandomm(base[l], state, n);
+            }
+            double start = now();
+            mbexp_pow(&mb, ptrs, ptrs, mb.lanes, &rec, ws);
+            samples[i] = (now() - start) / (double) mb.lanes;
+        }
+        report(outfile, first, bits, "mbexp_pow", "s", samples, trials);
+        for (uint64_t l = 0; l < mb.lanes; l++) {
+            mpz_clear(base[l]);
+        }
+        mbexp_ws_free(ws);
+        nt_recoding_clear(&rec);
+    }
+    mbexp_clear(&mb);
+
+    for (uint64_t i = 0; i < trials; i++) {
+        reseed(seed, bits, i);
+        mpz_urandomb(a, state, bits);
+        mpz_urandomb(b, state, bits);
+        double start = now();
+        gcd(out, a, b);
+        samples[i] = now() - start;
+    }
+    report(outfile, first, bits, "gcd", "s", samples, trials);
+
+    mpz_sub_ui(a, p, 1);
+    mpz_sub_ui(b, q, 1);
+    mpz_mul(totient, a, b);
+    for (uint64_t i = 0; i < trials; i++) {
+        double start = now();
+        mod_inverse(out, e, totient);
+        samples[i] = now() - start;
+    }
+    report(outfile, first, bits, "mod_inverse", "s", samples, trials);
+
+    //file throughput on temporary regular files, so the mapped paths are measured
+    FILE *plain = tmpfile();
+    FILE *cipher = tmpfile();
+    FILE *result = tmpfile();
+    if ((plain == NULL) || (cipher == NULL) || (result == NULL)) {
+        fprintf(stderr, "ERROR: unable to open temporary files - %d\n", errno);
+    } else {
+        reseed(seed, bits, 0);
+        mpz_urandomb(a, state, 8 * file_bytes);
+        uint8_t *data = (uint8_t *) calloc(file_bytes + 1, 1);
+        size_t len = 0;
+        mpz_export(data, &len, 1, 1, 1, 0, a);
+        fwrite(data, 1, file_bytes, plain);
+        fflush(plain);
+        free(data);
+        double mb = (double) file_bytes / 1e6;
+
+        for (uint64_t i = 0; i < trials; i++) {
+            rewind(plain);
+            reset_file(cipher);
+            double start = now();
+            rsa_encrypt_file(plain, cipher, n, e, threads, true);
+            fflush(cipher);
+            samples[i] = mb / (now() - start);
+        }
+        report(outfile, first, bits, "encrypt_file", "MB/s", samples, trials);
+
+        for (uint64_t i = 0; i < trials; i++) {
+            rewind(cipher);
+            reset_file(result);
+            double start = now();
+            rsa_decrypt_file_crt(cipher, result, n, p, q, dp, dq, qinv, NULL, threads);
+            fflush(result);
+            samples[i] = mb / (now() - start);
+        }
+        report(outfile, first, bits, "decrypt_file", "MB/s", samples, trials);
+    }
+    if (plain != NULL) {
+        fclose(plain);
+    }
+    if (cipher != NULL) {
+        fclose(cipher);
+    }
+    if (result != NULL) {
+        fclose(result);
+    }
+
+    mpz_clear(p);
+    mpz_clear(q);
+    mpz_clear(n);
+    mpz_clear(e);
+    mpz_clear(d);
+    mpz_clear(dp);
+    mpz_clear(dq);
+    mpz_clear(qinv);
+    mpz_clear(a);
+    mpz_clear(b);
+    mpz_clear(out);
+    mpz_clear(totient);
+    free(samples);
+    return;
+}
+
+int main(int argc, char **argv) {
+
+    int opt = 0;
+
+    FILE *outfile = stdout;
+    uint64_t bits = 0; //0 runs every default size
+    uint64_t trials = 5;
+    uint64_t seed = 1;
+    uint64_t file_bytes = 65536;
+    uint64_t threads = 1;
+
+    while ((opt = getopt(argc, argv, ITEMS)) != -1) {
+        switch (opt) {
+        case 'b': bits = (uint64_t) atoi(optarg); break;
+        case 'r': trials = (uint64_t) atoi(optarg); break;
+        case 's': seed = (uint64_t) strtoull(optarg, NULL, 10); break;
+        case 'f': file_bytes = (uint64_t) strtoull(optarg, NULL, 10); break;
+        case 't': threads = pipeline_parse_threads(optarg); break;
+        case 'o': outfile = fopen(optarg, "w"); break;
+        default:
+        case 'h': fprintf(stderr, "%s", help_message); return 0;
+        }
+    }
+
+    if (outfile == NULL) {
+        fprintf(stderr, "ERROR: unable to open outfile - %d\n", errno);
+        return 0;
+    }
+
+    if ((trials < 1) || (file_bytes < 1) || ((bits != 0) && (bits < 64))) {
+        fprintf(stderr, "ERROR: trials and bytes must be positive and bits at least 64\n");
+        return 0;
+    }
+
+    if (threads == 0) {
+        fprintf(stderr, "ERROR: threads must be between 1 and %d\n", PIPELINE_MAX_THREADS);
+        return 0;
+    }
+
+    fprintf(outfile,
+        "{\n  \"seed\": %" PRIu64 ",\n  \"trials\": %" PRIu64 ",\n  \"threads\": %" PRIu64
+        ",\n  \"file_bytes\": %" PRIu64 ",\n  \"results\": [\n",
+        seed, trials, threads, file_bytes);
+
+    randstate_init(seed);
+    bool first = true;
+    if (bits != 0) {
+        bench_bits(outfile, &first, bits, trials, seed, file_bytes, threads);
+    } else {
+        for (uint64_t i = 0; i < sizeof(default_bits) / sizeof(default_bits[0]); i++) {
+            bench_bits(outfile, &first, default_bits[i], trials, seed, file_bytes, threads);
+        }
+    }
+    randstate_clear();
+
+    fprintf(outfile, "\n  ]\n}\n");
+    if (outfile != stdout) {
+        fclose(outfile);
+    }
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "chacha.h"
+
+//four 32-bit lanes, one word of four consecutive blocks
+//the compiler maps this onto one SSE or NEON register, the 16 words of 4 blocks fit the
+//register file so a whole double round runs without spilling
+typedef uint32_t lanes_t __attribute__((vector_size(16)));
+
+#define LANES 4
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d)                                                                    \
+    a += b;                                                                                    \
+    d ^= a;                                                                                    \
+    d = ROTL(d, 16);                                                                           \
+    c += d;                                                                                    \
+    b ^= c;                                                                                    \
+    b = ROTL(b, 12);                                                                           \
+    a += b;                                                                                    \
+    d ^= a;                                                                                    \
+    d = ROTL(d, 8);                                                                            \
+    c += d;                                                                                    \
+    b ^= c;                                                                                    \
+    b = ROTL(b, 7);
+
+//reads a little-endian word from buf
+static uint32_t get_le(const uint8_t *buf) {
+    return (uint32_t) buf[0] | ((uint32_t) buf[1] << 8) | ((uint32_t) buf[2] << 16)
+           | ((uint32_t) buf[3] << 24);
+}
+
+//stores value little-endian in buf
+static void put_le(uint8_t *buf, uint32_t value) {
+    buf[0] = (uint8_t) value;
+    buf[1] = (uint8_t) (value >> 8);
+    buf[2] = (uint8_t) (value >> 16);
+    buf[3] = (uint8_t) (value >> 24);
+    return;
+}
+
+//sets up the cipher for key (CHACHA_KEY_SIZE bytes) and nonce (CHACHA_NONCE_SIZE bytes)
+void chacha_init(chacha_t *ctx, const uint8_t *key, const uint8_t *nonce) {
+    static const uint8_t sigma[16] = "expand 32-byte k";
+    for (int i = 0; i < 4; i++) {
+        ctx->input[i] = get_le(sigma + 4 * i);
+    }
+    for (int i = 0; i < 8; i++) {
+        ctx->input[4 + i] = get_le(key + 4 * i);
+    }
+    ctx->input[12] = 0;
+    ctx->input[13] = 0;
+    ctx->input[14] = get_le(nonce);
+    ctx->input[15] = get_le(nonce + 4);
+    return;
+}
+
+//keystream blocks counter to counter + 3 into ks, all four computed side by side
+static void chacha_blocks(chacha_t *ctx, uint8_t *ks, uint64_t counter) {
+    lanes_t x[16], start[16];
+    for (int i = 0; i < 16; i++) {
+        uint32_t word = ctx->input[i];
+        x[i] = (lanes_t) { word, word, word, word };
+    }
+    for (int lane = 0; lane < LANES; lane++) {
+        x[12][lane] = (uint32_t) (counter + lane);
+        x[13][lane] = (uint32_t) ((counter + lane) >> 32);
+    }
+    memcpy(start, x, sizeof(x));
+
+    //20 rounds, a column round and a diagonal round at a time
+    for (int i = 0; i < 10; i++) {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        x[i] += start[i];
+        for (int lane = 0; lane < LANES; lane++) {
+            put_le(ks + CHACHA_BLOCK_SIZE * lane + 4 * i, x[i][lane]);
+        }
+    }
+    return;
+}
+
+//xors len bytes of in with the keystream starting at block counter into out
+//out and in may be the same buffer
+void chacha_xor(chacha_t *ctx, uint8_t *out, const uint8_t *in, uint64_t len, uint64_t counter) {
+    uint8_t ks[LANES * CHACHA_BLOCK_SIZE];
+    while (len > 0) {
+        chacha_blocks(ctx, ks, counter);
+        counter += LANES;
+
+        uint64_t bytes = (len < sizeof(ks)) ? len : sizeof(ks);
+        if (bytes == sizeof(ks)) {
+            //whole words at a time, memcpy keeps the loads aligned-agnostic
+            for (uint64_t i = 0; i < sizeof(ks); i += sizeof(uint64_t)) {
+                uint64_t a, b;
+                memcpy(&a, in + i, sizeof(a));
+                memcpy(&b, ks + i, sizeof(b));
+                a ^= b;
+                memcpy(out + i, &a, sizeof(a));
+            }
+        } else {
+            for (uint64_t i = 0; i < bytes; i++) {
+                out[i] = in[i] ^ ks[i];
+            }
+        }
+        in += bytes;
+        out += bytes;
+        len -= bytes;
+    }
+    return;
+}
+
+//xors len bytes of in with the keystream starting at byte offset of the stream into out
+//for callers handing over data in pieces that do not end on block boundaries
+void chacha_xor_at(chacha_t *ctx, uint8_t *out, const uint8_t *in, uint64_t len, uint64_t offset) {
+    uint64_t skip = offset % CHACHA_BLOCK_SIZE;
+    if ((skip != 0) && (len > 0)) {
+        uint8_t ks[CHACHA_BLOCK_SIZE] = { 0 };
+        chacha_xor(ctx, ks, ks, CHACHA_BLOCK_SIZE, offset / CHACHA_BLOCK_SIZE);
+        uint64_t head = (len < CHACHA_BLOCK_SIZE - skip) ? len : CHACHA_BLOCK_SIZE - skip;
+        for (uint64_t i = 0; i < head; i++) {
+            out[i] = in[i] ^ ks[skip + i];
+        }
+        in += head;
+        out += head;
+        len -= head;
+        offset += head;
+    }
+    chacha_xor(ctx, out, in, len, offset / CHACHA_BLOCK_SIZE);
+    return;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+//ChaCha20 stream cipher, the original variant with a 64-bit block counter and a 64-bit nonce
+//the keystream of block i only depends on the key, the nonce and i, so any part of a stream
+//can be processed on its own given the number of the 64 byte block it starts at
+
+#define CHACHA_KEY_SIZE   32
+#define CHACHA_NONCE_SIZE 8
+#define CHACHA_BLOCK_SIZE 64
+
+typedef struct {
+    uint32_t input[16]; //constants, key and nonce, the counter words are filled in per call
+} chacha_t;
+
+void chacha_init(chacha_t *ctx, const uint8_t *key, const uint8_t *nonce);
+
+void chacha_xor(chacha_t *ctx, uint8_t *out, const uint8_t *in, uint64_t len, uint64_t counter);
+
+void chacha_xor_at(chacha_t *ctx, uint8_t *out, const uint8_t *in, uint64_t len, uint64_t offset);
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "container.h"
+
+//stores the low bytes of value big-endian in buf
+static void put_be(uint8_t *buf, uint64_t value, uint64_t bytes) {
+    for (uint64_t i = 0; i < bytes; i++) {
+        buf[bytes - 1 - i] = (uint8_t) (value >> (8 * i));
+    }
+    return;
+}
+
+//reads a big-endian value of bytes bytes from buf
+static uint64_t get_be(uint8_t *buf, uint64_t bytes) {
+    uint64_t value = 0;
+    for (uint64_t i = 0; i < bytes; i++) {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+//serializes hdr into the CONTAINER_HEADER_SIZE bytes at buf
+void container_encode(uint8_t *buf, container_t *hdr) {
+    memcpy(buf, hdr->hybrid ? CONTAINER_HYBRID_MAGIC : CONTAINER_MAGIC, 4);
+    buf[4] = hdr->version;
+    buf[5] = hdr->flags;
+    put_be(buf + 6, 0, 2);
+    put_be(buf + 8, hdr->modulus_bits, 4);
+    put_be(buf + 12, hdr->block_width, 4);
+    put_be(buf + CONTAINER_COUNT_OFFSET, hdr->block_count, 8);
+    return;
+}
+
+//parses the CONTAINER_HEADER_SIZE bytes at buf into hdr
+//returns false if they are not a header this version understands, unknown flags included
+bool container_decode(uint8_t *buf, container_t *hdr) {
+    hdr->hybrid = (memcmp(buf, CONTAINER_HYBRID_MAGIC, 4) == 0);
+    if (!hdr->hybrid && (memcmp(buf, CONTAINER_MAGIC, 4) != 0)) {
+        return false;
+    }
+    hdr->version = buf[4];
+    hdr->flags = buf[5];
+    hdr->modulus_bits = (uint32_t) get_be(buf + 8, 4);
+    hdr->block_width = (uint32_t) get_be(buf + 12, 4);
+    hdr->block_count = get_be(buf + CONTAINER_COUNT_OFFSET, 8);
+    return (hdr->version == CONTAINER_VERSION) && (hdr->block_width > 0)
+           && ((hdr->flags & ~CONTAINER_FLAG_LZ) == 0);
+}
+
+//writes the header hdr to OUTFILE
+void container_write(FILE *outfile, container_t *hdr) {
+    uint8_t buf[CONTAINER_HEADER_SIZE];
+    container_encode(buf, hdr);
+    fwrite(buf, 1, CONTAINER_HEADER_SIZE, outfile);
+    return;
+}
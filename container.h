@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//binary cypher text container
+//a fixed size header followed by block_count big-endian blocks, each block_width bytes, so
+//the offset of any block is CONTAINER_HEADER_SIZE + i * block_width
+//
+//header layout, all fields big-endian:
+//  0  magic "RSAB"
+//  4  version
+//  5  flags, CONTAINER_FLAG_LZ
+//  6  reserved, 0
+//  8  modulus bits
+//  12 block width in bytes
+//  16 block count, CONTAINER_UNKNOWN_COUNT when the writer could not tell
+//
+//with CONTAINER_FLAG_LZ the data was compressed into lz frames before it was split into
+//blocks, so the decrypted blocks are the frames rather than the data
+//
+//hybrid containers start with CONTAINER_HYBRID_MAGIC instead and hold a single block, the
+//session key wrapped under the RSA key, followed by the ChaCha20 encrypted payload and its
+//POLY1305_TAG_SIZE byte tag at the end of the input
+//their block count is the bytes of the payload, CONTAINER_UNKNOWN_COUNT when the writer could
+//not tell; it is left out of the tag so it can be filled in once the payload is written, and
+//checked against the payload the tag covers instead
+
+#define CONTAINER_MAGIC         "RSAB"
+#define CONTAINER_HYBRID_MAGIC  "RSAH"
+#define CONTAINER_VERSION       1
+#define CONTAINER_HEADER_SIZE   24
+#define CONTAINER_COUNT_OFFSET  16 //where the block count starts in the header
+#define CONTAINER_UNKNOWN_COUNT UINT64_MAX
+#define CONTAINER_FLAG_LZ       0x01
+
+typedef struct {
+    bool hybrid; //the blocks wrap a session key for a symmetric payload
+    uint8_t version;
+    uint8_t flags;
+    uint32_t modulus_bits;
+    uint32_t block_width;
+    uint64_t block_count;
+} container_t;
+
+void container_encode(uint8_t *buf, container_t *hdr);
+
+bool container_decode(uint8_t *buf, container_t *hdr);
+
+void container_write(FILE *outfile, container_t *hdr);
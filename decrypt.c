@@ -4,25 +4,40 @@
 #include <ctype.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include "randstate.h"
 #include "numtheory.h"
+#include "pipeline.h"
+#include "keycache.h"
 #include "rsa.h"
+#include "stats.h"
 
-#define ITEMS "i:o:n:vh"
+#define ITEMS "i:o:n:c:t:vh"
 
 char *help_message = "SYNOPSIS\n"
                      "   Decrypts data using RSA encryption.\n"
                      "   Encrypted data is encrypted by the encrypt program.\n\n"
                      "USAGE\n"
-                     "   ./decrypt [-hv] [-i infile] [-o outfile] -n privkey\n\n"
+                     "   ./decrypt [-hv] [-i infile] [-o outfile] [-c cache] [-t threads]"
+                     " -n privkey\n\n"
                      "OPTIONS\n"
                      "   -h              Display program help and usage.\n"
                      "   -v              Display verbose program output.\n"
                      "   -i infile       Input file of data to decrypt (default: stdin).\n"
                      "   -o outfile      Output file for decrypted data (default: stdout).\n"
-                     "   -n pvfile       Private key file (default: rsa.priv).\n";
+                     "   -n pvfile       Private key file (default: rsa.priv).\n"
+                     "   -c cache        Binary key cache, rebuilt when pvfile changes.\n"
+                     "   -t threads      Threads decrypting blocks (default: 1).\n"
+                     "   --stats[=file]  Print counters and phase times (default: stderr).\n";
+
+//long options, --stats takes an optional file to write the counters to
+static struct option long_options[] = {
+    { "stats", optional_argument, NULL, 'S' },
+    { NULL, 0, NULL, 0 },
+};
 
 //credit: Eugene for getopt() use
 //credit: Professor Long, asgn6.pdf
@@ -36,13 +51,23 @@ int main(int argc, char **argv) {
     FILE *pvfile = fopen("rsa.priv", "r");
 
     bool verbose = false;
+    uint64_t threads = 1;
+    bool show_stats = false;
+    char *stats_path = NULL;
+    char *cache_path = NULL;
 
-    while ((opt = getopt(argc, argv, ITEMS)) != -1) {
+    while ((opt = getopt_long(argc, argv, ITEMS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'v': verbose = true; break;
         case 'i': infile = fopen(optarg, "r"); break;
-        case 'o': outfile = fopen(optarg, "w"); break;
+        case 'o': outfile = fopen(optarg, "w+"); break;
         case 'n': pvfile = fopen(optarg, "r"); break;
+        case 'c': cache_path = optarg; break;
+        case 't': threads = pipeline_parse_threads(optarg); break;
+        case 'S':
+            show_stats = true;
+            stats_path = optarg;
+            break;
         default:
         case 'h':
             fprintf(stderr, "%s", help_message);
@@ -71,25 +96,88 @@ int main(int argc, char **argv) {
         return 0;
     }
 
+    if (threads == 0) {
+        fprintf(stderr, "ERROR: threads must be between 1 and %d\n", PIPELINE_MAX_THREADS);
+        fclose(pvfile);
+        return 0;
+    }
+
     //begin decryption-----------------------------------------------------------------------------
+    //count GMP's allocations from the start so the report covers the whole run
+    if (verbose == true) {
+        rsa_count_allocs();
+    }
+
     //read in private key file
-    mpz_t n, d;
+    mpz_t n, d, p, q, dp, dq, qinv;
     mpz_init(n); //public modulus
     mpz_init(d); //private key
+    mpz_init(p); //prime1
+    mpz_init(q); //prime2
+    mpz_init(dp); //d % (p - 1)
+    mpz_init(dq); //d % (q - 1)
+    mpz_init(qinv); //q^-1 % p
+
+    rsa_extra_t extra; //primes beyond p and q of multi-prime keys
+    rsa_extra_init(&extra);
+
+    //the CRT values are used when the key has them, everything is set up before the first block
+    //a current cache replaces parsing the key and that setup
+    rsa_ctx_t ctx;
+    bool cached = (cache_path != NULL)
+                  && keycache_load(cache_path, pvfile, true, &ctx, threads, NULL, NULL);
+    if (cached != true) {
+        //older key files only hold n and d
+        rsa_read_priv(n, d, p, q, dp, dq, qinv, &extra, pvfile);
+        rsa_ctx_init_priv(&ctx, n, d, p, q, dp, dq, qinv, &extra, threads);
+
+        if ((cache_path != NULL)
+            && (keycache_save(cache_path, pvfile, &ctx, false, NULL, NULL) != true)) {
+            fprintf(stderr, "ERROR: unable to write key cache - %d\n", errno);
+        }
+    }
 
-    rsa_read_priv(n, d, pvfile);
-
+    //verbose output goes to stderr, stdout carries the data when there is no -o
     if (verbose == true) {
-        gmp_fprintf(stdout, "n (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
-        gmp_fprintf(stdout, "d (%d bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
+        gmp_fprintf(stderr, "n (%d bits) = %Zd\n", mpz_sizeinbase(ctx.n, 2), ctx.n);
+        gmp_fprintf(stderr, "d (%d bits) = %Zd\n", mpz_sizeinbase(ctx.d, 2), ctx.d);
+        if (ctx.crt == true) {
+            gmp_fprintf(stderr, "p (%d bits) = %Zd\n", mpz_sizeinbase(ctx.p, 2), ctx.p);
+            gmp_fprintf(stderr, "q (%d bits) = %Zd\n", mpz_sizeinbase(ctx.q, 2), ctx.q);
+            for (uint64_t i = 0; i < ctx.extra.count; i++) {
+                gmp_fprintf(stderr, "r%" PRIu64 " (%d bits) = %Zd\n", i + 3,
+                    mpz_sizeinbase(ctx.extra.r[i], 2), ctx.extra.r[i]);
+            }
+        }
+        fprintf(stderr, "kernel = %s, %" PRIu64 " blocks per batch\n",
+            mbexp_name((ctx.crt == true) ? ctx.mb_p.isa : ctx.mb_n.isa), ctx.lanes);
     }
 
-    rsa_decrypt_file(infile, outfile, n, d);
+    //the exit status tells scripts whether the output can be trusted
+    int status = 0;
+    if (rsa_decrypt_file_ctx(infile, outfile, &ctx) != true) {
+        fprintf(stderr, "ERROR: input was not encrypted for this key or is damaged\n");
+        status = 1;
+    } else if (verbose == true) {
+        fprintf(stderr, "allocations after setup = %" PRIu64 " of %" PRIu64 "\n", ctx.allocs,
+            rsa_allocs());
+    }
+
+    if ((show_stats == true) && (stats_write(stats_path) != true)) {
+        fprintf(stderr, "ERROR: unable to open stats file - %d\n", errno);
+    }
 
     //delete and clear-----------------------------------------------------------------------------
+    rsa_ctx_clear(&ctx);
     mpz_clear(n);
     mpz_clear(d);
+    mpz_clear(p);
+    mpz_clear(q);
+    mpz_clear(dp);
+    mpz_clear(dq);
+    mpz_clear(qinv);
+    rsa_extra_clear(&extra);
 
     fclose(pvfile);
-    return 0;
+    return status;
 }
@@ -4,25 +4,43 @@
 #include <ctype.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include "randstate.h"
 #include "numtheory.h"
+#include "pipeline.h"
+#include "keycache.h"
 #include "rsa.h"
+#include "stats.h"
 
-#define ITEMS "i:o:n:vh"
+#define ITEMS "i:o:n:c:t:bHzvh"
 
 char *help_message = "SYNOPSIS\n"
                      "   Encrypts data using RSA encryption.\n"
                      "   Encrypted data is decrypted by the decrypt program.\n\n"
                      "USAGE\n"
-                     "   ./encrypt [-hv] [-i infile] [-o outfile] -n pubkey\n\n"
+                     "   ./encrypt [-hvbHz] [-i infile] [-o outfile] [-c cache] [-t threads]"
+                     " -n pubkey\n\n"
                      "OPTIONS\n"
                      "   -h              Display program help and usage.\n"
                      "   -v              Display verbose program output.\n"
                      "   -i infile       Input file of data to encrypt (default: stdin).\n"
                      "   -o outfile      Output file for encrypted data (default: stdout).\n"
-                     "   -n pbfile       Public key file (default: rsa.pub).\n";
+                     "   -n pbfile       Public key file (default: rsa.pub).\n"
+                     "   -c cache        Binary key cache, rebuilt when pbfile changes.\n"
+                     "   -t threads      Threads encrypting blocks (default: 1).\n"
+                     "   -b              Write a binary container instead of hex text.\n"
+                     "   -H              Hybrid: RSA wraps a session key, ChaCha20 the data.\n"
+                     "   -z              Compress the data before encrypting it, implies -b.\n"
+                     "   --stats[=file]  Print counters and phase times (default: stderr).\n";
+
+//long options, --stats takes an optional file to write the counters to
+static struct option long_options[] = {
+    { "stats", optional_argument, NULL, 'S' },
+    { NULL, 0, NULL, 0 },
+};
 
 //credit: Eugene for getopt() use
 //credit: Professor Long, asgn6.pdf
@@ -36,13 +54,32 @@ int main(int argc, char **argv) {
     FILE *pbfile = fopen("rsa.pub", "r");
 
     bool verbose = false;
-
-    while ((opt = getopt(argc, argv, ITEMS)) != -1) {
+    uint64_t threads = 1;
+    bool show_stats = false;
+    char *stats_path = NULL;
+    bool binary = false;
+    bool hybrid = false;
+    bool compress = false;
+    char *cache_path = NULL;
+
+    while ((opt = getopt_long(argc, argv, ITEMS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'v': verbose = true; break;
         case 'i': infile = fopen(optarg, "r"); break;
-        case 'o': outfile = fopen(optarg, "w"); break;
+        case 'o': outfile = fopen(optarg, "w+"); break;
         case 'n': pbfile = fopen(optarg, "r"); break;
+        case 'c': cache_path = optarg; break;
+        case 't': threads = pipeline_parse_threads(optarg); break;
+        case 'S':
+            show_stats = true;
+            stats_path = optarg;
+            break;
+        case 'b': binary = true; break;
+        case 'H': hybrid = true; break;
+        case 'z':
+            compress = true;
+            binary = true;
+            break;
         default:
         case 'h':
             fprintf(stderr, "%s", help_message);
@@ -71,7 +108,24 @@ int main(int argc, char **argv) {
         return 0;
     }
 
+    if (threads == 0) {
+        fprintf(stderr, "ERROR: threads must be between 1 and %d\n", PIPELINE_MAX_THREADS);
+        fclose(pbfile);
+        return 0;
+    }
+
+    if ((compress == true) && (hybrid == true)) {
+        fprintf(stderr, "ERROR: -z compresses block containers, not hybrid ones\n");
+        fclose(pbfile);
+        return 0;
+    }
+
     //begin encryption-----------------------------------------------------------------------------
+    //count GMP's allocations from the start so the report covers the whole run
+    if (verbose == true) {
+        rsa_count_allocs();
+    }
+
     //read in public key file
     mpz_t n, e, s;
     mpz_init(n); //sum of p and q
@@ -79,14 +133,24 @@ int main(int argc, char **argv) {
     mpz_init(s); //signature
 
     char username[256];
+    rsa_ctx_t ctx;
+
+    //a current cache replaces parsing the key, its setup and the signature check
+    bool cached = (cache_path != NULL)
+                  && keycache_load(cache_path, pbfile, false, &ctx, threads, username, s);
+    if (cached == true) {
+        mpz_set(n, ctx.n);
+        mpz_set(e, ctx.e);
+    } else {
+        rsa_read_pub(n, e, s, username, pbfile);
+    }
 
-    rsa_read_pub(n, e, s, username, pbfile);
-
+    //verbose output goes to stderr, stdout carries the data when there is no -o
     if (verbose == true) {
-        fprintf(stdout, "user = %s\n", username);
-        gmp_fprintf(stdout, "s (%d bits) = %Zd\n", mpz_sizeinbase(s, 2), s);
-        gmp_fprintf(stdout, "n (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
-        gmp_fprintf(stdout, "e (%d bits) = %Zd\n", mpz_sizeinbase(e, 2), e);
+        fprintf(stderr, "user = %s\n", username);
+        gmp_fprintf(stderr, "s (%d bits) = %Zd\n", mpz_sizeinbase(s, 2), s);
+        gmp_fprintf(stderr, "n (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
+        gmp_fprintf(stderr, "e (%d bits) = %Zd\n", mpz_sizeinbase(e, 2), e);
     }
 
     //verify username
@@ -94,16 +158,46 @@ int main(int argc, char **argv) {
     mpz_init(m); //holds raw username
     mpz_set_str(m, username, 62);
 
-    //if username could not be verified
-    if (rsa_verify(m, s, e, n) != true) {
-        fprintf(stderr, "ERROR: could not verify signature\n");
-        fclose(pbfile);
-        return 0;
+    //everything the workers need is set up once, before the first block
+    if (cached != true) {
+        rsa_ctx_init_pub(&ctx, n, e, threads);
+
+        //if username could not be verified
+        if (rsa_verify_ctx(m, s, &ctx, 0) != true) {
+            fprintf(stderr, "ERROR: could not verify signature\n");
+            rsa_ctx_clear(&ctx);
+            fclose(pbfile);
+            return 0;
+        }
+
+        if ((cache_path != NULL)
+            && (keycache_save(cache_path, pbfile, &ctx, true, username, s) != true)) {
+            fprintf(stderr, "ERROR: unable to write key cache - %d\n", errno);
+        }
     }
 
-    rsa_encrypt_file(infile, outfile, n, e);
+    if (verbose == true) {
+        fprintf(stderr, "kernel = %s, %" PRIu64 " blocks per batch\n", mbexp_name(ctx.mb_n.isa),
+            ctx.lanes);
+    }
+
+    if (hybrid != true) {
+        rsa_encrypt_file_ctx(infile, outfile, &ctx, binary, compress);
+    } else if (rsa_encrypt_file_hybrid(infile, outfile, &ctx) != true) {
+        fprintf(stderr, "ERROR: key too small for a session key or no randomness available\n");
+    }
+
+    if (verbose == true) {
+        fprintf(stderr, "allocations after setup = %" PRIu64 " of %" PRIu64 "\n", ctx.allocs,
+            rsa_allocs());
+    }
+
+    if ((show_stats == true) && (stats_write(stats_path) != true)) {
+        fprintf(stderr, "ERROR: unable to open stats file - %d\n", errno);
+    }
 
     //clears---------------------------------------------------------------------------------------
+    rsa_ctx_clear(&ctx);
     fclose(pbfile);
 
     mpz_clear(n);
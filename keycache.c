@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <gmp.h>
+
+#include "keycache.h"
+#include "mapfile.h"
+#include "numtheory.h"
+#include "rsa.h"
+#include "stats.h"
+
+//buffer a cache is put together in before it is written out
+typedef struct {
+    uint8_t *data;
+    uint64_t len, cap;
+} cache_buf_t;
+
+//position in a mapped cache, ok drops to false at the first item that does not fit
+typedef struct {
+    const uint8_t *pos, *end;
+    bool ok;
+} cache_reader_t;
+
+//appends an item of bytes bytes
+static void put_item(cache_buf_t *buf, const void *data, uint64_t bytes) {
+    uint64_t padded = (bytes + 7) & ~(uint64_t) 7;
+    if (buf->len + 8 + padded > buf->cap) {
+        buf->cap = 2 * (buf->len + 8 + padded);
+        buf->data = (uint8_t *) realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->len, &bytes, 8);
+    if (bytes > 0) {
+        memcpy(buf->data + buf->len + 8, data, bytes);
+    }
+    memset(buf->data + buf->len + 8 + bytes, 0, padded - bytes);
+    buf->len += 8 + padded;
+    return;
+}
+
+static void put_mpz(cache_buf_t *buf, mpz_t a) {
+    put_item(buf, mpz_limbs_read(a), mpz_size(a) * sizeof(mp_limb_t));
+    return;
+}
+
+//the modulus itself is already in the cache as a value
+static void put_mont(cache_buf_t *buf, mont_t *mont) {
+    put_item(buf, &mont->ninv, sizeof(mp_limb_t));
+    put_item(buf, mont->r2, mont->size * sizeof(mp_limb_t));
+    put_item(buf, mont->one, mont->size * sizeof(mp_limb_t));
+    return;
+}
+
+static void put_rec(cache_buf_t *buf, nt_recoding_t *rec) {
+    put_item(buf, &rec->limb, sizeof(mp_limb_t));
+    put_item(buf, &rec->k, sizeof(uint64_t));
+    put_item(buf, rec->windows, rec->count * sizeof(uint16_t));
+    return;
+}
+
+//takes the next item, NULL once the cache has run out
+static const uint8_t *get_item(cache_reader_t *r, uint64_t *bytes) {
+    if (!r->ok || (r->end - r->pos < 8)) {
+        r->ok = false;
+        return NULL;
+    }
+    memcpy(bytes, r->pos, 8);
+    uint64_t padded = (*bytes + 7) & ~(uint64_t) 7;
+    if ((*bytes > padded) || ((uint64_t) (r->end - r->pos) - 8 < padded)) {
+        r->ok = false;
+        return NULL;
+    }
+    const uint8_t *data = r->pos + 8;
+    r->pos += 8 + padded;
+    return data;
+}
+
+//takes the next item into want bytes at out, it has to be exactly that long
+static void get_fixed(cache_reader_t *r, void *out, uint64_t want) {
+    uint64_t bytes;
+    const uint8_t *data = get_item(r, &bytes);
+    if ((data == NULL) || (bytes != want)) {
+        r->ok = false;
+        return;
+    }
+    memcpy(out, data, want);
+    return;
+}
+
+static void get_mpz(cache_reader_t *r, mpz_t a) {
+    uint64_t bytes;
+    const uint8_t *data = get_item(r, &bytes);
+    if ((data == NULL) || (bytes % sizeof(mp_limb_t) != 0)) {
+        r->ok = false;
+        return;
+    }
+    mp_size_t size = (mp_size_t) (bytes / sizeof(mp_limb_t));
+    mp_limb_t *limbs = mpz_limbs_write(a, (size > 0) ? size : 1);
+    memcpy(limbs, data, bytes);
+    mpz_limbs_finish(a, size);
+    return;
+}
+
+//sets up the Montgomery context of modulus from its cached constants
+static void get_mont(cache_reader_t *r, mont_t *mont, mpz_t modulus) {
+    mp_size_t size = (mp_size_t) mpz_size(modulus);
+    mont_alloc(mont, (size > 0) ? size : 1);
+    mont->size = size;
+    if (size > 0) {
+        mpn_copyi(mont->n, mpz_limbs_read(modulus), size);
+    }
+    get_fixed(r, &mont->ninv, sizeof(mp_limb_t));
+    get_fixed(r, mont->r2, size * sizeof(mp_limb_t));
+    get_fixed(r, mont->one, size * sizeof(mp_limb_t));
+    r->ok = r->ok && (size > 0) && mpz_odd_p(modulus);
+    return;
+}
+
+//reads a recoding back, its windows are checked so a damaged cache cannot index past the
+//odd-power table: k has to be the width nt_recode picks for the exponent the windows spell
+//out, so it never exceeds NT_MAX_WINDOW, and no window is wider than k
+static void get_rec(cache_reader_t *r, nt_recoding_t *rec) {
+    rec->windows = NULL;
+    rec->count = 0;
+    get_fixed(r, &rec->limb, sizeof(mp_limb_t));
+    get_fixed(r, &rec->k, sizeof(uint64_t));
+    uint64_t bytes;
+    const uint8_t *data = get_item(r, &bytes);
+    if ((data == NULL) || (bytes % sizeof(uint16_t) != 0) || (rec->k < 1)
+        || (rec->k > NT_MAX_WINDOW)) {
+        r->ok = false;
+        return;
+    }
+    if (bytes == 0) {
+        r->ok = r->ok && (rec->k == 1);
+        return;
+    }
+    rec->count = bytes / sizeof(uint16_t);
+    rec->windows = (uint16_t *) malloc(bytes);
+    memcpy(rec->windows, data, bytes);
+    uint64_t bits = 0;
+    for (uint64_t i = 0; i < rec->count; i++) {
+        uint64_t w = rec->windows[i] >> 8;
+        uint64_t value = rec->windows[i] & 0xFF;
+        if ((w < 1) || (w > rec->k) || (value >> w != 0) || ((i == 0) && (value == 0))) {
+            r->ok = false;
+        }
+        bits += w;
+    }
+    r->ok = r->ok && (rec->k == nt_window_bits(bits));
+    return;
+}
+
+//FNV-1a of the header, its checksum left out, and the items that follow it
+static uint64_t cache_checksum(const keycache_header_t *hdr, const uint8_t *items) {
+    keycache_header_t copy = *hdr;
+    copy.checksum = 0;
+    uint64_t h = 14695981039346656037ull;
+    const uint8_t *bytes = (const uint8_t *) &copy;
+    for (uint64_t i = 0; i < sizeof(copy); i++) {
+        h = (h ^ bytes[i]) * 1099511628211ull;
+    }
+    for (uint64_t i = 0; i < hdr->items; i++) {
+        h = (h ^ items[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+//fills in the identity of KEYFILE, false if it cannot be stat'ed
+static bool key_identity(FILE *keyfile, keycache_header_t *hdr) {
+    struct stat st;
+    if (fstat(fileno(keyfile), &st) != 0) {
+        return false;
+    }
+    hdr->dev = (uint64_t) st.st_dev;
+    hdr->ino = (uint64_t) st.st_ino;
+    hdr->size = (uint64_t) st.st_size;
+    hdr->mtime_sec = (int64_t) st.st_mtim.tv_sec;
+    hdr->mtime_nsec = (int64_t) st.st_mtim.tv_nsec;
+    return true;
+}
+
+//checks a mapped header against the running build and the key file it has to come from
+static bool header_valid(keycache_header_t *hdr, FILE *keyfile, bool priv) {
+    keycache_header_t key;
+    if (!key_identity(keyfile, &key)) {
+        return false;
+    }
+    uint32_t kind = hdr->flags & (KEYCACHE_PRIVATE | KEYCACHE_VERIFIED);
+    bool flags = priv ? ((kind & KEYCACHE_PRIVATE) != 0) : (kind == KEYCACHE_VERIFIED);
+    return (memcmp(hdr->magic, KEYCACHE_MAGIC, 4) == 0) && (hdr->version == KEYCACHE_VERSION)
+           && (hdr->limb_bits == GMP_NUMB_BITS) && flags && (hdr->dev == key.dev)
+           && (hdr->ino == key.ino) && (hdr->size == key.size)
+           && (hdr->mtime_sec == key.mtime_sec) && (hdr->mtime_nsec == key.mtime_nsec)
+           && (hdr->extra <= RSA_MAX_PRIMES - 2) && (memchr(hdr->username, '\0', 256) != NULL);
+}
+
+//sets up ctx for up to workers threads from the cache at path, made from KEYFILE
+//priv asks for a private key, a public one is only taken when its signature was verified
+//username and s get the owner and signature of a public key, both may be NULL
+//returns false, with ctx untouched, if there is no cache or it is stale or damaged
+bool keycache_load(const char *path, FILE *keyfile, bool priv, rsa_ctx_t *ctx, uint64_t workers,
+    char username[], mpz_t s) {
+    uint64_t start = stats_now();
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    mapfile_t map;
+    bool mapped = mapfile_open_read(file, &map);
+    fclose(file);
+    if (!mapped) {
+        return false;
+    }
+    keycache_header_t hdr;
+    if (map.size >= sizeof(hdr)) {
+        memcpy(&hdr, map.base, sizeof(hdr));
+    }
+    if ((map.size < sizeof(hdr)) || !header_valid(&hdr, keyfile, priv)
+        || (hdr.items != map.size - sizeof(hdr))
+        || (hdr.checksum != cache_checksum(&hdr, map.base + sizeof(hdr)))) {
+        mapfile_close(&map);
+        return false;
+    }
+
+    //everything starts out empty so a damaged cache can be dropped with rsa_ctx_clear
+    memset(ctx, 0, sizeof(*ctx));
+    mpz_init(ctx->n);
+    mpz_init(ctx->e);
+    mpz_init(ctx->d);
+    mpz_init(ctx->p);
+    mpz_init(ctx->q);
+    mpz_init(ctx->dp);
+    mpz_init(ctx->dq);
+    mpz_init(ctx->qinv);
+    rsa_extra_init(&ctx->extra);
+    mpz_t sig;
+    mpz_init(sig);
+
+    cache_reader_t r = { map.base + sizeof(hdr), map.base + map.size, true };
+    get_mpz(&r, ctx->n);
+    get_mpz(&r, ctx->e);
+    get_mpz(&r, sig);
+    get_mpz(&r, ctx->d);
+    get_mpz(&r, ctx->p);
+    get_mpz(&r, ctx->q);
+    get_mpz(&r, ctx->dp);
+    get_mpz(&r, ctx->dq);
+    get_mpz(&r, ctx->qinv);
+    for (uint64_t i = 0; i < hdr.extra; i++) {
+        get_mpz(&r, ctx->extra.r[i]);
+        get_mpz(&r, ctx->extra.d[i]);
+        get_mpz(&r, ctx->extra.t[i]);
+    }
+
+    get_mont(&r, &ctx->mont_n, ctx->n);
+    ctx->crt = ((hdr.flags & KEYCACHE_CRT) != 0);
+    if (ctx->crt) {
+        get_mont(&r, &ctx->mont_p, ctx->p);
+        get_mont(&r, &ctx->mont_q, ctx->q);
+        for (uint64_t i = 0; i < hdr.extra; i++) {
+            get_mont(&r, &ctx->mont_r[i], ctx->extra.r[i]);
+            ctx->extra.count++;
+        }
+    }
+
+    get_rec(&r, &ctx->rec_e);
+    get_rec(&r, &ctx->rec_d);
+    for (uint64_t i = 0; i < RSA_MAX_PRIMES; i++) {
+        get_rec(&r, &ctx->rec_crt[i]);
+    }
+    mapfile_close(&map);
+
+    if (!r.ok) {
+        rsa_ctx_clear(ctx);
+        mpz_clear(sig);
+        return false;
+    }
+
+    ctx->workers = (workers > 1) ? workers : 1;
+    ctx->scratch = (nt_ctx_t *) malloc(ctx->workers * sizeof(nt_ctx_t));
+    for (uint64_t i = 0; i < ctx->workers; i++) {
+        nt_ctx_init(&ctx->scratch[i], mpz_sizeinbase(ctx->n, 2));
+    }
+    rsa_ctx_batch(ctx);
+    if (username != NULL) {
+        strcpy(username, hdr.username);
+    }
+    if (s != NULL) {
+        mpz_set(s, sig);
+    }
+    mpz_clear(sig);
+    stats_phase(STATS_KEY_LOAD, start);
+    return true;
+}
+
+//writes the key in ctx, made from KEYFILE, to the cache at path
+//verified records that the signature s of a public key owned by username checked out, both
+//are NULL for private keys
+//the cache is written next to path and renamed over it, so readers never see half of one
+//returns false if it could not be written
+bool keycache_save(
+    const char *path, FILE *keyfile, rsa_ctx_t *ctx, bool verified, char username[], mpz_t s) {
+    keycache_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    if (!key_identity(keyfile, &hdr)) {
+        return false;
+    }
+    memcpy(hdr.magic, KEYCACHE_MAGIC, 4);
+    hdr.version = KEYCACHE_VERSION;
+    hdr.limb_bits = GMP_NUMB_BITS;
+    hdr.flags = (username == NULL) ? KEYCACHE_PRIVATE : 0;
+    hdr.flags |= verified ? KEYCACHE_VERIFIED : 0;
+    hdr.flags |= ctx->crt ? KEYCACHE_CRT : 0;
+    hdr.extra = ctx->extra.count;
+    if (username != NULL) {
+        strncpy(hdr.username, username, sizeof(hdr.username) - 1);
+    }
+
+    cache_buf_t buf = { NULL, 0, 0 };
+    mpz_t zero;
+    mpz_init(zero);
+    put_mpz(&buf, ctx->n);
+    put_mpz(&buf, ctx->e);
+    put_mpz(&buf, (s != NULL) ? s : zero);
+    put_mpz(&buf, ctx->d);
+    put_mpz(&buf, ctx->p);
+    put_mpz(&buf, ctx->q);
+    put_mpz(&buf, ctx->dp);
+    put_mpz(&buf, ctx->dq);
+    put_mpz(&buf, ctx->qinv);
+    for (uint64_t i = 0; i < ctx->extra.count; i++) {
+        put_mpz(&buf, ctx->extra.r[i]);
+        put_mpz(&buf, ctx->extra.d[i]);
+        put_mpz(&buf, ctx->extra.t[i]);
+    }
+    mpz_clear(zero);
+
+    put_mont(&buf, &ctx->mont_n);
+    if (ctx->crt) {
+        put_mont(&buf, &ctx->mont_p);
+        put_mont(&buf, &ctx->mont_q);
+        for (uint64_t i = 0; i < ctx->extra.count; i++) {
+            put_mont(&buf, &ctx->mont_r[i]);
+        }
+    }
+
+    put_rec(&buf, &ctx->rec_e);
+    put_rec(&buf, &ctx->rec_d);
+    for (uint64_t i = 0; i < RSA_MAX_PRIMES; i++) {
+        put_rec(&buf, &ctx->rec_crt[i]);
+    }
+
+    hdr.items = buf.len;
+    hdr.checksum = cache_checksum(&hdr, buf.data);
+
+    char *tmp = (char *) malloc(strlen(path) + 32);
+    sprintf(tmp, "%s.%ld.tmp", path, (long) getpid());
+
+    //a private cache holds the whole key, so like the key file only its owner may read it,
+    //from the moment it is created
+    mode_t mode = (username == NULL) ? 0600 : 0666;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    FILE *file = (fd != -1) ? fdopen(fd, "w") : NULL;
+    if ((fd != -1) && (file == NULL)) {
+        close(fd);
+    }
+    bool saved = (file != NULL) && (fwrite(&hdr, sizeof(hdr), 1, file) == 1)
+                 && (fwrite(buf.data, 1, buf.len, file) == buf.len);
+    if (file != NULL) {
+        saved = (fclose(file) == 0) && saved;
+    }
+    saved = saved && (rename(tmp, path) == 0);
+    if (!saved) {
+        unlink(tmp);
+    }
+    free(tmp);
+    free(buf.data);
+    return saved;
+}
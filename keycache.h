@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#include "rsa.h"
+
+//binary key cache
+//a key context written out once its setup is done: the key values as limbs, the Montgomery
+//constants of its moduli and its recoded exponents, so a tool loads it with one mmap and a few
+//copies instead of parsing hex and redoing that work
+//the cache records the device, inode, size and modification time of the key file it was made
+//from and is ignored as soon as any of them changes
+//it is native endian with native limbs, meant for the machine that wrote it
+//a checksum over the header and the items catches a cache damaged after it was written, which
+//would otherwise go straight into the exponentiations
+//
+//layout: a keycache_header_t, then items of a uint64_t byte count followed by that many bytes
+//padded to 8, in this order:
+//  n, e, s, d, p, q, dp, dq, qinv, then r, d and t of each extra prime, as limbs
+//  ninv, R^2 % n and R % n of n, then of p, q and each extra prime for CRT keys
+//  limb, k and windows of the recodings of e, d, dp, dq and the extra primes' exponents
+
+#define KEYCACHE_MAGIC   "RSAK"
+#define KEYCACHE_VERSION 2
+
+#define KEYCACHE_PRIVATE  1 //a private key, otherwise a public key
+#define KEYCACHE_VERIFIED 2 //the signature of the public key checked out before it was cached
+#define KEYCACHE_CRT      4 //the private key has CRT values
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t limb_bits; //GMP_NUMB_BITS of the writer
+    uint32_t flags;
+    uint64_t dev, ino, size; //identity of the key file the cache was made from
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t extra; //primes beyond p and q
+    char username[256]; //owner of a public key
+    uint64_t items; //bytes of items after the header
+    uint64_t checksum; //FNV-1a of the header, with this field 0, and the items
+} keycache_header_t;
+
+bool keycache_load(const char *path, FILE *keyfile, bool priv, rsa_ctx_t *ctx, uint64_t workers,
+    char username[], mpz_t s);
+
+bool keycache_save(
+    const char *path, FILE *keyfile, rsa_ctx_t *ctx, bool verified, char username[], mpz_t s);
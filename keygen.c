@@ -1,32 +1,294 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <gmp.h>
+#include <inttypes.h>
 #include <time.h>
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <getopt.h>
 
+#include "pipeline.h"
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "stats.h"
 
-#define ITEMS "b:i:n:d:s:vh"
+#define ITEMS "b:i:e:k:n:d:p:u:o:B:s:t:vh"
 
 char *help_message
     = "SYNOPSIS\n"
-      "   Generates an RSA public/private key pair.\n\n"
+      "   Generates an RSA public/private key pair, or one for every user in a list.\n\n"
       "USAGE\n"
-      "   ./keygen [-hv] [-b bits] -n pbfile -d pvfile\n\n"
+      "   ./keygen [-hv] [-b bits] [-e exponent] [-k primes] [-t threads] [-p poolfile]\n"
+      "            -n pbfile -d pvfile\n"
+      "   ./keygen [-hv] [-b bits] [-e exponent] [-k primes] [-t threads] [-p poolfile]\n"
+      "            -u userlist [-o outdir | -B bundle]\n\n"
       "OPTIONS\n"
       "   -h              Display program help and usage.\n"
       "   -v              Display verbose program output.\n"
       "   -b bits         Minimum bits needed for public key n (default: 256).\n"
-      "   -i confidence   Miller-Rabin iterations for testing primes (default: 50).\n"
+      "   -i confidence   Primes are wrong with odds below 4^-confidence (default: 50).\n"
+      "   -e exponent     Odd public exponent of at least 65537, 0 for random (default: 65537).\n"
+      "   -k primes       Primes in the modulus, 2 to 4 (default: 2).\n"
       "   -n pbfile       Public key file (default: rsa.pub).\n"
       "   -d pvfile       Private key file (default: rsa.priv).\n"
-      "   -s seed         Random seed for testing.\n";
+      "   -p poolfile     Prime pool to take the primes from, searched for once it runs out.\n"
+      "   -u userlist     Make a key pair for every username in userlist, one per line.\n"
+      "   -o outdir       Directory for the user.pub and user.priv files of -u (default: .).\n"
+      "   -B bundle       Write every key pair of -u to the one file bundle instead.\n"
+      "   -s seed         Random seed for testing.\n"
+      "   -t threads      Threads searching for the primes, or making keys with -u (default: 1).\n"
+      "   --stats[=file]  Print counters and phase times (default: stderr).\n";
+
+//long options, --stats takes an optional file to write the counters to
+static struct option long_options[] = {
+    { "stats", optional_argument, NULL, 'S' },
+    { NULL, 0, NULL, 0 },
+};
+
+//options every key pair is made with
+typedef struct {
+    uint64_t modulus_bits, iters, pub_exp, primes;
+    char *pool_path;
+} keygen_opts_t;
+
+//one key pair and its signature
+typedef struct {
+    mpz_t p, q, n, e, s, d, dp, dq, qinv;
+    mpz_t m; //holds the raw username
+    rsa_extra_t extra; //primes beyond p and q
+} keypair_t;
+
+static void keypair_init(keypair_t *k, uint64_t primes) {
+    mpz_init(k->p); //prime1
+    mpz_init(k->q); //prime2
+    mpz_init(k->n); //product of the primes
+    mpz_init(k->e); //public exponent
+    mpz_init(k->s); //signature
+    mpz_init(k->d); //private key
+    mpz_init(k->dp); //d % (p - 1)
+    mpz_init(k->dq); //d % (q - 1)
+    mpz_init(k->qinv); //q^-1 % p
+    mpz_init(k->m);
+    rsa_extra_init(&k->extra);
+    k->extra.count = primes - 2;
+    return;
+}
+
+static void keypair_clear(keypair_t *k) {
+    mpz_clear(k->p);
+    mpz_clear(k->q);
+    mpz_clear(k->n);
+    mpz_clear(k->e);
+    mpz_clear(k->s);
+    mpz_clear(k->d);
+    mpz_clear(k->dp);
+    mpz_clear(k->dq);
+    mpz_clear(k->qinv);
+    mpz_clear(k->m);
+    rsa_extra_clear(&k->extra);
+    return;
+}
+
+//makes a key pair signed with username, every random number comes from st
+//threads workers search for the primes
+//returns false if username is not a base-62 number between 0 and n, which would leave the key
+//with a signature of 0 or one that does not verify
+static bool keypair_make(
+    keypair_t *k, keygen_opts_t *o, char *username, uint64_t threads, gmp_randstate_t st) {
+    rsa_make_pub_pool(k->p, k->q, &k->extra, k->n, k->e, o->modulus_bits, o->iters, o->pub_exp,
+        threads, o->pool_path, st);
+    rsa_make_priv(k->d, k->e, k->p, k->q, &k->extra);
+    rsa_make_crt(k->dp, k->dq, k->qinv, k->d, k->p, k->q, &k->extra);
+    if ((mpz_set_str(k->m, username, 62) != 0) || (mpz_sgn(k->m) == 0)
+        || (mpz_cmp(k->m, k->n) >= 0)) {
+        return false;
+    }
+    rsa_sign_crt(k->s, k->m, k->p, k->q, k->dp, k->dq, k->qinv, &k->extra);
+    return true;
+}
+
+//batch mode--------------------------------------------------------------------------------------
+
+//one user of the list in flight
+typedef struct {
+    char username[256];
+    gmp_randstate_t st; //split off the seeded state in list order
+    keypair_t key;
+    bool made; //the username could be signed
+    char *pub, *priv; //contents of the key files
+    size_t pub_len, priv_len;
+} batch_slot_t;
+
+//everything the batch pipeline stages share
+typedef struct {
+    FILE *users;
+    keygen_opts_t *opts;
+    char *outdir; //directory of the per-user files, NULL when writing a bundle
+    FILE *bundle;
+    char *line; //getline buffer
+    size_t line_cap;
+    uint64_t line_no;
+    uint64_t made; //key pairs written
+    uint64_t failed; //names skipped and key files that could not be written
+    batch_slot_t *slots;
+} batch_job_t;
+
+//a username is signed as a base-62 number, so it may only hold letters and digits, which
+//also keeps it a plain file name, and must not be 0 or too long for a public key file
+static bool valid_username(const char *name) {
+    size_t len = strlen(name);
+    if ((len == 0) || (len > 255) || (strspn(name, "0") == len)) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char) name[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//reader stage, takes the next username and splits a random state off for it
+//blank lines are skipped, names that do not pass valid_username are reported and skipped
+static bool batch_read(void *arg, uint64_t slot) {
+    batch_job_t *job = (batch_job_t *) arg;
+    batch_slot_t *s = &job->slots[slot];
+    ssize_t len;
+    while ((len = getline(&job->line, &job->line_cap, job->users)) != -1) {
+        job->line_no++;
+        while ((len > 0) && isspace((unsigned char) job->line[len - 1])) {
+            job->line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (!valid_username(job->line)) {
+            fprintf(stderr, "ERROR: invalid username on line %" PRIu64 "\n", job->line_no);
+            job->failed++;
+            continue;
+        }
+        strcpy(s->username, job->line);
+        randstate_split(s->st, state);
+        return true;
+    }
+    return false;
+}
+
+//renders the key files into memory so the writer only copies them out
+static void batch_render(batch_slot_t *s) {
+    keypair_t *k = &s->key;
+    FILE *pub = open_memstream(&s->pub, &s->pub_len);
+    rsa_write_pub(k->n, k->e, k->s, s->username, pub);
+    fclose(pub);
+    FILE *priv = open_memstream(&s->priv, &s->priv_len);
+    rsa_write_priv(k->n, k->d, k->p, k->q, k->dp, k->dq, k->qinv, &k->extra, priv);
+    fclose(priv);
+    return;
+}
+
+//worker stage, makes one user's key pair, its primes are searched for on this thread alone
+static void batch_work(void *arg, uint64_t slot, uint64_t worker) {
+    batch_job_t *job = (batch_job_t *) arg;
+    batch_slot_t *s = &job->slots[slot];
+    (void) worker;
+    s->made = keypair_make(&s->key, job->opts, s->username, 1, s->st);
+    if (s->made) {
+        batch_render(s);
+    }
+    return;
+}
+
+//writes size bytes of data to path, owner only when private is set
+static bool write_key_file(const char *path, const char *data, size_t size, bool private) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = !private || (fchmod(fileno(file), 0600) == 0);
+    ok = ok && (fwrite(data, 1, size, file) == size);
+    return (fclose(file) == 0) && ok;
+}
+
+//writer stage, writes the key pairs out in list order
+static void batch_write(void *arg, uint64_t slot) {
+    batch_job_t *job = (batch_job_t *) arg;
+    batch_slot_t *s = &job->slots[slot];
+    if (!s->made) {
+        fprintf(stderr, "ERROR: username %s cannot be signed with its key\n", s->username);
+        job->failed++;
+        gmp_randclear(s->st);
+        return;
+    }
+    bool ok = true;
+    if (job->bundle != NULL) {
+        ok = (fwrite(s->pub, 1, s->pub_len, job->bundle) == s->pub_len)
+             && (fwrite(s->priv, 1, s->priv_len, job->bundle) == s->priv_len);
+    } else {
+        size_t size = strlen(job->outdir) + strlen(s->username) + 7;
+        char *path = (char *) malloc(size);
+        snprintf(path, size, "%s/%s.pub", job->outdir, s->username);
+        ok = write_key_file(path, s->pub, s->pub_len, false);
+        snprintf(path, size, "%s/%s.priv", job->outdir, s->username);
+        ok = ok && write_key_file(path, s->priv, s->priv_len, true);
+        free(path);
+    }
+    if (ok) {
+        job->made++;
+    } else {
+        fprintf(stderr, "ERROR: unable to write key pair of %s - %d\n", s->username, errno);
+        job->failed++;
+    }
+    explicit_bzero(s->priv, s->priv_len);
+    free(s->pub);
+    free(s->priv);
+    gmp_randclear(s->st);
+    return;
+}
+
+//makes a key pair for every username in users on threads workers
+//each user gets a random state split off the seeded one in list order, so the keys only
+//depend on the seed and the list, not on the thread count
+//returns the number of names skipped or pairs not written
+static uint64_t batch_run(FILE *users, keygen_opts_t *opts, char *outdir, FILE *bundle,
+    uint64_t threads, bool verbose) {
+    batch_job_t job;
+    job.users = users;
+    job.opts = opts;
+    job.outdir = outdir;
+    job.bundle = bundle;
+    job.line = NULL;
+    job.line_cap = 0;
+    job.line_no = 0;
+    job.made = 0;
+    job.failed = 0;
+
+    uint64_t depth = 2 * threads;
+    job.slots = (batch_slot_t *) malloc(depth * sizeof(batch_slot_t));
+    for (uint64_t i = 0; i < depth; i++) {
+        keypair_init(&job.slots[i].key, opts->primes);
+    }
+
+    uint64_t start = stats_now();
+    pipeline_run(threads, depth, batch_read, batch_work, batch_write, &job);
+    double seconds = (double) (stats_now() - start) / 1e9;
+
+    fprintf(stdout, "%" PRIu64 " key pairs in %.3f s, %.2f keys/s\n", job.made, seconds,
+        (seconds > 0) ? (double) job.made / seconds : 0.0);
+    if (verbose == true) {
+        fprintf(stdout, "%" PRIu64 " usernames skipped or not written\n", job.failed);
+    }
+
+    for (uint64_t i = 0; i < depth; i++) {
+        keypair_clear(&job.slots[i].key);
+    }
+    free(job.slots);
+    free(job.line);
+    return job.failed;
+}
 
 //credit: Eugene for getopt() use
 //credit: Professor Long, asgn6.pdf
@@ -35,53 +297,137 @@ int main(int argc, char **argv) {
     int opt = 0;
 
     //default output files for private and public keys
-    FILE *pub_file = fopen("rsa.pub", "w");
-    FILE *priv_file = fopen("rsa.priv", "w");
+    char *pub_path = "rsa.pub";
+    char *priv_path = "rsa.priv";
 
     //default options for other flags
-    uint64_t modulus_bits = 256;
+    keygen_opts_t opts;
+    opts.modulus_bits = 256;
+    opts.iters = 50;
+    opts.pub_exp = 65537;
+    opts.primes = 2;
+    opts.pool_path = NULL;
     bool verbose = false;
-    uint64_t iters = 50;
+    uint64_t threads = 1;
     uint64_t seed = time(NULL);
+    char *users_path = NULL;
+    char *outdir = ".";
+    char *bundle_path = NULL;
+    bool show_stats = false;
+    char *stats_path = NULL;
 
-    while ((opt = getopt(argc, argv, ITEMS)) != -1) {
+    while ((opt = getopt_long(argc, argv, ITEMS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'b': //sets the modulus_bits
-            modulus_bits = (uint64_t) atoi(optarg);
+            opts.modulus_bits = (uint64_t) atoi(optarg);
             break;
         case 'i': //sets the iter
-            iters = (uint64_t) atoi(optarg);
+            opts.iters = (uint64_t) atoi(optarg);
+            break;
+        case 'e': //sets the public exponent
+            opts.pub_exp = (uint64_t) strtoull(optarg, NULL, 10);
             break;
-        case 'n': pub_file = fopen(optarg, "w"); break;
-        case 'd': priv_file = fopen(optarg, "w"); break;
+        case 'k': //sets the number of primes in the modulus
+            opts.primes = (uint64_t) atoi(optarg);
+            break;
+        case 'n': pub_path = optarg; break;
+        case 'd': priv_path = optarg; break;
+        case 'p': opts.pool_path = optarg; break;
+        case 'u': users_path = optarg; break;
+        case 'o': outdir = optarg; break;
+        case 'B': bundle_path = optarg; break;
         case 's': //sets the seed
             seed = (uint64_t) atoi(optarg);
             break;
+        case 't': //sets the number of prime search threads
+            threads = pipeline_parse_threads(optarg);
+            break;
         case 'v': //enables verbose printing
             verbose = true;
             break;
+        case 'S': //prints the performance counters at the end
+            show_stats = true;
+            stats_path = optarg;
+            break;
         default:
         case 'h': //default and 'h' case print the help message and close the program
             fprintf(stderr, "%s", help_message);
-            fclose(pub_file);
-            fclose(priv_file);
             return 0;
         }
     }
 
+    //a fixed exponent has to be odd to ever be coprime with the totient
+    //blocks only carry one byte of padding, so m^e of a short block with a small e stays below n
+    //and gives m away to an integer root, with 65537 every padded block wraps around n
+    if ((opts.pub_exp != 0) && ((opts.pub_exp < 65537) || (opts.pub_exp % 2 == 0))) {
+        fprintf(stderr, "ERROR: public exponent must be odd and at least 65537\n");
+        return 0;
+    }
+
+    //every prime beyond p and q makes the private key operations cheaper, up to a point
+    if ((opts.primes < 2) || (opts.primes > RSA_MAX_PRIMES)) {
+        fprintf(stderr, "ERROR: number of primes must be between 2 and %d\n", RSA_MAX_PRIMES);
+        return 0;
+    }
+
+    if (threads == 0) {
+        fprintf(stderr, "ERROR: threads must be between 1 and %d\n", PIPELINE_MAX_THREADS);
+        return 0;
+    }
+
+    //batch mode-----------------------------------------------------------------------------------
+    if (users_path != NULL) {
+        FILE *users = fopen(users_path, "r");
+        if (users == NULL) {
+            fprintf(stderr, "ERROR: unable to open user list - %d\n", errno);
+            return 0;
+        }
+        FILE *bundle = NULL;
+        if (bundle_path != NULL) {
+            bundle = fopen(bundle_path, "w");
+            if ((bundle == NULL) || (fchmod(fileno(bundle), 0600) == -1)) {
+                fprintf(stderr, "ERROR: unable to open bundle file - %d\n", errno);
+                fclose(users);
+                if (bundle != NULL) {
+                    fclose(bundle);
+                }
+                return 0;
+            }
+        }
+
+        randstate_init(seed);
+        batch_run(users, &opts, (bundle == NULL) ? outdir : NULL, bundle, threads, verbose);
+        randstate_clear();
+
+        if ((show_stats == true) && (stats_write(stats_path) != true)) {
+            fprintf(stderr, "ERROR: unable to open stats file - %d\n", errno);
+        }
+        fclose(users);
+        if ((bundle != NULL) && (fclose(bundle) != 0)) {
+            fprintf(stderr, "ERROR: unable to write bundle file - %d\n", errno);
+        }
+        return 0;
+    }
+
+    //the key is signed with the name of the user running keygen
+    char *username = getenv("USER");
+    if ((username == NULL) || !valid_username(username)) {
+        fprintf(stderr, "ERROR: USER has to be a username of letters and digits\n");
+        return 0;
+    }
+
     //begin check of output files------------------------------------------------------------------
 
+    FILE *pub_file = fopen(pub_path, "w");
     if (pub_file == NULL) {
         fprintf(stderr, "ERROR: unable to open public key file - %d\n", errno);
-        fclose(pub_file);
-        fclose(priv_file);
         return 0;
     }
 
+    FILE *priv_file = fopen(priv_path, "w");
     if (priv_file == NULL) {
         fprintf(stderr, "ERROR: unable to open private key file - %d\n", errno);
         fclose(pub_file);
-        fclose(priv_file);
         return 0;
     }
 
@@ -97,42 +443,44 @@ int main(int argc, char **argv) {
     //initialize randstate with value seed
     randstate_init(seed);
 
-    //initializing of mpz_t for public key
-    mpz_t p, q, n, e, s;
-    mpz_init(p); //prime1
-    mpz_init(q); //prime2
-    mpz_init(n); //product of prime1 and prime2
-    mpz_init(e); //public exponent
-    mpz_init(s); //signature
-
-    //creation of public key
-    rsa_make_pub(p, q, n, e, modulus_bits, iters);
-
-    //creation of private key
-    mpz_t d; //private key
-    mpz_init(d);
-    rsa_make_priv(d, e, p, q);
-
-    //creation of signature
-    mpz_t m; //holds the raw username
-    mpz_init(m);
-    char *username = getenv("USER");
-    mpz_set_str(m, username, 62);
-    rsa_sign(s, m, d, n);
+    //creation of the public key, private key, its CRT values and the signature
+    keypair_t key;
+    keypair_init(&key, opts.primes);
+    if (keypair_make(&key, &opts, username, threads, state) != true) {
+        fprintf(stderr, "ERROR: username %s cannot be signed with its key\n", username);
+        fclose(pub_file);
+        fclose(priv_file);
+        randstate_clear();
+        keypair_clear(&key);
+        return 0;
+    }
 
     //writing of keys and verbose output-----------------------------------------------------------
     //writing of keys
-    rsa_write_pub(n, e, s, username, pub_file);
-    rsa_write_priv(n, d, priv_file);
+    rsa_write_pub(key.n, key.e, key.s, username, pub_file);
+    rsa_write_priv(key.n, key.d, key.p, key.q, key.dp, key.dq, key.qinv, &key.extra, priv_file);
 
     if (verbose == true) {
         fprintf(stdout, "user = %s\n", username);
-        gmp_fprintf(stdout, "s (%d bits) = %Zd\n", mpz_sizeinbase(s, 2), s);
-        gmp_fprintf(stdout, "p (%d bits) = %Zd\n", mpz_sizeinbase(p, 2), p);
-        gmp_fprintf(stdout, "q (%d bits) = %Zd\n", mpz_sizeinbase(q, 2), q);
-        gmp_fprintf(stdout, "n (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
-        gmp_fprintf(stdout, "e (%d bits) = %Zd\n", mpz_sizeinbase(e, 2), e);
-        gmp_fprintf(stdout, "d (%d bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
+        gmp_fprintf(stdout, "s (%d bits) = %Zd\n", mpz_sizeinbase(key.s, 2), key.s);
+        gmp_fprintf(stdout, "p (%d bits) = %Zd\n", mpz_sizeinbase(key.p, 2), key.p);
+        gmp_fprintf(stdout, "q (%d bits) = %Zd\n", mpz_sizeinbase(key.q, 2), key.q);
+        for (uint64_t i = 0; i < key.extra.count; i++) {
+            gmp_fprintf(stdout, "r%" PRIu64 " (%d bits) = %Zd\n", i + 3,
+                mpz_sizeinbase(key.extra.r[i], 2), key.extra.r[i]);
+        }
+        gmp_fprintf(stdout, "n (%d bits) = %Zd\n", mpz_sizeinbase(key.n, 2), key.n);
+        gmp_fprintf(stdout, "e (%d bits) = %Zd\n", mpz_sizeinbase(key.e, 2), key.e);
+        gmp_fprintf(stdout, "d (%d bits) = %Zd\n", mpz_sizeinbase(key.d, 2), key.d);
+        fprintf(stdout,
+            "prime search: %" PRIu64 " candidates, %" PRIu64 " sieved, %" PRIu64
+            " failed testing, %" PRIu64 " restarts, %" PRIu64 " primes, %" PRIu64 " pooled\n",
+            (uint64_t) stats.candidates, (uint64_t) stats.sieved, (uint64_t) stats.mr_rejected,
+            (uint64_t) stats.restarts, (uint64_t) stats.found, (uint64_t) stats.pooled);
+    }
+
+    if ((show_stats == true) && (stats_write(stats_path) != true)) {
+        fprintf(stderr, "ERROR: unable to open stats file - %d\n", errno);
     }
 
     //closing and clearing-------------------------------------------------------------------------
@@ -140,14 +488,7 @@ int main(int argc, char **argv) {
     fclose(priv_file);
 
     randstate_clear();
-
-    mpz_clear(p);
-    mpz_clear(q);
-    mpz_clear(n);
-    mpz_clear(e);
-    mpz_clear(s);
-    mpz_clear(d);
-    mpz_clear(m);
+    keypair_clear(&key);
 
     return 0;
 }
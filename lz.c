@@ -0,0 +1,209 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+//longest back reference offset, the 2 offset bytes
+#define LZ_MAX_OFFSET 65535
+
+//stores the low 3 bytes of value big-endian in buf
+static void put_be24(uint8_t *buf, uint64_t value) {
+    buf[0] = (uint8_t) (value >> 16);
+    buf[1] = (uint8_t) (value >> 8);
+    buf[2] = (uint8_t) value;
+    return;
+}
+
+//reads a 3 byte big-endian value from buf
+static uint64_t get_be24(const uint8_t *buf) {
+    return ((uint64_t) buf[0] << 16) | ((uint64_t) buf[1] << 8) | buf[2];
+}
+
+//the 4 bytes at p as one word, in whatever order the machine keeps them
+static uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+//hash table slot of the 4 bytes at p
+static uint32_t hash4(const uint8_t *p) {
+    return (load32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+//bytes a length takes beyond its token nibble
+static uint64_t length_bytes(uint64_t n) {
+    return (n < 15) ? 0 : (n - 15) / 255 + 1;
+}
+
+//writes the part of length n beyond its token nibble at out, returns the new end
+static uint8_t *put_length(uint8_t *out, uint64_t n) {
+    if (n < 15) {
+        return out;
+    }
+    for (n -= 15; n >= 255; n -= 255) {
+        *out++ = 255;
+    }
+    *out++ = (uint8_t) n;
+    return out;
+}
+
+//reads the part of a length beyond its token nibble from *in, adding it to *n
+//returns false if it runs past end or beyond a frame
+static bool get_length(const uint8_t **in, const uint8_t *end, uint64_t *n) {
+    if (*n < 15) {
+        return true;
+    }
+    uint8_t b = 255;
+    while (b == 255) {
+        if ((*in == end) || (*n > LZ_FRAME_SIZE)) {
+            return false;
+        }
+        b = *(*in)++;
+        *n += b;
+    }
+    return true;
+}
+
+//writes one sequence at out: lits literals from src and, unless match is 0, a back
+//reference of match bytes offset back
+//returns the new end, NULL if the sequence would reach limit
+static uint8_t *put_sequence(uint8_t *out, uint8_t *limit, const uint8_t *src, uint64_t lits,
+    uint64_t offset, uint64_t match) {
+    uint64_t m = (match > 0) ? match - LZ_MIN_MATCH : 0;
+    uint64_t need = 1 + length_bytes(lits) + lits + ((match > 0) ? 2 + length_bytes(m) : 0);
+    if (need >= (uint64_t) (limit - out)) {
+        return NULL;
+    }
+    *out++ = (uint8_t) (((lits < 15) ? lits : 15) << 4 | ((m < 15) ? m : 15));
+    out = put_length(out, lits);
+    memcpy(out, src, lits);
+    out += lits;
+    if (match > 0) {
+        *out++ = (uint8_t) (offset >> 8);
+        *out++ = (uint8_t) offset;
+        out = put_length(out, m);
+    }
+    return out;
+}
+
+//compresses the len bytes at src, at most LZ_FRAME_SIZE, into one frame at frame, which has
+//room for LZ_FRAME_BOUND bytes
+//matches are found through a hash table of the last position of each 4 byte sequence, the
+//search steps further the longer it goes without one so incompressible data passes quickly
+//returns the bytes of the frame, LZ_HEADER_SIZE + len when it is stored as it is
+uint64_t lz_compress(lz_t *lz, uint8_t *frame, const uint8_t *src, uint64_t len) {
+    uint8_t *start = frame + LZ_HEADER_SIZE;
+    uint8_t *limit = start + len; //a compressed frame has to come out smaller
+    uint8_t *out = start;
+    uint64_t anchor = 0; //first byte not yet written
+    uint64_t i = 0;
+    uint64_t misses = 0;
+    memset(lz->table, 0, sizeof(lz->table));
+
+    while ((out != NULL) && (i + LZ_MIN_MATCH <= len)) {
+        uint32_t h = hash4(src + i);
+        uint64_t cand = lz->table[h];
+        lz->table[h] = (uint32_t) (i + 1);
+        if ((cand == 0) || (i - (cand - 1) > LZ_MAX_OFFSET)
+            || (load32(src + cand - 1) != load32(src + i))) {
+            i += 1 + (misses++ >> 6);
+            continue;
+        }
+
+        uint64_t ref = cand - 1;
+        uint64_t match = LZ_MIN_MATCH;
+        while ((i + match < len) && (src[ref + match] == src[i + match])) {
+            match++;
+        }
+        out = put_sequence(out, limit, src + anchor, i - anchor, i - ref, match);
+        i += match;
+        anchor = i;
+        misses = 0;
+    }
+    if (out != NULL) {
+        out = put_sequence(out, limit, src + anchor, len - anchor, 0, 0);
+    }
+
+    uint64_t stored = (out != NULL) ? (uint64_t) (out - start) : len;
+    if (out == NULL) {
+        memcpy(start, src, len);
+    }
+    put_be24(frame, len);
+    put_be24(frame + 3, stored);
+    return LZ_HEADER_SIZE + stored;
+}
+
+//reads the lengths of the frame whose header is at frame, its data bytes into *len and its
+//stored bytes into *stored
+//returns false if they are not the lengths of a frame lz_compress makes
+bool lz_frame_header(const uint8_t *frame, uint64_t *len, uint64_t *stored) {
+    *len = get_be24(frame);
+    *stored = get_be24(frame + 3);
+    return (*len > 0) && (*len <= LZ_FRAME_SIZE) && (*stored > 0) && (*stored <= *len);
+}
+
+//whether the frame at frame holds its data compressed rather than as it is
+bool lz_compressed(const uint8_t *frame) {
+    uint64_t len = 0;
+    uint64_t stored = 0;
+    return lz_frame_header(frame, &len, &stored) && (stored < len);
+}
+
+//expands the whole frame at frame into dst, which has room for its data bytes
+//every length and offset is checked against the frame, so damaged input cannot write or
+//read outside of it
+//returns false if the frame is not one lz_compress makes
+bool lz_decompress(uint8_t *dst, const uint8_t *frame) {
+    uint64_t len = 0;
+    uint64_t stored = 0;
+    if (!lz_frame_header(frame, &len, &stored)) {
+        return false;
+    }
+    const uint8_t *in = frame + LZ_HEADER_SIZE;
+    const uint8_t *end = in + stored;
+    if (stored == len) {
+        memcpy(dst, in, len);
+        return true;
+    }
+
+    uint64_t o = 0;
+    while (in < end) {
+        uint8_t token = *in++;
+        uint64_t lits = token >> 4;
+        if (!get_length(&in, end, &lits) || (lits > (uint64_t) (end - in)) || (lits > len - o)) {
+            return false;
+        }
+        memcpy(dst + o, in, lits);
+        in += lits;
+        o += lits;
+        if (o == len) {
+            return in == end;
+        }
+
+        if (end - in < 2) {
+            return false;
+        }
+        uint64_t offset = ((uint64_t) in[0] << 8) | in[1];
+        in += 2;
+        uint64_t match = token & 15;
+        if (!get_length(&in, end, &match)) {
+            return false;
+        }
+        match += LZ_MIN_MATCH;
+        if ((offset == 0) || (offset > o) || (match > len - o)) {
+            return false;
+        }
+        //a reference closer than its length repeats the bytes it is still writing
+        if (offset >= match) {
+            memcpy(dst + o, dst + o - offset, match);
+        } else {
+            for (uint64_t k = 0; k < match; k++) {
+                dst[o + k] = dst[o + k - offset];
+            }
+        }
+        o += match;
+    }
+    return false;
+}
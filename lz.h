@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//LZ77 compression of file data ahead of the RSA blocks, in frames that stand on their own
+//a frame is a header of two big-endian 3 byte lengths, its data bytes and its stored bytes,
+//followed by the stored bytes: the data itself when the two are equal, otherwise sequences of
+//a token, a literal run and a back reference into the frame's data
+//
+//sequence layout, the token nibbles saturate at 15 and continue in bytes of 255 and a last
+//byte below it, as LZ4 does:
+//  token   literal run length << 4 | match length - LZ_MIN_MATCH
+//  [len]   rest of the literal run length
+//  literals
+//  offset  2 bytes big-endian, 1 to 65535 bytes back
+//  [len]   rest of the match length
+//the last sequence of a frame ends after its literals, with no back reference
+//a frame is only stored compressed when that makes it smaller, so data that does not
+//compress costs the header alone
+
+#define LZ_FRAME_SIZE  ((uint64_t) 1 << 16) //most data bytes in a frame
+#define LZ_HEADER_SIZE 6
+#define LZ_FRAME_BOUND (LZ_HEADER_SIZE + LZ_FRAME_SIZE) //most bytes a frame takes
+#define LZ_MIN_MATCH   4
+#define LZ_HASH_BITS   14
+
+//compressor state, kept between frames only so that it is not allocated for each
+typedef struct {
+    uint32_t table[1 << LZ_HASH_BITS]; //1 + last position of each hashed 4 byte sequence
+} lz_t;
+
+uint64_t lz_compress(lz_t *lz, uint8_t *frame, const uint8_t *src, uint64_t len);
+
+bool lz_frame_header(const uint8_t *frame, uint64_t *len, uint64_t *stored);
+
+bool lz_compressed(const uint8_t *frame);
+
+bool lz_decompress(uint8_t *dst, const uint8_t *frame);
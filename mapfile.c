@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapfile.h"
+
+//maps all of FILE read-only, callers start at ftell(file) to skip what stdio already consumed
+//returns false if the file is not a regular file or is empty
+bool mapfile_open_read(FILE *file, mapfile_t *map) {
+    struct stat st;
+    map->fd = fileno(file);
+    map->base = NULL;
+    map->size = 0;
+    if ((fstat(map->fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size <= 0)) {
+        return false;
+    }
+
+    void *base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    madvise(base, (size_t) st.st_size, MADV_SEQUENTIAL);
+    map->base = (uint8_t *) base;
+    map->size = (uint64_t) st.st_size;
+    return true;
+}
+
+//sizes FILE to size bytes and maps it for writing
+//only regular files opened for reading and writing with nothing written yet qualify
+bool mapfile_open_write(FILE *file, mapfile_t *map, uint64_t size) {
+    struct stat st;
+    map->fd = fileno(file);
+    map->base = NULL;
+    map->size = 0;
+    if ((fstat(map->fd, &st) != 0) || !S_ISREG(st.st_mode) || (ftell(file) != 0)
+        || ((fcntl(map->fd, F_GETFL) & O_ACCMODE) != O_RDWR) || (size == 0)) {
+        return false;
+    }
+
+    fflush(file);
+    return mapfile_grow(map, size);
+}
+
+//extends a writable mapping to size bytes, the contents mapped so far are kept
+bool mapfile_grow(mapfile_t *map, uint64_t size) {
+    if (map->base != NULL) {
+        munmap(map->base, map->size);
+        map->base = NULL;
+    }
+    if (ftruncate(map->fd, (off_t) size) != 0) {
+        return false;
+    }
+
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    map->base = (uint8_t *) base;
+    map->size = size;
+    return true;
+}
+
+//unmaps a file mapped by mapfile_open_read
+void mapfile_close(mapfile_t *map) {
+    if (map->base != NULL) {
+        munmap(map->base, map->size);
+    }
+    map->base = NULL;
+    map->size = 0;
+    return;
+}
+
+//unmaps a file mapped by mapfile_open_write, cuts it to the size bytes actually written and
+//moves the stream to its end
+void mapfile_finish(mapfile_t *map, FILE *file, uint64_t size) {
+    mapfile_close(map);
+    if (ftruncate(map->fd, (off_t) size) == 0) {
+        fseek(file, 0, SEEK_END);
+    }
+    return;
+}
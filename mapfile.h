@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//memory mapped view of a regular file that is open as a FILE stream
+//pipes, terminals and anything else that cannot be mapped keep using stdio
+typedef struct {
+    int fd;
+    uint8_t *base; //start of the mapping, the file offset 0
+    uint64_t size; //bytes mapped
+} mapfile_t;
+
+bool mapfile_open_read(FILE *file, mapfile_t *map);
+
+bool mapfile_open_write(FILE *file, mapfile_t *map, uint64_t size);
+
+bool mapfile_grow(mapfile_t *map, uint64_t size);
+
+void mapfile_close(mapfile_t *map);
+
+void mapfile_finish(mapfile_t *map, FILE *file, uint64_t size);
@@ -0,0 +1,446 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+
+#include "mbexp.h"
+#include "stats.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && (GMP_NUMB_BITS == 64)
+#define MBEXP_X86 1
+#include <immintrin.h>
+#endif
+
+//largest odd-power table, windows are at most 6 bits wide
+#define MBEXP_TABLE 32
+
+//bytes every vector value is aligned to
+#define MBEXP_ALIGN 64
+
+//multiplies r = a * b * R^-1 % n in every lane, t is scratch of 2 * digits values
+//a and b must be below 2n with normalized digits, so is r, r may alias a or b
+typedef void (*mbexp_mul_fn)(
+    uint64_t *r, const uint64_t *a, const uint64_t *b, const mbexp_t *mb, uint64_t *t);
+
+#ifdef MBEXP_X86
+
+//operand scanning with the product and the reduction of each digit of b fused in one pass,
+//the 52-bit low and high halves of every product go into neighbouring 64-bit accumulators
+//which have room for the 4 * digits halves a column can collect up to 8192-bit moduli
+//inlined into every caller, so a constant digits fixes the loop bounds at compile time
+__attribute__((target("avx512f,avx512ifma"), always_inline)) static inline void ifma_mul_digits(
+    uint64_t *r, const uint64_t *a, const uint64_t *b, const mbexp_t *mb, uint64_t *t,
+    const uint64_t digits) {
+    const __m512i *av = (const __m512i *) a;
+    const __m512i *bv = (const __m512i *) b;
+    const __m512i *nv = (const __m512i *) mb->n;
+    __m512i *acc = (__m512i *) t;
+    __m512i zero = _mm512_setzero_si512();
+    __m512i k0 = _mm512_set1_epi64((long long) mb->k0);
+    __m512i mask = _mm512_set1_epi64((1LL << 52) - 1);
+
+    for (uint64_t j = 0; j < 2 * digits; j++) {
+        acc[j] = zero;
+    }
+    for (uint64_t i = 0; i < digits; i++) {
+        __m512i *ai = acc + i;
+        __m512i bi = bv[i];
+
+        //q clears the low digit, which then only carries into the next one
+        __m512i low = _mm512_madd52lo_epu64(ai[0], av[0], bi);
+        __m512i q = _mm512_madd52lo_epu64(zero, low, k0);
+        low = _mm512_madd52lo_epu64(low, nv[0], q);
+        __m512i high = _mm512_madd52hi_epu64(zero, av[0], bi);
+        high = _mm512_madd52hi_epu64(high, nv[0], q);
+        high = _mm512_add_epi64(high, _mm512_srli_epi64(low, 52));
+
+#pragma GCC unroll 8
+        for (uint64_t j = 1; j < digits; j++) {
+            __m512i x = _mm512_add_epi64(ai[j], high);
+            x = _mm512_madd52lo_epu64(x, av[j], bi);
+            ai[j] = _mm512_madd52lo_epu64(x, nv[j], q);
+            high = _mm512_madd52hi_epu64(zero, av[j], bi);
+            high = _mm512_madd52hi_epu64(high, nv[j], q);
+        }
+        ai[digits] = _mm512_add_epi64(ai[digits], high);
+    }
+
+    //the upper half is the result, its carries are pushed up once at the end
+    __m512i *rv = (__m512i *) r;
+    __m512i carry = zero;
+    for (uint64_t j = 0; j < digits; j++) {
+        __m512i x = _mm512_add_epi64(acc[digits + j], carry);
+        carry = _mm512_srli_epi64(x, 52);
+        rv[j] = _mm512_and_si512(x, mask);
+    }
+    return;
+}
+
+__attribute__((target("avx512f,avx512ifma"))) static void ifma_mul(
+    uint64_t *r, const uint64_t *a, const uint64_t *b, const mbexp_t *mb, uint64_t *t) {
+    ifma_mul_digits(r, a, b, mb, t, mb->digits);
+    return;
+}
+
+//the same schedule with 26-bit digits, whose whole 52-bit products fit one accumulator
+__attribute__((target("avx2"), always_inline)) static inline void avx2_mul_digits(
+    uint64_t *r, const uint64_t *a, const uint64_t *b, const mbexp_t *mb, uint64_t *t,
+    const uint64_t digits) {
+    const __m256i *av = (const __m256i *) a;
+    const __m256i *bv = (const __m256i *) b;
+    const __m256i *nv = (const __m256i *) mb->n;
+    __m256i *acc = (__m256i *) t;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i k0 = _mm256_set1_epi64x((long long) mb->k0);
+    __m256i mask = _mm256_set1_epi64x((1LL << 26) - 1);
+
+    for (uint64_t j = 0; j < 2 * digits; j++) {
+        acc[j] = zero;
+    }
+    for (uint64_t i = 0; i < digits; i++) {
+        __m256i *ai = acc + i;
+        __m256i bi = bv[i];
+
+        __m256i low = _mm256_add_epi64(ai[0], _mm256_mul_epu32(av[0], bi));
+        __m256i q = _mm256_and_si256(_mm256_mul_epu32(low, k0), mask);
+        low = _mm256_add_epi64(low, _mm256_mul_epu32(nv[0], q));
+        __m256i carry = _mm256_srli_epi64(low, 26);
+
+        ai[1] = _mm256_add_epi64(ai[1], carry);
+#pragma GCC unroll 8
+        for (uint64_t j = 1; j < digits; j++) {
+            __m256i x = _mm256_add_epi64(ai[j], _mm256_mul_epu32(av[j], bi));
+            ai[j] = _mm256_add_epi64(x, _mm256_mul_epu32(nv[j], q));
+        }
+    }
+
+    __m256i *rv = (__m256i *) r;
+    __m256i carry = zero;
+    for (uint64_t j = 0; j < digits; j++) {
+        __m256i x = _mm256_add_epi64(acc[digits + j], carry);
+        carry = _mm256_srli_epi64(x, 26);
+        rv[j] = _mm256_and_si256(x, mask);
+    }
+    return;
+}
+
+__attribute__((target("avx2"))) static void avx2_mul(
+    uint64_t *r, const uint64_t *a, const uint64_t *b, const mbexp_t *mb, uint64_t *t) {
+    avx2_mul_digits(r, a, b, mb, t, mb->digits);
+    return;
+}
+
+//the kernels specialized for a digit count known at compile time, the accumulators then live
+//on the stack of the call instead of in the workspace, which lets the compiler keep the
+//columns it is working on in registers
+#define MBEXP_FIXED(name, target_isa, vector, digits)                                      \
+    __attribute__((target(target_isa))) static void name##_##digits(uint64_t *r,          \
+        const uint64_t *a, const uint64_t *b, const mbexp_t *mb, uint64_t *t) {             \
+        vector acc[2 * digits];                                                             \
+        (void) t;                                                                           \
+        name##_digits(r, a, b, mb, (uint64_t *) acc, digits);                               \
+        return;                                                                             \
+    }
+
+//the moduli and primes of 2048, 3072 and 4096-bit keys, n takes 2 bits more than its size
+MBEXP_FIXED(ifma_mul, "avx512f,avx512ifma", __m512i, 20) //1024-bit primes
+MBEXP_FIXED(ifma_mul, "avx512f,avx512ifma", __m512i, 30) //1536-bit primes
+MBEXP_FIXED(ifma_mul, "avx512f,avx512ifma", __m512i, 40) //2048-bit moduli and primes
+MBEXP_FIXED(ifma_mul, "avx512f,avx512ifma", __m512i, 60) //3072-bit moduli
+MBEXP_FIXED(ifma_mul, "avx512f,avx512ifma", __m512i, 79) //4096-bit moduli
+
+//AVX2 only runs up to 1024 bits
+MBEXP_FIXED(avx2_mul, "avx2", __m256i, 20) //512-bit primes
+MBEXP_FIXED(avx2_mul, "avx2", __m256i, 40) //1024-bit moduli and primes
+
+#endif
+
+//the widest kernel this CPU runs
+mbexp_isa_t mbexp_detect(void) {
+#ifdef MBEXP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512ifma")) {
+        return MBEXP_IFMA;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return MBEXP_AVX2;
+    }
+#endif
+    return MBEXP_SCALAR;
+}
+
+//kernel for a modulus of bits on this CPU
+//IFMA beats GMP at every size, the 26-bit digits of AVX2 need 4 times the multiplications and
+//only pay off up to 1024 bits, larger moduli are left to GMP
+mbexp_isa_t mbexp_select(uint64_t bits) {
+    mbexp_isa_t isa = mbexp_detect();
+    if ((isa == MBEXP_AVX2) && (bits > 1024)) {
+        return MBEXP_SCALAR;
+    }
+    return isa;
+}
+
+//name of a kernel as printed by the tools
+const char *mbexp_name(mbexp_isa_t isa) {
+    switch (isa) {
+    case MBEXP_IFMA: return "avx512ifma";
+    case MBEXP_AVX2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+static mbexp_mul_fn mbexp_mul(mbexp_isa_t isa) {
+#ifdef MBEXP_X86
+    if (isa == MBEXP_IFMA) {
+        return ifma_mul;
+    }
+    if (isa == MBEXP_AVX2) {
+        return avx2_mul;
+    }
+#endif
+    (void) isa;
+    return NULL;
+}
+
+//the multiplication for mb, specialized for its digit count when that is a common size
+static mbexp_mul_fn mbexp_mul_sized(const mbexp_t *mb) {
+#ifdef MBEXP_X86
+    if (mb->isa == MBEXP_IFMA) {
+        switch (mb->digits) {
+        case 20: return ifma_mul_20;
+        case 30: return ifma_mul_30;
+        case 40: return ifma_mul_40;
+        case 60: return ifma_mul_60;
+        case 79: return ifma_mul_79;
+        default: break;
+        }
+    }
+    if (mb->isa == MBEXP_AVX2) {
+        switch (mb->digits) {
+        case 20: return avx2_mul_20;
+        case 40: return avx2_mul_40;
+        default: break;
+        }
+    }
+#endif
+    return mbexp_mul(mb->isa);
+}
+
+//stores a, which must be below 2^(radix * digits), as the digits of lane in v
+//limbs is scratch with room for the digits plus one limb
+static void to_digits(uint64_t *v, uint64_t lane, mpz_t a, const mbexp_t *mb, uint64_t *limbs) {
+    uint64_t count = (mb->radix * mb->digits + 63) / 64 + 1;
+    uint64_t used = mpz_size(a);
+    memset(limbs, 0, count * sizeof(uint64_t));
+    if (used > 0) {
+        memcpy(limbs, mpz_limbs_read(a), used * sizeof(uint64_t));
+    }
+    uint64_t mask = ((uint64_t) 1 << mb->radix) - 1;
+    for (uint64_t i = 0; i < mb->digits; i++) {
+        uint64_t bit = i * mb->radix;
+        uint64_t x = limbs[bit / 64] >> (bit % 64);
+        if (bit % 64 + mb->radix > 64) {
+            x |= limbs[bit / 64 + 1] << (64 - bit % 64);
+        }
+        v[i * mb->lanes + lane] = x & mask;
+    }
+    return;
+}
+
+//reads the digits of lane in v back into out and reduces it below n, limbs is scratch as for
+//to_digits, out only ever gets the limbs of n
+static void from_digits(
+    mpz_t out, const uint64_t *v, uint64_t lane, const mbexp_t *mb, uint64_t *limbs) {
+    uint64_t count = (mb->radix * mb->digits + 63) / 64;
+    memset(limbs, 0, count * sizeof(uint64_t));
+    for (uint64_t i = 0; i < mb->digits; i++) {
+        uint64_t x = v[i * mb->lanes + lane];
+        uint64_t bit = i * mb->radix;
+        limbs[bit / 64] |= x << (bit % 64);
+        if (bit % 64 + mb->radix > 64) {
+            limbs[bit / 64 + 1] |= x >> (64 - bit % 64);
+        }
+    }
+
+    //the almost-reduced result is at most n, n itself becomes 0
+    mp_size_t size = (mp_size_t) mpz_size(mb->modulus);
+    const mp_limb_t *n = mpz_limbs_read(mb->modulus);
+    if (mpn_cmp(limbs, n, size) >= 0) {
+        mpn_sub_n(limbs, limbs, n, size);
+    }
+    mp_limb_t *rp = mpz_limbs_write(out, size);
+    mpn_copyi(rp, limbs, size);
+    mpz_limbs_finish(out, size);
+    return;
+}
+
+//stores a in every lane of v
+static void broadcast(uint64_t *v, mpz_t a, const mbexp_t *mb, uint64_t *limbs) {
+    for (uint64_t lane = 0; lane < mb->lanes; lane++) {
+        to_digits(v, lane, a, mb, limbs);
+    }
+    return;
+}
+
+static uint64_t *aligned_values(uint64_t count, const mbexp_t *mb) {
+    uint64_t bytes = count * mb->digits * mb->lanes * sizeof(uint64_t);
+    bytes = (bytes + MBEXP_ALIGN - 1) & ~(uint64_t) (MBEXP_ALIGN - 1);
+    return (uint64_t *) aligned_alloc(MBEXP_ALIGN, bytes);
+}
+
+//sets up the constants of an odd modulus for the kernel isa
+//MBEXP_SCALAR only records the modulus, mbexp_pow then has to be left to the caller
+void mbexp_init(mbexp_t *mb, mpz_t modulus, mbexp_isa_t isa) {
+    mpz_init_set(mb->modulus, modulus);
+    mb->isa = (mbexp_mul(isa) != NULL) ? isa : MBEXP_SCALAR;
+    mb->lanes = (mb->isa == MBEXP_IFMA) ? 8 : (mb->isa == MBEXP_AVX2) ? 4 : 1;
+    mb->radix = (mb->isa == MBEXP_IFMA) ? 52 : 26;
+    mb->digits = (mpz_sizeinbase(modulus, 2) + 2 + mb->radix - 1) / mb->radix;
+    mb->n = NULL;
+    mb->r2 = NULL;
+    mb->one = NULL;
+    mb->k0 = 0;
+    if (mb->isa == MBEXP_SCALAR) {
+        return;
+    }
+
+    //-n^-1 % 2^radix and R^2 % n
+    mpz_t x, r;
+    mpz_init(x);
+    mpz_init_set_ui(r, 1);
+    mpz_mul_2exp(r, r, mb->radix);
+    mpz_invert(x, modulus, r);
+    mpz_sub(x, r, x);
+    mb->k0 = mpz_get_ui(x);
+    mpz_set_ui(r, 1);
+    mpz_mul_2exp(r, r, 2 * mb->radix * mb->digits);
+    mpz_mod(r, r, modulus);
+
+    uint64_t *limbs = (uint64_t *) malloc(((mb->radix * mb->digits + 63) / 64 + 1) * 8);
+    mb->n = aligned_values(3, mb);
+    mb->r2 = mb->n + mb->digits * mb->lanes;
+    mb->one = mb->r2 + mb->digits * mb->lanes;
+    broadcast(mb->n, modulus, mb, limbs);
+    broadcast(mb->r2, r, mb, limbs);
+    mpz_set_ui(x, 1);
+    broadcast(mb->one, x, mb, limbs);
+    free(limbs);
+    mpz_clear(x);
+    mpz_clear(r);
+    return;
+}
+
+void mbexp_clear(mbexp_t *mb) {
+    free(mb->n);
+    mb->n = NULL;
+    mb->r2 = NULL;
+    mb->one = NULL;
+    mpz_clear(mb->modulus);
+    return;
+}
+
+//values in a workspace: the odd-power table, the base, the accumulator and the 2 * digits
+//of product scratch, followed by limbs for converting into digits
+#define MBEXP_WS_VALUES (MBEXP_TABLE + 4)
+
+//bytes of workspace mbexp_pow needs for mb, 0 for MBEXP_SCALAR
+//a workspace of the largest size serves every modulus it was sized over
+uint64_t mbexp_ws_size(mbexp_t *mb) {
+    if (mb->isa == MBEXP_SCALAR) {
+        return 0;
+    }
+    uint64_t limbs = (mb->radix * mb->digits + 63) / 64 + 1;
+    uint64_t values = MBEXP_WS_VALUES + (limbs + mb->digits - 1) / mb->digits;
+    uint64_t bytes = values * mb->digits * mb->lanes * sizeof(uint64_t);
+    return (bytes + MBEXP_ALIGN - 1) & ~(uint64_t) (MBEXP_ALIGN - 1);
+}
+
+//allocates a workspace of size bytes from mbexp_ws_size, NULL for 0
+uint64_t *mbexp_ws_alloc(uint64_t size) {
+    return (size > 0) ? (uint64_t *) aligned_alloc(MBEXP_ALIGN, size) : NULL;
+}
+
+void mbexp_ws_free(uint64_t *ws) {
+    free(ws);
+    return;
+}
+
+//out[i] = base[i] ^ exponent % n for the count bases, 1 <= count <= mb->lanes
+//rec is the exponent recoded by nt_recode, every base must be below n
+//out may alias base, ws comes from mbexp_ws_alloc
+void mbexp_pow(
+    mbexp_t *mb, mpz_ptr out[], mpz_ptr base[], uint64_t count, nt_recoding_t *rec, uint64_t *ws) {
+    if ((rec->count == 0) && (rec->limb == 0)) {
+        for (uint64_t i = 0; i < count; i++) {
+            mpz_set_ui(out[i], 1);
+        }
+        return;
+    }
+
+    mbexp_mul_fn mul = mbexp_mul_sized(mb);
+    uint64_t value = mb->digits * mb->lanes;
+    uint64_t *table = ws;
+    uint64_t *x = table + MBEXP_TABLE * value;
+    uint64_t *acc = x + value;
+    uint64_t *t = acc + value;
+    uint64_t *limbs = t + 2 * value;
+
+    //lanes without a base of their own run on a copy of the first
+    for (uint64_t lane = 0; lane < mb->lanes; lane++) {
+        to_digits(x, lane, base[(lane < count) ? lane : 0], mb, limbs);
+    }
+    mul(x, x, mb->r2, mb, t);
+    uint64_t mults = 2; //into and out of Montgomery form
+
+    if (rec->count == 0) {
+        //left-to-right binary for exponents of one limb, as in pow_mod_mont_short
+        mp_limb_t exponent = rec->limb;
+        int bit = GMP_NUMB_BITS - 1;
+        while ((exponent >> bit) == 0) {
+            bit--;
+        }
+        memcpy(acc, x, value * sizeof(uint64_t));
+        for (bit--; bit >= 0; bit--) {
+            mul(acc, acc, acc, mb, t);
+            mults++;
+            if ((exponent >> bit) & 1) {
+                mul(acc, acc, x, mb, t);
+                mults++;
+            }
+        }
+    } else {
+        //the odd powers, then the sliding windows of pow_mod_mont_rec_ws
+        uint64_t table_size = (uint64_t) 1 << (rec->k - 1);
+        memcpy(table, x, value * sizeof(uint64_t));
+        if (table_size > 1) {
+            mul(x, x, x, mb, t); //base ^ 2
+            for (uint64_t i = 1; i < table_size; i++) {
+                mul(table + i * value, table + (i - 1) * value, x, mb, t);
+            }
+        }
+        mults += table_size;
+
+        memcpy(acc, table + ((rec->windows[0] & 0xFF) >> 1) * value, value * sizeof(uint64_t));
+        for (uint64_t i = 1; i < rec->count; i++) {
+            uint64_t w = rec->windows[i] >> 8;
+            uint64_t v = rec->windows[i] & 0xFF;
+            for (uint64_t b = 0; b < w; b++) {
+                mul(acc, acc, acc, mb, t);
+            }
+            mults += w;
+            if (v != 0) {
+                mul(acc, acc, table + (v >> 1) * value, mb, t);
+                mults++;
+            }
+        }
+    }
+
+    mul(acc, acc, mb->one, mb, t);
+    for (uint64_t lane = 0; lane < count; lane++) {
+        from_digits(out[lane], acc, lane, mb, limbs);
+    }
+    stats_add(&stats.modmults, mults * count);
+    stats_add(&stats.modexps, count);
+    return;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+
+#include "numtheory.h"
+
+//multi-buffer modular exponentiation
+//runs up to MBEXP_LANES exponentiations with the same modulus and exponent side by side, one
+//in each lane of the vector registers, so one vector Montgomery multiplication does the work
+//of lanes scalar ones
+//values are held as digits of radix bits, digit i of every lane next to each other, and
+//multiplied with Montgomery's almost-reduction, R = 2^(radix * digits) > 4n keeps every
+//intermediate below 2n without a final subtraction until the result is converted back
+
+#define MBEXP_LANES 8 //most exponentiations one call runs side by side
+
+//kernels, the widest the CPU supports is picked at run time
+typedef enum {
+    MBEXP_SCALAR, //no kernel, callers fall back to one GMP exponentiation at a time
+    MBEXP_AVX2, //4 lanes of 26-bit digits multiplied with vpmuludq
+    MBEXP_IFMA, //8 lanes of 52-bit digits multiplied with AVX-512 IFMA
+} mbexp_isa_t;
+
+//constants of one odd modulus for a kernel
+typedef struct {
+    mbexp_isa_t isa;
+    uint64_t lanes; //exponentiations one call runs side by side, 1 for MBEXP_SCALAR
+    uint64_t radix; //bits per digit
+    uint64_t digits; //digits per value
+    uint64_t k0; //-n^-1 % 2^radix
+    uint64_t *n, *r2, *one; //n, R^2 % n and 1 as digits, repeated in every lane
+    mpz_t modulus;
+} mbexp_t;
+
+mbexp_isa_t mbexp_detect(void);
+
+mbexp_isa_t mbexp_select(uint64_t bits);
+
+const char *mbexp_name(mbexp_isa_t isa);
+
+void mbexp_init(mbexp_t *mb, mpz_t modulus, mbexp_isa_t isa);
+
+void mbexp_clear(mbexp_t *mb);
+
+uint64_t mbexp_ws_size(mbexp_t *mb);
+
+uint64_t *mbexp_ws_alloc(uint64_t size);
+
+void mbexp_ws_free(uint64_t *ws);
+
+void mbexp_pow(
+    mbexp_t *mb, mpz_ptr out[], mpz_ptr base[], uint64_t count, nt_recoding_t *rec, uint64_t *ws);
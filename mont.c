@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+#include "mont.h"
+
+//copies the value of a into size limbs at rp, a must fit
+static void limbs_set(mp_limb_t *rp, mpz_t a, mp_size_t size) {
+    mp_size_t used = mpz_size(a);
+    if (used > 0) {
+        mpn_copyi(rp, mpz_limbs_read(a), used);
+    }
+    if (used < size) {
+        mpn_zero(rp + used, size - used);
+    }
+    return;
+}
+
+//sets up the Montgomery constants for an odd modulus
+void mont_init(mont_t *ctx, mpz_t modulus) {
+    mont_alloc(ctx, mpz_size(modulus));
+    mont_set(ctx, modulus);
+    return;
+}
+
+//allocates a context with room for moduli of up to alloc limbs, mont_set fills it in
+void mont_alloc(mont_t *ctx, mp_size_t alloc) {
+    //n, R^2 % n and R % n, then R^2 and its quotient while they are being reduced
+    ctx->n = (mp_limb_t *) malloc((6 * alloc + 3) * sizeof(mp_limb_t));
+    ctx->r2 = ctx->n + alloc;
+    ctx->one = ctx->n + 2 * alloc;
+    ctx->setup = ctx->n + 3 * alloc;
+    ctx->alloc = alloc;
+    ctx->size = 0;
+    return;
+}
+
+//computes the Montgomery constants for an odd modulus in place, without allocating
+//the modulus must fit the room the context was allocated with
+void mont_set(mont_t *ctx, mpz_t modulus) {
+    mp_size_t size = mpz_size(modulus);
+    ctx->size = size;
+    limbs_set(ctx->n, modulus, size);
+
+    //n^-1 % 2^GMP_NUMB_BITS by Newton iteration, each step doubles the correct low bits
+    //an odd n0 is its own inverse modulo 8, so 3 bits are correct to begin with
+    mp_limb_t n0 = ctx->n[0];
+    mp_limb_t inv = n0;
+    for (int i = 0; i < 6; i++) {
+        inv *= 2 - n0 * inv;
+    }
+    ctx->ninv = -inv;
+
+    //R % n and R^2 % n, dividing the powers of 2 laid out in the setup scratch
+    mp_limb_t *np = ctx->setup;
+    mp_limb_t *qp = np + 2 * size + 1;
+    mpn_zero(np, size);
+    np[size] = 1;
+    mpn_tdiv_qr(qp, ctx->one, 0, np, size + 1, ctx->n, size);
+    mpn_zero(np, 2 * size);
+    np[2 * size] = 1;
+    mpn_tdiv_qr(qp, ctx->r2, 0, np, 2 * size + 1, ctx->n, size);
+    return;
+}
+
+//frees the limbs held by the context
+void mont_clear(mont_t *ctx) {
+    free(ctx->n);
+    ctx->n = NULL;
+    ctx->r2 = NULL;
+    ctx->one = NULL;
+    ctx->setup = NULL;
+    ctx->size = 0;
+    ctx->alloc = 0;
+    return;
+}
+
+//Montgomery reduction rp = tp * R^-1 % n, tp holds 2 * size limbs and is overwritten
+//tp must be less than n * R, rp may not overlap tp
+void mont_redc(mp_limb_t *rp, mp_limb_t *tp, mont_t *ctx) {
+    mp_size_t size = ctx->size;
+
+    //clear one low limb per step, the carry out of each step is parked in the limb it cleared
+    for (mp_size_t i = 0; i < size; i++) {
+        mp_limb_t q = tp[i] * ctx->ninv;
+        tp[i] = mpn_addmul_1(tp + i, ctx->n, size, q);
+    }
+
+    //add the parked carries into the high half, the sum is below 2n
+    mp_limb_t carry = mpn_add_n(rp, tp + size, tp, size);
+    if ((carry != 0) || (mpn_cmp(rp, ctx->n, size) >= 0)) {
+        mpn_sub_n(rp, rp, ctx->n, size);
+    }
+    return;
+}
+
+//rp = ap * bp * R^-1 % n, tp is scratch of 2 * size limbs
+void mont_mul(mp_limb_t *rp, mp_limb_t *ap, mp_limb_t *bp, mont_t *ctx, mp_limb_t *tp) {
+    mpn_mul_n(tp, ap, bp, ctx->size);
+    mont_redc(rp, tp, ctx);
+    return;
+}
+
+//rp = ap * ap * R^-1 % n, tp is scratch of 2 * size limbs
+void mont_sqr(mp_limb_t *rp, mp_limb_t *ap, mont_t *ctx, mp_limb_t *tp) {
+    mpn_sqr(tp, ap, ctx->size);
+    mont_redc(rp, tp, ctx);
+    return;
+}
+
+//converts a into Montgomery form rp = a * R % n, tp is scratch of 2 * size limbs
+void mont_to(mp_limb_t *rp, mpz_t a, mont_t *ctx, mp_limb_t *tp) {
+    mp_size_t size = ctx->size;
+
+    //values that are negative or wider than n are reduced first, blocks never are
+    if ((mpz_sgn(a) < 0) || ((mp_size_t) mpz_size(a) > size)) {
+        mpz_t n, reduced;
+        mpz_roinit_n(n, ctx->n, size);
+        mpz_init(reduced);
+        mpz_mod(reduced, a, n);
+        limbs_set(rp, reduced, size);
+        mpz_clear(reduced);
+    } else {
+        limbs_set(rp, a, size);
+    }
+
+    //a < R and R^2 % n < n so the product is below n * R
+    mont_mul(rp, rp, ctx->r2, ctx, tp);
+    return;
+}
+
+//converts ap out of Montgomery form into out = ap * R^-1 % n, tp is scratch of 2 * size limbs
+void mont_from(mpz_t out, mp_limb_t *ap, mont_t *ctx, mp_limb_t *tp) {
+    mp_size_t size = ctx->size;
+    mpn_copyi(tp, ap, size);
+    mpn_zero(tp + size, size);
+    mont_redc(mpz_limbs_write(out, size), tp, ctx);
+    mpz_limbs_finish(out, size);
+    return;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <gmp.h>
+
+//Montgomery arithmetic modulo an odd n, built once per modulus and reused
+//values in Montgomery form are a * R % n with R = 2^(size * GMP_NUMB_BITS), stored in size limbs
+typedef struct {
+    mp_size_t size; //limbs in the modulus
+    mp_size_t alloc; //largest modulus in limbs the context has room for
+    mp_limb_t *n; //modulus limbs
+    mp_limb_t ninv; //-n^-1 % 2^GMP_NUMB_BITS
+    mp_limb_t *r2; //R^2 % n, used to convert into Montgomery form
+    mp_limb_t *one; //R % n, 1 in Montgomery form
+    mp_limb_t *setup; //scratch for computing R % n and R^2 % n
+} mont_t;
+
+void mont_init(mont_t *ctx, mpz_t modulus);
+
+void mont_alloc(mont_t *ctx, mp_size_t alloc);
+
+void mont_set(mont_t *ctx, mpz_t modulus);
+
+void mont_clear(mont_t *ctx);
+
+void mont_redc(mp_limb_t *rp, mp_limb_t *tp, mont_t *ctx);
+
+void mont_mul(mp_limb_t *rp, mp_limb_t *ap, mp_limb_t *bp, mont_t *ctx, mp_limb_t *tp);
+
+void mont_sqr(mp_limb_t *rp, mp_limb_t *ap, mont_t *ctx, mp_limb_t *tp);
+
+void mont_to(mp_limb_t *rp, mpz_t a, mont_t *ctx, mp_limb_t *tp);
+
+void mont_from(mpz_t out, mp_limb_t *ap, mont_t *ctx, mp_limb_t *tp);
@@ -1,233 +1,965 @@
 #include <gmp.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
 
 #include "numtheory.h"
 #include "randstate.h"
+#include "stats.h"
+
+//picks the sliding window width for an exponent that is bits long, at most NT_MAX_WINDOW
+uint64_t nt_window_bits(uint64_t bits) {
+    if (bits > 671) {
+        return 6;
+    }
+    if (bits > 239) {
+        return 5;
+    }
+    if (bits > 79) {
+        return 4;
+    }
+    if (bits > 23) {
+        return 3;
+    }
+    return (bits > 7) ? 2 : 1;
+}
+
+//finds the window of the exponent that starts at bit i
+//stores the window's value in value, 0 for a single zero bit, and returns its width in bits
+static uint64_t next_window(mpz_t exponent, int64_t i, uint64_t k, uint64_t *value) {
+    if (mpz_tstbit(exponent, i) == 0) {
+        *value = 0;
+        return 1;
+    }
+
+    //longest window of at most k bits starting at bit i that ends in a 1
+    int64_t j = (i - (int64_t) k + 1 > 0) ? i - (int64_t) k + 1 : 0;
+    while (mpz_tstbit(exponent, j) == 0) {
+        j++;
+    }
+    *value = 0;
+    for (int64_t b = i; b >= j; b--) {
+        *value = (*value << 1) | mpz_tstbit(exponent, b);
+    }
+    return (uint64_t) (i - j + 1);
+}
 
 //performs modular exponentiation out = (base ^ power) % modulus
+//uses a sliding window over the exponent with a table of the odd powers of base
 void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
-    mpz_t p, d;
-    mpz_init_set(p, base); //sets p = based
-    mpz_init_set(d, exponent); //set d = exponent
-    mpz_set_ui(out, 1); //v within the pseudocode
+    //x ^ 0 is 1, same as the bit-at-a-time version this replaces
+    if (mpz_sgn(exponent) <= 0) {
+        mpz_set_ui(out, 1);
+        return;
+    }
+
+    //odd moduli go through Montgomery multiplication, one-off calls build the context here
+    if (mpz_odd_p(modulus)) {
+        mont_t ctx;
+        mont_init(&ctx, modulus);
+        pow_mod_mont(out, base, exponent, &ctx);
+        mont_clear(&ctx);
+        return;
+    }
+
+    uint64_t bits = mpz_sizeinbase(exponent, 2);
+    uint64_t k = nt_window_bits(bits);
+    uint64_t table_size = (uint64_t) 1 << (k - 1);
+    mp_bitcnt_t width = 2 * mpz_sizeinbase(modulus, 2);
+
+    //table[i] = base ^ (2i + 1) % modulus
+    mpz_t table[1 << (NT_MAX_WINDOW - 1)];
+    mpz_t acc;
+    mpz_init2(acc, width);
+    for (uint64_t i = 0; i < table_size; i++) {
+        mpz_init2(table[i], width);
+    }
+    mpz_mod(table[0], base, modulus);
+    if (table_size > 1) {
+        mpz_mul(acc, table[0], table[0]);
+        mpz_mod(acc, acc, modulus); //base ^ 2
+        for (uint64_t i = 1; i < table_size; i++) {
+            mpz_mul(table[i], table[i - 1], acc);
+            mpz_mod(table[i], table[i], modulus);
+        }
+    }
+
+    //scan the exponent from the top bit down
+    uint64_t mults = table_size;
+    bool first = true;
+    int64_t i = (int64_t) bits - 1;
+    while (i >= 0) {
+        uint64_t value;
+        uint64_t w = next_window(exponent, i, k, &value);
+        i -= (int64_t) w;
+
+        if (first) {
+            //acc is still 1, skip the squarings
+            mpz_set(acc, table[value >> 1]);
+            first = false;
+            continue;
+        }
+        for (uint64_t b = 0; b < w; b++) {
+            mpz_mul(acc, acc, acc);
+            mpz_mod(acc, acc, modulus);
+        }
+        mults += w;
+        if (value != 0) {
+            mpz_mul(acc, acc, table[value >> 1]);
+            mpz_mod(acc, acc, modulus);
+            mults++;
+        }
+    }
+
+    mpz_set(out, acc);
+    stats_add(&stats.modmults, mults);
+    stats_add(&stats.modexps, 1);
+
+    mpz_clear(acc);
+    for (uint64_t i = 0; i < table_size; i++) {
+        mpz_clear(table[i]);
+    }
+    return;
+}
+
+//limbs of pow_mod_mont workspace for a modulus of size limbs: the largest odd-power table,
+//the accumulator and the 2 * size limbs of product scratch
+#define POW_LIMBS(size) ((((mp_size_t) 1 << (NT_MAX_WINDOW - 1)) + 3) * (size))
+
+//performs modular exponentiation out = (base ^ exponent) % n for an exponent of one limb
+//short public exponents such as 65537 are almost all squarings, so plain left-to-right
+//binary beats building a window table
+static void pow_mod_mont_short(
+    mpz_t out, mpz_t base, mp_limb_t exponent, mont_t *ctx, mp_limb_t *ws) {
+    mp_size_t size = ctx->size;
+    mp_limb_t *b = ws;
+    mp_limb_t *acc = b + size;
+    mp_limb_t *tp = acc + size;
+
+    mont_to(b, base, ctx, tp);
+    mpn_copyi(acc, b, size); //the top bit of the exponent
+
+    uint64_t mults = 2; //into and out of Montgomery form
+    int bit = GMP_NUMB_BITS - 1;
+    while ((exponent >> bit) == 0) {
+        bit--;
+    }
+    for (bit--; bit >= 0; bit--) {
+        mont_sqr(acc, acc, ctx, tp);
+        mults++;
+        if ((exponent >> bit) & 1) {
+            mont_mul(acc, acc, b, ctx, tp);
+            mults++;
+        }
+    }
+
+    mont_from(out, acc, ctx, tp);
+    stats_add(&stats.modmults, mults);
+    stats_add(&stats.modexps, 1);
+    return;
+}
+
+//fills table[i] = base ^ (2i + 1) in Montgomery form for windows of up to k bits
+//acc and tp are scratch, returns the modular multiplications made
+static uint64_t pow_table(
+    mp_limb_t *table, mpz_t base, uint64_t k, mont_t *ctx, mp_limb_t *acc, mp_limb_t *tp) {
+    uint64_t table_size = (uint64_t) 1 << (k - 1);
+    mp_size_t size = ctx->size;
+    mont_to(table, base, ctx, tp);
+    if (table_size > 1) {
+        mont_sqr(acc, table, ctx, tp); //base ^ 2
+        for (uint64_t i = 1; i < table_size; i++) {
+            mont_mul(table + i * size, table + (i - 1) * size, acc, ctx, tp);
+        }
+    }
+    return table_size + 1; //the table and the conversion into Montgomery form
+}
+
+//sliding window exponentiation behind pow_mod_mont, ws holds POW_LIMBS(ctx->size) limbs
+static void pow_mod_mont_ws(
+    mpz_t out, mpz_t base, mpz_t exponent, mont_t *ctx, mp_limb_t *ws) {
+    if (mpz_sgn(exponent) <= 0) {
+        mpz_set_ui(out, 1);
+        return;
+    }
+    if (mpz_size(exponent) == 1) {
+        pow_mod_mont_short(out, base, mpz_getlimbn(exponent, 0), ctx, ws);
+        return;
+    }
+
+    uint64_t bits = mpz_sizeinbase(exponent, 2);
+    uint64_t k = nt_window_bits(bits);
+    uint64_t table_size = (uint64_t) 1 << (k - 1);
+    mp_size_t size = ctx->size;
+
+    //the workspace holds the odd-power table, the accumulator and the product scratch
+    mp_limb_t *table = ws;
+    mp_limb_t *acc = table + table_size * size;
+    mp_limb_t *tp = acc + size;
+    uint64_t mults = pow_table(table, base, k, ctx, acc, tp) + 1;
+
+    bool first = true;
+    int64_t i = (int64_t) bits - 1;
+    while (i >= 0) {
+        uint64_t value;
+        uint64_t w = next_window(exponent, i, k, &value);
+        i -= (int64_t) w;
+
+        if (first) {
+            mpn_copyi(acc, table + (value >> 1) * size, size);
+            first = false;
+            continue;
+        }
+        for (uint64_t b = 0; b < w; b++) {
+            mont_sqr(acc, acc, ctx, tp);
+        }
+        mults += w;
+        if (value != 0) {
+            mont_mul(acc, acc, table + (value >> 1) * size, ctx, tp);
+            mults++;
+        }
+    }
+
+    mont_from(out, acc, ctx, tp);
+    stats_add(&stats.modmults, mults);
+    stats_add(&stats.modexps, 1);
+    return;
+}
+
+//the sliding window loop of pow_mod_mont_ws over windows found ahead of time by nt_recode
+static void pow_mod_mont_rec_ws(
+    mpz_t out, mpz_t base, nt_recoding_t *rec, mont_t *ctx, mp_limb_t *ws) {
+    if (rec->count == 0) {
+        if (rec->limb == 0) {
+            mpz_set_ui(out, 1);
+        } else {
+            pow_mod_mont_short(out, base, rec->limb, ctx, ws);
+        }
+        return;
+    }
+
+    uint64_t table_size = (uint64_t) 1 << (rec->k - 1);
+    mp_size_t size = ctx->size;
+    mp_limb_t *table = ws;
+    mp_limb_t *acc = table + table_size * size;
+    mp_limb_t *tp = acc + size;
+    uint64_t mults = pow_table(table, base, rec->k, ctx, acc, tp) + 1;
+
+    //the first window always has a value, it starts at the top bit of the exponent
+    mpn_copyi(acc, table + ((rec->windows[0] & 0xFF) >> 1) * size, size);
+    for (uint64_t i = 1; i < rec->count; i++) {
+        uint64_t w = rec->windows[i] >> 8;
+        uint64_t value = rec->windows[i] & 0xFF;
+        for (uint64_t b = 0; b < w; b++) {
+            mont_sqr(acc, acc, ctx, tp);
+        }
+        mults += w;
+        if (value != 0) {
+            mont_mul(acc, acc, table + (value >> 1) * size, ctx, tp);
+            mults++;
+        }
+    }
+
+    mont_from(out, acc, ctx, tp);
+    stats_add(&stats.modmults, mults);
+    stats_add(&stats.modexps, 1);
+    return;
+}
+
+//splits exponent into the windows pow_mod_mont_ws would walk, so an exponent used for many
+//operations is only scanned once, exponents that fit a limb are kept as they are
+void nt_recode(nt_recoding_t *rec, mpz_t exponent) {
+    rec->limb = 0;
+    rec->k = 1;
+    rec->count = 0;
+    rec->windows = NULL;
+    if (mpz_sgn(exponent) <= 0) {
+        return;
+    }
+    if (mpz_size(exponent) == 1) {
+        rec->limb = mpz_getlimbn(exponent, 0);
+        return;
+    }
+
+    //every window takes at least one bit, so there are at most bits of them
+    uint64_t bits = mpz_sizeinbase(exponent, 2);
+    rec->k = nt_window_bits(bits);
+    rec->windows = (uint16_t *) malloc(bits * sizeof(uint16_t));
+    int64_t i = (int64_t) bits - 1;
+    while (i >= 0) {
+        uint64_t value;
+        uint64_t w = next_window(exponent, i, rec->k, &value);
+        i -= (int64_t) w;
+        rec->windows[rec->count++] = (uint16_t) ((w << 8) | value);
+    }
+    return;
+}
+
+//frees the windows of a recoded exponent
+void nt_recoding_clear(nt_recoding_t *rec) {
+    free(rec->windows);
+    rec->windows = NULL;
+    rec->count = 0;
+    return;
+}
+
+//performs modular exponentiation out = (base ^ power) % n with a prebuilt Montgomery context
+//same sliding window as pow_mod, all products are reduced on the limbs without division
+void pow_mod_mont(mpz_t out, mpz_t base, mpz_t exponent, mont_t *ctx) {
+    mp_limb_t *ws = (mp_limb_t *) malloc(POW_LIMBS(ctx->size) * sizeof(mp_limb_t));
+    pow_mod_mont_ws(out, base, exponent, ctx, ws);
+    free(ws);
+    return;
+}
+
+//sets up scratch for moduli of up to bits bits
+void nt_ctx_init(nt_ctx_t *ctx, uint64_t bits) {
+    mp_size_t size = (mp_size_t) ((bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS);
+    if (size < 1) {
+        size = 1;
+    }
+    ctx->size = size;
+    ctx->limbs = (mp_limb_t *) malloc(POW_LIMBS(size) * sizeof(mp_limb_t));
+    for (uint64_t i = 0; i < NT_TEMPS; i++) {
+        mpz_init2(ctx->t[i], (2 * size + 1) * GMP_NUMB_BITS);
+    }
+    mont_alloc(&ctx->mont, size);
+    return;
+}
+
+//frees the scratch
+void nt_ctx_clear(nt_ctx_t *ctx) {
+    free(ctx->limbs);
+    for (uint64_t i = 0; i < NT_TEMPS; i++) {
+        mpz_clear(ctx->t[i]);
+    }
+    mont_clear(&ctx->mont);
+    ctx->limbs = NULL;
+    ctx->size = 0;
+    return;
+}
+
+//grows the limb scratch when a modulus of size limbs does not fit, the temporaries grow by
+//themselves
+static void nt_ctx_reserve(nt_ctx_t *ctx, mp_size_t size) {
+    if (size <= ctx->size) {
+        return;
+    }
+    free(ctx->limbs);
+    mont_clear(&ctx->mont);
+    ctx->size = size;
+    ctx->limbs = (mp_limb_t *) malloc(POW_LIMBS(size) * sizeof(mp_limb_t));
+    mont_alloc(&ctx->mont, size);
+    return;
+}
+
+//pow_mod_mont with the workspace taken from ctx instead of the heap
+void pow_mod_mont_ctx(mpz_t out, mpz_t base, mpz_t exponent, mont_t *mont, nt_ctx_t *ctx) {
+    nt_ctx_reserve(ctx, mont->size);
+    pow_mod_mont_ws(out, base, exponent, mont, ctx->limbs);
+    return;
+}
+
+//pow_mod_mont_ctx for an exponent recoded by nt_recode
+void pow_mod_mont_rec(mpz_t out, mpz_t base, nt_recoding_t *rec, mont_t *mont, nt_ctx_t *ctx) {
+    nt_ctx_reserve(ctx, mont->size);
+    pow_mod_mont_rec_ws(out, base, rec, mont, ctx->limbs);
+    return;
+}
+
+//pow_mod with the Montgomery context of an odd modulus rebuilt in ctx instead of allocated
+//even moduli, which RSA never has, still go through pow_mod
+void pow_mod_ctx(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus, nt_ctx_t *ctx) {
+    if ((mpz_sgn(exponent) <= 0) || mpz_even_p(modulus)) {
+        pow_mod(out, base, exponent, modulus);
+        return;
+    }
+    nt_ctx_reserve(ctx, mpz_size(modulus));
+    mont_set(&ctx->mont, modulus);
+    pow_mod_mont_ws(out, base, exponent, &ctx->mont, ctx->limbs);
+    return;
+}
 
-    while (mpz_cmp_ui(d, 0) > 0) {
-        mpz_t temp; //temp variable to hold d
-        mpz_init_set(temp, d);
-        mpz_mod_ui(temp, temp, 2);
-        if (mpz_cmp_ui(temp, 1) == 0) { //if d % 2 == 1
-            //out = (out * p) % modulus
-            mpz_mul(out, out, p);
-            mpz_mod(out, out, modulus);
+//odd primes used by the make_prime sieve, filled in on first use
+#define SIEVE_PRIMES 2048
+#define SIEVE_LIMIT  17900
+static uint32_t small_primes[SIEVE_PRIMES];
+static pthread_once_t small_primes_once = PTHREAD_ONCE_INIT;
+
+//sieve distance walked from one random start before drawing a new one
+#define MAX_STEP (1 << 20)
+
+//the first TRIAL_PRIMES of them are trial divided by is_prime, a group at a time: each group
+//is a run of primes whose product fits an unsigned long, so one division by the product
+//covers the whole run
+#define TRIAL_PRIMES 256
+static unsigned long trial_products[TRIAL_PRIMES];
+static uint64_t trial_ends[TRIAL_PRIMES]; //index of the prime after each group
+static uint64_t trial_groups;
+
+//fills small_primes with the first SIEVE_PRIMES odd primes and groups the trial primes
+static void init_small_primes(void) {
+    static bool composite[SIEVE_LIMIT];
+    uint64_t count = 0;
+    for (uint64_t i = 3; i < SIEVE_LIMIT && count < SIEVE_PRIMES; i += 2) {
+        if (composite[i]) {
+            continue;
         }
-        //p = (p * p) % modulus
-        mpz_mul(p, p, p);
-        mpz_mod(p, p, modulus);
+        small_primes[count++] = (uint32_t) i;
+        for (uint64_t j = i * i; j < SIEVE_LIMIT; j += 2 * i) {
+            composite[j] = true;
+        }
+    }
 
-        //d = d / 2
-        mpz_fdiv_q_ui(d, d, 2);
-        mpz_clear(temp);
+    unsigned long product = 1;
+    for (uint64_t i = 0; i < TRIAL_PRIMES; i++) {
+        if (product > ULONG_MAX / small_primes[i]) {
+            trial_products[trial_groups] = product;
+            trial_ends[trial_groups++] = i;
+            product = 1;
+        }
+        product *= small_primes[i];
     }
-    mpz_clear(p);
-    mpz_clear(d);
+    trial_products[trial_groups] = product;
+    trial_ends[trial_groups++] = TRIAL_PRIMES;
     return;
 }
 
 //tests if n is prime through an approximation iters times
 bool is_prime(mpz_t n, uint64_t iters) {
-    //hardcoded cases for 0 - 4
-    if (mpz_cmp_ui(n, 0) == 0) {
-        return false;
-    }
+    return is_prime_r(n, iters, state);
+}
 
-    if (mpz_cmp_ui(n, 1) == 0) {
-        return false;
+//tests if n is prime through an approximation iters times, drawing bases from st
+bool is_prime_r(mpz_t n, uint64_t iters, gmp_randstate_t st) {
+    nt_ctx_t ctx;
+    nt_ctx_init(&ctx, mpz_sizeinbase(n, 2));
+    bool prime = is_prime_ctx(n, iters, st, &ctx);
+    nt_ctx_clear(&ctx);
+    return prime;
+}
+
+//Miller-Rabin rounds with random bases that bring the chance of a random bits long odd
+//composite passing all of them below 2^-(2 * iters), the worst case bound of iters rounds
+//uses the bounds of Damgard, Landrock and Pomerance, "Average case error estimates for the
+//strong probable prime test", never more than iters rounds
+//the bounds only hold for candidates drawn at random, so only prime_search relies on them
+static uint64_t mr_rounds(uint64_t bits, uint64_t iters) {
+    double k = (double) bits;
+    double target = -2.0 * (double) iters;
+    if (bits < 21) {
+        return iters;
     }
-    if (mpz_cmp_ui(n, 2) == 0) {
+    for (uint64_t t = 1; t < iters; t++) {
+        double x = (double) t;
+        double bound; //log2 of the chance a composite passes t rounds
+        if (t == 1) {
+            bound = 2 * log2(k) + 2 * (2 - sqrt(k));
+        } else if (((t == 2) && (k >= 88)) || ((t >= 3) && (x <= k / 9))) {
+            bound = 1.5 * log2(k) + x - 0.5 * log2(x) + 2 * (2 - sqrt(x * k));
+        } else if (x >= k / 9) {
+            bound = log2(0.35 * k * pow(2, -5 * x) + pow(k, 3.75) / 7 * pow(2, -k / 2 - 2 * x)
+                         + 12 * k * pow(2, -k / 4 - 3 * x));
+        } else {
+            continue;
+        }
+        if (bound <= target) {
+            return t;
+        }
+    }
+    return iters;
+}
+
+//one strong probable prime test of odd n to base a, n - 1 = 2^s * r with r odd
+//the Montgomery context of ctx has to be set up for n, y comes from t[4]
+static bool strong_probable_prime(mpz_t n, mpz_t a, mpz_t r, uint64_t s, mpz_t n_minus_1,
+    nt_ctx_t *ctx, uint64_t *mults) {
+    mpz_ptr y = ctx->t[4];
+
+    //y = power-mod(a, r, n)
+    pow_mod_mont_ws(y, a, r, &ctx->mont, ctx->limbs);
+
+    //if y == 1 or y == n - 1
+    if ((mpz_cmp_ui(y, 1) == 0) || (mpz_cmp(y, n_minus_1) == 0)) {
         return true;
     }
-    if (mpz_cmp_ui(n, 3) == 0) {
+
+    //while j <= s - 1 and y != n - 1
+    for (uint64_t j = 1; (j <= s - 1) && (mpz_cmp(y, n_minus_1) != 0); j++) {
+        //y = y^2 % n
+        mpz_mul(y, y, y);
+        mpz_mod(y, y, n);
+        (*mults)++;
+
+        //if y == 1
+        if (mpz_cmp_ui(y, 1) == 0) {
+            return false;
+        }
+    }
+
+    //if y != n - 1, a is a witness that n is composite
+    return mpz_cmp(y, n_minus_1) == 0;
+}
+
+//x = x / 2 % n for odd n
+static void half_mod(mpz_t x, mpz_t n) {
+    mpz_mod(x, x, n);
+    if (mpz_odd_p(x)) {
+        mpz_add(x, x, n);
+    }
+    mpz_tdiv_q_2exp(x, x, 1);
+    return;
+}
+
+//strong Lucas probable prime test of an odd n that is not a perfect square
+//Selfridge's parameters: the first D of 5, -7, 9, -11, ... with (D/n) = -1, P = 1 and
+//Q = (1 - D) / 4, then with n + 1 = 2^s * d and d odd, n passes if U_d = 0 or V_(d*2^j) = 0
+//for some j < s
+//uses t[0] and t[2] to t[5] of ctx
+static bool strong_lucas(mpz_t n, nt_ctx_t *ctx, uint64_t *mults) {
+    mpz_ptr d = ctx->t[0];
+    mpz_ptr u = ctx->t[2];
+    mpz_ptr v = ctx->t[3];
+    mpz_ptr qk = ctx->t[4]; //Q^k for the index k reached so far
+    mpz_ptr du = ctx->t[5];
+
+    long disc = 5;
+    while (true) {
+        mpz_set_si(du, disc);
+        int jacobi = mpz_jacobi(du, n);
+        if (jacobi == -1) {
+            break;
+        }
+        if ((jacobi == 0) && (mpz_cmpabs_ui(n, (unsigned long) labs(disc)) != 0)) {
+            return false; //n shares a factor with D
+        }
+        disc = (disc > 0) ? -(disc + 2) : -(disc - 2);
+    }
+    long q = (1 - disc) / 4;
+
+    mpz_add_ui(d, n, 1);
+    uint64_t s = mpz_scan1(d, 0);
+    mpz_tdiv_q_2exp(d, d, s);
+
+    //binary chain over d from its top bit: U_1 = 1, V_1 = P = 1
+    mpz_set_ui(u, 1);
+    mpz_set_ui(v, 1);
+    mpz_set_si(qk, q);
+    mpz_mod(qk, qk, n);
+    for (int64_t i = (int64_t) mpz_sizeinbase(d, 2) - 2; i >= 0; i--) {
+        //U_2k = U_k * V_k, V_2k = V_k^2 - 2 * Q^k
+        mpz_mul(u, u, v);
+        mpz_mod(u, u, n);
+        mpz_mul(v, v, v);
+        mpz_submul_ui(v, qk, 2);
+        mpz_mod(v, v, n);
+        mpz_mul(qk, qk, qk);
+        mpz_mod(qk, qk, n);
+        *mults += 3;
+
+        //U_k+1 = (P * U_k + V_k) / 2, V_k+1 = (D * U_k + P * V_k) / 2
+        if (mpz_tstbit(d, i)) {
+            mpz_mul_si(du, u, disc);
+            mpz_add(u, u, v);
+            half_mod(u, n);
+            mpz_add(v, v, du);
+            half_mod(v, n);
+            mpz_mul_si(qk, qk, q);
+            mpz_mod(qk, qk, n);
+        }
+    }
+    if ((mpz_sgn(u) == 0) || (mpz_sgn(v) == 0)) {
         return true;
     }
-    if (mpz_cmp_ui(n, 4) == 0) {
+
+    //V_2k = V_k^2 - 2 * Q^k for the remaining doublings
+    for (uint64_t j = 1; j < s; j++) {
+        mpz_mul(v, v, v);
+        mpz_submul_ui(v, qk, 2);
+        mpz_mod(v, v, n);
+        if (mpz_sgn(v) == 0) {
+            return true;
+        }
+        mpz_mul(qk, qk, qk);
+        mpz_mod(qk, qk, n);
+        *mults += 2;
+    }
+    return false;
+}
+
+//tests if n is prime through an approximation, drawing bases from st
+//small primes are trial divided first, then n goes through a Baillie-PSW test, a strong test
+//to base 2 and a strong Lucas test, that no composite is known to pass
+//last come rounds Miller-Rabin rounds with random bases
+//all temporaries come from ctx, so testing candidate after candidate does not allocate
+static bool probable_prime(mpz_t n, uint64_t rounds, gmp_randstate_t st, nt_ctx_t *ctx) {
+    if (mpz_cmp_ui(n, 3) <= 0) {
+        return mpz_cmp_ui(n, 2) >= 0;
+    }
+    if (mpz_even_p(n)) {
         return false;
     }
 
-    //write n = 2^s * r + 1 such that r is odd
-    mpz_t r, r_temp, s;
-    mpz_init(r);
-    mpz_init_set_ui(s, 0);
-
-    //r = (n - 1) / 2^s·
-    //do-while r is not odd
-    do {
-        mpz_add_ui(s, s, 1); //s++
-        mpz_t n_temp; //temp variable to hold alterations to n
-        mpz_init_set(n_temp, n);
-        mpz_sub_ui(n_temp, n_temp, 1); // (n - 1)
-
-        mpz_t s_temp, one; //temporary variable to hold alterations to s
-        mpz_init_set(s_temp, s);
-        mpz_init_set_ui(one, 1); //mpz representation of 2 THERE HAS TO BE A BETTER WAY
-        mp_bitcnt_t s_temp_bit = mpz_get_ui(s_temp);
-        mpz_mul_2exp(s_temp, one, s_temp_bit); // 2^s
-
-        mpz_tdiv_q(r, n_temp, s_temp); //(n - 1) / (2^s)
-        //comparison check to see if r is odd
-        mpz_init_set(r_temp, r);
-        mpz_mod_ui(r_temp, r_temp, 2);
-        //gmp_printf("r_temp before test is %Zd \n", r_temp);
-
-        //clears
-        mpz_clear(n_temp);
-        mpz_clear(s_temp);
-        mpz_clear(one);
-    } while (mpz_cmp_ui(r_temp, 1) != 0); //while r % 2 == 1
-    //clear temp variables from do-while
-    mpz_clear(r_temp);
-
-    for (uint64_t i = 1; i <= iters; i++) {
-        //choose random a within {2,3,...,n-2}
-        mpz_t a, n_minus_three;
-        mpz_init(a);
-        mpz_init_set(n_minus_three, n);
+    //trial division, n below the square of the largest trial prime is settled by it
+    pthread_once(&small_primes_once, init_small_primes);
+    uint64_t first = 0;
+    for (uint64_t g = 0; g < trial_groups; g++) {
+        unsigned long rem = mpz_fdiv_ui(n, trial_products[g]);
+        for (uint64_t i = first; i < trial_ends[g]; i++) {
+            if (rem % small_primes[i] == 0) {
+                return mpz_cmp_ui(n, small_primes[i]) == 0;
+            }
+        }
+        first = trial_ends[g];
+    }
+    unsigned long largest = small_primes[TRIAL_PRIMES - 1];
+    if (mpz_cmp_ui(n, largest * largest) < 0) {
+        return true;
+    }
+
+    mpz_ptr r = ctx->t[0];
+    mpz_ptr n_minus_1 = ctx->t[1];
+    mpz_ptr n_minus_three = ctx->t[2];
+    mpz_ptr a = ctx->t[3];
+    mpz_sub_ui(n_minus_1, n, 1);
+
+    //write n = 2^s * r + 1 such that r is odd, s is the number of trailing zero bits
+    uint64_t s = mpz_scan1(n_minus_1, 0);
+    mpz_tdiv_q_2exp(r, n_minus_1, s);
+
+    //every round works modulo n, the Montgomery context is rebuilt in place for it
+    nt_ctx_reserve(ctx, mpz_size(n));
+    mont_set(&ctx->mont, n);
+
+    uint64_t tests = 1;
+    uint64_t mults = 0;
+    mpz_set_ui(a, 2);
+    bool prime = strong_probable_prime(n, a, r, s, n_minus_1, ctx, &mults);
+
+    //the Lucas test reuses t[0] and t[2] to t[5], r is recomputed after it
+    prime = prime && !mpz_perfect_square_p(n) && strong_lucas(n, ctx, &mults);
+    if (prime) {
+        mpz_tdiv_q_2exp(r, n_minus_1, s);
         mpz_sub_ui(n_minus_three, n, 3);
-        mpz_urandomm(a, state, n_minus_three);
+    }
+
+    for (uint64_t i = 1; (i <= rounds) && prime; i++) {
+        tests++;
+
+        //choose random a within {2,3,...,n-2}
+        mpz_urandomm(a, st, n_minus_three);
         mpz_add_ui(a, a, 2); //turns the range into [2, n-2]
+        prime = strong_probable_prime(n, a, r, s, n_minus_1, ctx, &mults);
+    }
 
-        //y = power-mod(a, r, n)
-        mpz_t y;
-        mpz_init(y);
-        pow_mod(y, a, r, n);
-
-        //if y != 1 and y != n - 1
-        mpz_t n_minus_1;
-        mpz_init(n_minus_1);
-        mpz_sub_ui(n_minus_1, n, 1);
-
-        if ((mpz_cmp_ui(y, 1) != 0) && (mpz_cmp(y, n_minus_1) != 0)) {
-            // j <-- 1
-            mpz_t j;
-            mpz_init_set_ui(j, 1);
-
-            //while j <= s - 1 and y != n - 1
-            mpz_t s_minus_1;
-            mpz_init(s_minus_1);
-            mpz_sub_ui(s_minus_1, s, 1);
-
-            while ((mpz_cmp(j, s_minus_1) <= 0) && (mpz_cmp(y, n_minus_1) != 0)) {
-                //power-mod(y, 2, n)
-                mpz_t two;
-                mpz_init_set_ui(two, 2);
-                pow_mod(y, y, two, n);
-                //mpz_clear(two);
-
-                //if y == 1
-                if (mpz_cmp_ui(y, 1) == 0) {
-                    return false;
-                }
+    stats_add(&stats.mr_rounds, tests);
+    stats_add(&stats.modmults, mults);
+    return prime;
+}
+
+//tests if n is prime through an approximation, drawing bases from st
+//n may come from anywhere, a pool file or a loaded key, so it gets all iters Miller-Rabin
+//rounds on top of the Baillie-PSW test, keeping a composite below 2^-(2 * iters) even in
+//the worst case
+bool is_prime_ctx(mpz_t n, uint64_t iters, gmp_randstate_t st, nt_ctx_t *ctx) {
+    return probable_prime(n, iters, st, ctx);
+}
 
-                //j <-- j + 1
-                mpz_add_ui(j, j, 1);
+//shared state of the workers racing for one prime
+//the prime found after the fewest candidates wins, ties go to the lowest worker, so the
+//winner only depends on the worker states and not on thread timing
+typedef struct {
+    _Atomic uint64_t best; //candidate count * workers + worker of the best prime so far
+    uint64_t workers;
+    pthread_mutex_t lock;
+} race_t;
+
+//true when p would also be acceptable for the public exponent e, gcd(e, p - 1) = 1
+static bool coprime_totient(mpz_t p, mpz_ptr e, nt_ctx_t *ctx) {
+    if (e == NULL) {
+        return true;
+    }
+    mpz_ptr p_minus_1 = ctx->t[6];
+    mpz_ptr d = ctx->t[7];
+    mpz_sub_ui(p_minus_1, p, 1);
+    gcd_ctx(d, e, p_minus_1, ctx);
+    return mpz_cmp_ui(d, 1) == 0;
+}
+
+//walks up from random odd starts until a prime bits long is found, stores it in p
+//a sieve of residues modulo the small primes throws out most composites so Miller-Rabin
+//only runs on the candidates that survive it
+//with a race, gives up once another worker has a better prime and returns false
+static bool prime_search(mpz_t p, uint64_t bits, uint64_t iters, mpz_ptr e, gmp_randstate_t st,
+    race_t *race, uint64_t worker) {
+    //counted locally and added to the stats once at the end
+    uint64_t candidates = 0, sieved = 0, mr_rejected = 0, restarts = 0, primes = 0;
+    uint64_t count = 0; //candidates looked at by this worker
+    bool found = false;
+
+    //keys of this worker's candidates, compared against the best one of the race
+    uint64_t workers = (race != NULL) ? race->workers : 1;
+    uint64_t key = worker;
+
+    uint32_t residues[SIEVE_PRIMES];
+    mpz_t start;
+    mpz_init2(start, bits);
+    nt_ctx_t ctx; //scratch shared by every candidate of the search
+    nt_ctx_init(&ctx, bits);
+
+    //the candidates are random odd numbers, so the average case bounds apply to them
+    uint64_t rounds = mr_rounds(bits, iters);
+
+    pthread_once(&small_primes_once, init_small_primes);
+
+    while (!found) {
+        //random odd start with the top bit set so every candidate is bits long
+        mpz_urandomb(start, st, bits);
+        mpz_setbit(start, bits - 1);
+        mpz_setbit(start, 0);
+
+        //small sizes could hit the sieve primes themselves, test those directly
+        bool sieve = (bits > 16);
+        if (sieve) {
+            for (uint64_t i = 0; i < SIEVE_PRIMES; i++) {
+                residues[i] = mpz_fdiv_ui(start, small_primes[i]);
+            }
+        }
 
-                //clears from while loop
-                mpz_clear(two);
+        uint64_t step;
+        for (step = 0; step < (sieve ? MAX_STEP : 2); step += 2) {
+            key = count * workers + worker;
+            if ((race != NULL) && (key > race->best)) {
+                break;
+            }
+            count++;
+            candidates++;
+
+            //residues track start + step, bumped by 2 for every candidate
+            if (sieve) {
+                bool divisible = false;
+                for (uint64_t i = 0; i < SIEVE_PRIMES; i++) {
+                    uint32_t r = residues[i];
+                    divisible |= (r == 0);
+                    r += 2;
+                    residues[i] = (r >= small_primes[i]) ? r - small_primes[i] : r;
+                }
+                if (divisible) {
+                    sieved++;
+                    continue;
+                }
             }
 
-            //if y!= n - 1
-            if (mpz_cmp(y, n_minus_1) != 0) {
-                return false;
+            mpz_add_ui(p, start, step);
+            if (mpz_sizeinbase(p, 2) > bits) {
+                break; //walked off the top, draw a new start
+            }
+            if (probable_prime(p, rounds, st, &ctx) && coprime_totient(p, e, &ctx)) {
+                primes++;
+                found = true;
+                break;
             }
+            mr_rejected++;
+        }
 
-            //clears from the if loop
-            mpz_clear(j);
-            mpz_clear(s_minus_1);
+        if ((race != NULL) && (key > race->best)) {
+            break;
+        }
+        if (!found && sieve) {
+            restarts++;
         }
+    }
 
-        //clears from the for loop
-        mpz_clear(a);
-        mpz_clear(n_minus_three);
-        mpz_clear(y);
-        mpz_clear(n_minus_1);
+    if (found && (race != NULL)) {
+        pthread_mutex_lock(&race->lock);
+        if (key < race->best) {
+            race->best = key;
+        } else {
+            found = false; //someone else got there with fewer candidates
+        }
+        pthread_mutex_unlock(&race->lock);
     }
 
-    //clears from the function
-    mpz_clear(r);
-    mpz_clear(s);
+    stats_add(&stats.candidates, candidates);
+    stats_add(&stats.sieved, sieved);
+    stats_add(&stats.mr_rejected, mr_rejected);
+    stats_add(&stats.restarts, restarts);
+    stats_add(&stats.found, primes);
 
-    return true;
+    mpz_clear(start);
+    nt_ctx_clear(&ctx);
+    return found;
 }
 
 //generates a prime number bits long, stores it in p
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
-    //generates a random number of size bits
-    do {
-        mpz_urandomb(p, state, bits);
-    } while ((!is_prime(p, iters)) || (mpz_sizeinbase(p, 2) < bits));
+    make_prime_r(p, bits, iters, state);
+    return;
+}
+
+//generates a prime number bits long with random values drawn from st, stores it in p
+void make_prime_r(mpz_t p, uint64_t bits, uint64_t iters, gmp_randstate_t st) {
+    prime_search(p, bits, iters, NULL, st, NULL, 0);
+    return;
+}
+
+//one worker of make_primes_parallel
+typedef struct {
+    mpz_t candidate;
+    gmp_randstate_t st;
+    uint64_t bits, iters, worker;
+    mpz_ptr e;
+    race_t *race;
+    bool won;
+} prime_worker_t;
+
+static void *prime_worker(void *arg) {
+    prime_worker_t *w = (prime_worker_t *) arg;
+    w->won = prime_search(w->candidate, w->bits, w->iters, w->e, w->st, w->race, w->worker);
+    return NULL;
+}
+
+//generates count primes at once, primes[i] is bits[i] long
+//when e is given every prime also has gcd(e, p - 1) = 1
+//threads are split evenly between the primes and race for them, each worker gets its own
+//random state split off st, so the primes only depend on st and threads
+void make_primes_parallel(mpz_ptr primes[], uint64_t bits[], uint64_t count, mpz_ptr e,
+    uint64_t iters, uint64_t threads, gmp_randstate_t st) {
+    uint64_t workers = (threads > count) ? threads / count : 1;
+    uint64_t total = count * workers;
+
+    race_t *races = (race_t *) malloc(count * sizeof(race_t));
+    prime_worker_t *pool = (prime_worker_t *) malloc(total * sizeof(prime_worker_t));
+    pthread_t *tids = (pthread_t *) malloc(total * sizeof(pthread_t));
+
+    for (uint64_t i = 0; i < count; i++) {
+        races[i].best = UINT64_MAX;
+        races[i].workers = workers;
+        pthread_mutex_init(&races[i].lock, NULL);
+    }
+    for (uint64_t i = 0; i < total; i++) {
+        prime_worker_t *w = &pool[i];
+        mpz_init(w->candidate);
+        randstate_split(w->st, st); //in a fixed order, before any thread starts
+        w->bits = bits[i / workers];
+        w->iters = iters;
+        w->worker = i % workers;
+        w->e = e;
+        w->race = &races[i / workers];
+        w->won = false;
+    }
+
+    //a single thread runs the workers one after the other, the race picks the same winners
+    if (threads <= 1) {
+        for (uint64_t i = 0; i < total; i++) {
+            prime_worker(&pool[i]);
+        }
+    } else {
+        for (uint64_t i = 0; i < total; i++) {
+            pthread_create(&tids[i], NULL, prime_worker, &pool[i]);
+        }
+        for (uint64_t i = 0; i < total; i++) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+
+    //the winner of each race is the worker whose key ended up as the best
+    for (uint64_t i = 0; i < total; i++) {
+        prime_worker_t *w = &pool[i];
+        race_t *race = w->race;
+        if (w->won && (race->best % workers == w->worker)) {
+            mpz_set(primes[i / workers], w->candidate);
+        }
+        mpz_clear(w->candidate);
+        gmp_randclear(w->st);
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        pthread_mutex_destroy(&races[i].lock);
+    }
+
+    free(races);
+    free(pool);
+    free(tids);
     return;
 }
 
 //computes the GCD of a and b, stores the value in d
 void gcd(mpz_t d, mpz_t a, mpz_t b) {
-    mpz_t b_temp;
-    mpz_init_set(d, a); //d = a in this context
-    mpz_init_set(b_temp, b);
+    nt_ctx_t ctx;
+    nt_ctx_init(&ctx, 0);
+    gcd_ctx(d, a, b, &ctx);
+    nt_ctx_clear(&ctx);
+    return;
+}
+
+//computes the GCD of a and b with temporaries from ctx, stores the value in d
+void gcd_ctx(mpz_t d, mpz_t a, mpz_t b, nt_ctx_t *ctx) {
+    mpz_ptr b_temp = ctx->t[0];
+    mpz_ptr temp = ctx->t[1];
+    mpz_set(b_temp, b);
+    mpz_set(d, a); //d = a in this context
 
     //while b != 0
     while (mpz_cmp_ui(b_temp, 0) != 0) {
         //temp = b_temp
-        mpz_t temp;
-        mpz_init_set(temp, b_temp);
+        mpz_set(temp, b_temp);
 
         //b = a % b
         mpz_mod(b_temp, d, b_temp);
 
         //a = temp
         mpz_set(d, temp);
-
-        mpz_clear(temp);
     }
-    mpz_clear(b_temp);
     return;
 }
 
 //computes inverse a % n, stores it in i, i set to 0 in case of no inverse
 void mod_inverse(mpz_t i, mpz_t a, mpz_t n) {
-    mpz_t r, r_prime, t_prime;
+    nt_ctx_t ctx;
+    nt_ctx_init(&ctx, 0);
+    mod_inverse_ctx(i, a, n, &ctx);
+    nt_ctx_clear(&ctx);
+    return;
+}
+
+//computes inverse a % n with temporaries from ctx, stores it in i, 0 if there is no inverse
+void mod_inverse_ctx(mpz_t i, mpz_t a, mpz_t n, nt_ctx_t *ctx) {
+    mpz_ptr r = ctx->t[0];
+    mpz_ptr r_prime = ctx->t[1];
+    mpz_ptr t_prime = ctx->t[2];
+    mpz_ptr q = ctx->t[3];
+    mpz_ptr temp = ctx->t[4]; //temp variable for parallel assignments
+
     //i is t in the pseudocode
     //(r, r') <- (n, a)
-    mpz_init_set(r, n);
-    mpz_init_set(r_prime, a);
+    mpz_set(r, n);
+    mpz_set(r_prime, a);
     //(t, t') <- (0, 1)
     mpz_set_ui(i, 0);
-    mpz_init_set_ui(t_prime, 1);
+    mpz_set_ui(t_prime, 1);
 
     //while r' != 0
     while (mpz_cmp_ui(r_prime, 0) != 0) {
-        mpz_t q;
-        mpz_init(q);
         //q <- [r / r']
         mpz_fdiv_q(q, r, r_prime);
 
-        mpz_t temp; //temp variable for parallel assignments
         //r <- r'
-        mpz_init_set(temp, r);
+        mpz_set(temp, r);
         mpz_set(r, r_prime);
         //r' <- r - q * r'
         mpz_mul(r_prime, r_prime, q);
         mpz_sub(r_prime, temp, r_prime);
 
         //t <- t'
-        mpz_init_set(temp, i);
+        mpz_set(temp, i);
         mpz_set(i, t_prime);
         //t' <- t - q * t'
         mpz_mul(t_prime, t_prime, q);
         mpz_sub(t_prime, temp, t_prime);
-
-        //clear temp var
-        mpz_clear(q);
-        mpz_clear(temp);
     }
 
     //if r > 1
@@ -241,10 +973,5 @@ void mod_inverse(mpz_t i, mpz_t a, mpz_t n) {
         //t <- t + n
         mpz_add(i, i, n);
     }
-
-    //clear variables
-    mpz_clear(r);
-    mpz_clear(r_prime);
-    mpz_clear(t_prime);
     return;
 }
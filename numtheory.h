@@ -5,12 +5,70 @@
 #include <stdio.h>
 #include <gmp.h>
 
+#include "mont.h"
+
+//scratch integers held by an nt_ctx_t
+#define NT_TEMPS 8
+
+//largest window width used by pow_mod, bounds the odd-power table
+#define NT_MAX_WINDOW 6
+
+//preallocated scratch for the numtheory routines, sized once for the largest modulus so
+//loops that call them over and over never touch the heap
+//is_prime_ctx, gcd_ctx and mod_inverse_ctx use t[0] to t[5], t[6] and t[7] are left to
+//callers, a context belongs to one thread at a time
+typedef struct {
+    mp_size_t size; //limbs of the largest modulus the scratch has room for
+    mp_limb_t *limbs; //pow_mod_mont_ctx workspace: odd-power table, accumulator and product
+    mpz_t t[NT_TEMPS]; //temporaries with room for products of two such moduli
+    mont_t mont; //Montgomery context rebuilt in place for one-off moduli
+} nt_ctx_t;
+
+//an exponent split into its sliding windows ahead of time by nt_recode
+typedef struct {
+    mp_limb_t limb; //the exponent itself when count is 0, 0 for exponents of 0 or less
+    uint64_t k; //widest window, sizes the odd-power table
+    uint64_t count; //windows, most significant first
+    uint16_t *windows; //width << 8 | value of each window, value 0 for a single zero bit
+} nt_recoding_t;
+
+void nt_ctx_init(nt_ctx_t *ctx, uint64_t bits);
+
+void nt_ctx_clear(nt_ctx_t *ctx);
+
 void gcd(mpz_t d, mpz_t a, mpz_t b);
 
+void gcd_ctx(mpz_t d, mpz_t a, mpz_t b, nt_ctx_t *ctx);
+
 void mod_inverse(mpz_t i, mpz_t a, mpz_t n);
 
+void mod_inverse_ctx(mpz_t i, mpz_t a, mpz_t n, nt_ctx_t *ctx);
+
 void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus);
 
+void pow_mod_ctx(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus, nt_ctx_t *ctx);
+
+void pow_mod_mont(mpz_t out, mpz_t base, mpz_t exponent, mont_t *ctx);
+
+void pow_mod_mont_ctx(mpz_t out, mpz_t base, mpz_t exponent, mont_t *mont, nt_ctx_t *ctx);
+
+uint64_t nt_window_bits(uint64_t bits);
+
+void nt_recode(nt_recoding_t *rec, mpz_t exponent);
+
+void nt_recoding_clear(nt_recoding_t *rec);
+
+void pow_mod_mont_rec(mpz_t out, mpz_t base, nt_recoding_t *rec, mont_t *mont, nt_ctx_t *ctx);
+
 bool is_prime(mpz_t n, uint64_t iters);
 
+bool is_prime_r(mpz_t n, uint64_t iters, gmp_randstate_t st);
+
+bool is_prime_ctx(mpz_t n, uint64_t iters, gmp_randstate_t st, nt_ctx_t *ctx);
+
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+
+void make_prime_r(mpz_t p, uint64_t bits, uint64_t iters, gmp_randstate_t st);
+
+void make_primes_parallel(mpz_ptr primes[], uint64_t bits[], uint64_t count, mpz_ptr e,
+    uint64_t iters, uint64_t threads, gmp_randstate_t st);
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+
+typedef struct {
+    pipeline_read_fn read;
+    pipeline_work_fn work;
+    pipeline_write_fn write;
+    void *arg;
+
+    uint64_t depth;
+    uint64_t read_seq; //blocks read so far
+    uint64_t work_seq; //blocks handed to workers so far
+    uint64_t write_seq; //blocks written so far
+    bool eof; //the reader has seen the end of the input
+    bool *done; //done[slot] is set once a worker has processed the block in slot
+
+    pthread_mutex_t lock;
+    pthread_cond_t reader_cv; //a slot was freed by the writer
+    pthread_cond_t worker_cv; //a block was read or the input ended
+    pthread_cond_t writer_cv; //a block was processed or the input ended
+} pipeline_t;
+
+typedef struct {
+    pipeline_t *pl;
+    uint64_t worker;
+} worker_arg_t;
+
+//takes blocks in read order and processes them until the input runs out
+static void *pipeline_worker(void *arg) {
+    worker_arg_t *wa = (worker_arg_t *) arg;
+    pipeline_t *pl = wa->pl;
+
+    pthread_mutex_lock(&pl->lock);
+    while (true) {
+        while ((pl->work_seq == pl->read_seq) && !pl->eof) {
+            pthread_cond_wait(&pl->worker_cv, &pl->lock);
+        }
+        if (pl->work_seq == pl->read_seq) {
+            break; //input ended and everything has been handed out
+        }
+        uint64_t slot = pl->work_seq % pl->depth;
+        pl->work_seq++;
+        pthread_mutex_unlock(&pl->lock);
+
+        pl->work(pl->arg, slot, wa->worker);
+
+        pthread_mutex_lock(&pl->lock);
+        pl->done[slot] = true;
+        pthread_cond_signal(&pl->writer_cv);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+//writes processed blocks strictly in read order and hands their slots back to the reader
+static void *pipeline_writer(void *arg) {
+    pipeline_t *pl = (pipeline_t *) arg;
+
+    pthread_mutex_lock(&pl->lock);
+    while (true) {
+        uint64_t slot = pl->write_seq % pl->depth;
+        while (!pl->done[slot] && !(pl->eof && (pl->write_seq == pl->read_seq))) {
+            pthread_cond_wait(&pl->writer_cv, &pl->lock);
+        }
+        if (!pl->done[slot]) {
+            break; //input ended and everything has been written
+        }
+        pthread_mutex_unlock(&pl->lock);
+
+        pl->write(pl->arg, slot);
+
+        pthread_mutex_lock(&pl->lock);
+        pl->done[slot] = false;
+        pl->write_seq++;
+        pthread_cond_signal(&pl->reader_cv);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+//runs the pipeline over the whole input, the calling thread is the reader
+//threads is the number of workers, 1 or less runs read, work and write in turn on slot 0
+void pipeline_run(uint64_t threads, uint64_t depth, pipeline_read_fn read,
+    pipeline_work_fn work, pipeline_write_fn write, void *arg) {
+    if (threads <= 1) {
+        while (read(arg, 0)) {
+            work(arg, 0, 0);
+            write(arg, 0);
+        }
+        return;
+    }
+
+    pipeline_t pl = { 0 };
+    pl.read = read;
+    pl.work = work;
+    pl.write = write;
+    pl.arg = arg;
+    pl.depth = depth;
+    pl.done = (bool *) calloc(depth, sizeof(bool));
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.reader_cv, NULL);
+    pthread_cond_init(&pl.worker_cv, NULL);
+    pthread_cond_init(&pl.writer_cv, NULL);
+
+    pthread_t writer;
+    pthread_t *workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+    worker_arg_t *args = (worker_arg_t *) malloc(threads * sizeof(worker_arg_t));
+    pthread_create(&writer, NULL, pipeline_writer, &pl);
+    for (uint64_t i = 0; i < threads; i++) {
+        args[i].pl = &pl;
+        args[i].worker = i;
+        pthread_create(&workers[i], NULL, pipeline_worker, &args[i]);
+    }
+
+    pthread_mutex_lock(&pl.lock);
+    while (true) {
+        //wait for the slot of the next block to be written out
+        while (pl.read_seq - pl.write_seq >= depth) {
+            pthread_cond_wait(&pl.reader_cv, &pl.lock);
+        }
+        uint64_t slot = pl.read_seq % depth;
+        pthread_mutex_unlock(&pl.lock);
+
+        bool more = read(arg, slot);
+
+        pthread_mutex_lock(&pl.lock);
+        if (!more) {
+            pl.eof = true;
+            pthread_cond_broadcast(&pl.worker_cv);
+            pthread_cond_signal(&pl.writer_cv);
+            break;
+        }
+        pl.read_seq++;
+        pthread_cond_signal(&pl.worker_cv);
+    }
+    pthread_mutex_unlock(&pl.lock);
+
+    for (uint64_t i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_join(writer, NULL);
+
+    pthread_mutex_destroy(&pl.lock);
+    pthread_cond_destroy(&pl.reader_cv);
+    pthread_cond_destroy(&pl.worker_cv);
+    pthread_cond_destroy(&pl.writer_cv);
+    free(workers);
+    free(args);
+    free(pl.done);
+    return;
+}
+
+//parses the thread count of a -t option
+//returns 0 unless arg is a whole number from 1 to PIPELINE_MAX_THREADS, so "-1" cannot wrap
+//around to billions of workers
+uint64_t pipeline_parse_threads(const char *arg) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long threads = strtoull(arg, &end, 10);
+    if ((arg[0] == '-') || (end == arg) || (*end != '\0') || (errno != 0)
+        || (threads > PIPELINE_MAX_THREADS)) {
+        return 0;
+    }
+    return (uint64_t) threads;
+}
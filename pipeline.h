@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//ordered block pipeline: one reader, a pool of workers and one writer
+//blocks live in depth slots that are recycled in order, so at most depth blocks are in
+//flight and the writer sees them in the order they were read
+
+//fills slot with the next block, returns false at the end of the input
+typedef bool (*pipeline_read_fn)(void *arg, uint64_t slot);
+
+//processes the block in slot, worker is the index of the calling worker
+typedef void (*pipeline_work_fn)(void *arg, uint64_t slot, uint64_t worker);
+
+//writes out the processed block in slot
+typedef void (*pipeline_write_fn)(void *arg, uint64_t slot);
+
+//most threads a -t option takes, each one gets its own scratch
+#define PIPELINE_MAX_THREADS 1024
+
+void pipeline_run(uint64_t threads, uint64_t depth, pipeline_read_fn read,
+    pipeline_work_fn work, pipeline_write_fn write, void *arg);
+
+uint64_t pipeline_parse_threads(const char *arg);
@@ -0,0 +1,182 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "poly1305.h"
+
+//the accumulator and r are kept in 26-bit limbs, so the products of a block fit in 64 bits
+//and the sums of five of them never overflow
+#define LIMB_MASK 0x3ffffff
+
+//reads a little-endian word from buf
+static uint32_t get_le(const uint8_t *buf) {
+    return (uint32_t) buf[0] | ((uint32_t) buf[1] << 8) | ((uint32_t) buf[2] << 16)
+           | ((uint32_t) buf[3] << 24);
+}
+
+//stores value little-endian in buf
+static void put_le(uint8_t *buf, uint32_t value) {
+    buf[0] = (uint8_t) value;
+    buf[1] = (uint8_t) (value >> 8);
+    buf[2] = (uint8_t) (value >> 16);
+    buf[3] = (uint8_t) (value >> 24);
+    return;
+}
+
+//sets up the authenticator for key (POLY1305_KEY_SIZE bytes)
+void poly1305_init(poly1305_t *ctx, const uint8_t *key) {
+    //r is clamped as the algorithm requires, the top 4 bits of every word and the bottom 2 of
+    //the last three are cleared
+    ctx->r[0] = get_le(key) & 0x3ffffff;
+    ctx->r[1] = (get_le(key + 3) >> 2) & 0x3ffff03;
+    ctx->r[2] = (get_le(key + 6) >> 4) & 0x3ffc0ff;
+    ctx->r[3] = (get_le(key + 9) >> 6) & 0x3f03fff;
+    ctx->r[4] = (get_le(key + 12) >> 8) & 0x00fffff;
+    for (int i = 0; i < 5; i++) {
+        ctx->h[i] = 0;
+    }
+    for (int i = 0; i < 4; i++) {
+        ctx->pad[i] = get_le(key + 16 + 4 * i);
+    }
+    ctx->buf_len = 0;
+    return;
+}
+
+//adds the len / 16 whole blocks at in to the accumulator and multiplies by r after each
+//hibit is the bit above the 16 bytes of a block, 0 only for the padded last partial block
+static void poly1305_blocks(poly1305_t *ctx, const uint8_t *in, uint64_t len, uint32_t hibit) {
+    uint64_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2], r3 = ctx->r[3], r4 = ctx->r[4];
+    //2^130 = 5 mod p, so the products that land above it come back multiplied by 5
+    uint64_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2], h3 = ctx->h[3], h4 = ctx->h[4];
+
+    while (len >= 16) {
+        h0 += get_le(in) & LIMB_MASK;
+        h1 += (get_le(in + 3) >> 2) & LIMB_MASK;
+        h2 += (get_le(in + 6) >> 4) & LIMB_MASK;
+        h3 += (get_le(in + 9) >> 6) & LIMB_MASK;
+        h4 += (get_le(in + 12) >> 8) | hibit;
+
+        uint64_t d0 = h0 * r0 + h1 * s4 + h2 * s3 + h3 * s2 + h4 * s1;
+        uint64_t d1 = h0 * r1 + h1 * r0 + h2 * s4 + h3 * s3 + h4 * s2;
+        uint64_t d2 = h0 * r2 + h1 * r1 + h2 * r0 + h3 * s4 + h4 * s3;
+        uint64_t d3 = h0 * r3 + h1 * r2 + h2 * r1 + h3 * r0 + h4 * s4;
+        uint64_t d4 = h0 * r4 + h1 * r3 + h2 * r2 + h3 * r1 + h4 * r0;
+
+        //partial reduction, the carries ripple once around and leave h just above 2^130
+        uint64_t c = d0 >> 26;
+        h0 = (uint32_t) d0 & LIMB_MASK;
+        d1 += c;
+        c = d1 >> 26;
+        h1 = (uint32_t) d1 & LIMB_MASK;
+        d2 += c;
+        c = d2 >> 26;
+        h2 = (uint32_t) d2 & LIMB_MASK;
+        d3 += c;
+        c = d3 >> 26;
+        h3 = (uint32_t) d3 & LIMB_MASK;
+        d4 += c;
+        c = d4 >> 26;
+        h4 = (uint32_t) d4 & LIMB_MASK;
+        h0 += (uint32_t) c * 5;
+        h1 += h0 >> 26;
+        h0 &= LIMB_MASK;
+
+        in += 16;
+        len -= 16;
+    }
+
+    ctx->h[0] = h0;
+    ctx->h[1] = h1;
+    ctx->h[2] = h2;
+    ctx->h[3] = h3;
+    ctx->h[4] = h4;
+    return;
+}
+
+//adds the len bytes at in to the message
+void poly1305_update(poly1305_t *ctx, const uint8_t *in, uint64_t len) {
+    if (ctx->buf_len > 0) {
+        uint64_t take = 16 - ctx->buf_len;
+        take = (take < len) ? take : len;
+        memcpy(ctx->buf + ctx->buf_len, in, take);
+        ctx->buf_len += take;
+        in += take;
+        len -= take;
+        if (ctx->buf_len < 16) {
+            return;
+        }
+        poly1305_blocks(ctx, ctx->buf, 16, 1 << 24);
+        ctx->buf_len = 0;
+    }
+    uint64_t whole = len & ~(uint64_t) 15;
+    poly1305_blocks(ctx, in, whole, 1 << 24);
+    memcpy(ctx->buf, in + whole, len - whole);
+    ctx->buf_len = len - whole;
+    return;
+}
+
+//writes the tag of the message to tag (POLY1305_TAG_SIZE bytes) and wipes the key
+void poly1305_final(poly1305_t *ctx, uint8_t *tag) {
+    //a last partial block gets a 1 byte right after it instead of the bit above 16 bytes
+    if (ctx->buf_len > 0) {
+        ctx->buf[ctx->buf_len] = 1;
+        memset(ctx->buf + ctx->buf_len + 1, 0, 16 - ctx->buf_len - 1);
+        poly1305_blocks(ctx, ctx->buf, 16, 0);
+    }
+
+    //full carry
+    uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2], h3 = ctx->h[3], h4 = ctx->h[4];
+    h2 += h1 >> 26;
+    h1 &= LIMB_MASK;
+    h3 += h2 >> 26;
+    h2 &= LIMB_MASK;
+    h4 += h3 >> 26;
+    h3 &= LIMB_MASK;
+    h0 += (h4 >> 26) * 5;
+    h4 &= LIMB_MASK;
+    h1 += h0 >> 26;
+    h0 &= LIMB_MASK;
+
+    //g = h - p, taken instead of h unless it went below zero, chosen with a mask so the time
+    //does not depend on h
+    uint32_t g0 = h0 + 5;
+    uint32_t g1 = h1 + (g0 >> 26);
+    g0 &= LIMB_MASK;
+    uint32_t g2 = h2 + (g1 >> 26);
+    g1 &= LIMB_MASK;
+    uint32_t g3 = h3 + (g2 >> 26);
+    g2 &= LIMB_MASK;
+    uint32_t g4 = h4 + (g3 >> 26) - (1u << 26);
+    g3 &= LIMB_MASK;
+    uint32_t keep_g = (g4 >> 31) - 1;
+    h0 = (h0 & ~keep_g) | (g0 & keep_g);
+    h1 = (h1 & ~keep_g) | (g1 & keep_g);
+    h2 = (h2 & ~keep_g) | (g2 & keep_g);
+    h3 = (h3 & ~keep_g) | (g3 & keep_g);
+    h4 = (h4 & ~keep_g) | (g4 & keep_g);
+
+    //h % 2^128 in 32-bit words, plus the pad
+    uint32_t w[4];
+    w[0] = h0 | (h1 << 26);
+    w[1] = (h1 >> 6) | (h2 << 20);
+    w[2] = (h2 >> 12) | (h3 << 14);
+    w[3] = (h3 >> 18) | (h4 << 8);
+    uint64_t f = 0;
+    for (int i = 0; i < 4; i++) {
+        f = (uint64_t) w[i] + ctx->pad[i] + (f >> 32);
+        put_le(tag + 4 * i, (uint32_t) f);
+    }
+
+    explicit_bzero(ctx, sizeof(*ctx));
+    return;
+}
+
+//compares two tags in a time that does not depend on where they differ
+bool poly1305_equal(const uint8_t *a, const uint8_t *b) {
+    uint8_t diff = 0;
+    for (int i = 0; i < POLY1305_TAG_SIZE; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
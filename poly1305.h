@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//Poly1305 one-time authenticator, the tag of a message under a 32 byte key that must never be
+//used for a second message
+//the message can be handed over in pieces of any length, the tag only depends on their
+//concatenation
+
+#define POLY1305_KEY_SIZE 32
+#define POLY1305_TAG_SIZE 16
+
+typedef struct {
+    uint32_t r[5]; //clamped first half of the key, 26-bit limbs
+    uint32_t h[5]; //accumulator, 26-bit limbs
+    uint32_t pad[4]; //second half of the key, added at the end
+    uint8_t buf[16]; //partial block carried over to the next call
+    uint64_t buf_len; //bytes in buf
+} poly1305_t;
+
+void poly1305_init(poly1305_t *ctx, const uint8_t *key);
+
+void poly1305_update(poly1305_t *ctx, const uint8_t *in, uint64_t len);
+
+void poly1305_final(poly1305_t *ctx, uint8_t *tag);
+
+bool poly1305_equal(const uint8_t *a, const uint8_t *b);
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <gmp.h>
+
+#include "numtheory.h"
+#include "pool.h"
+#include "stats.h"
+
+//opens the pool at path and locks it, -1 if either fails
+static int pool_open(const char *path, int flags, int lock) {
+    int fd = open(path, flags | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    if (flock(fd, lock) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//reads the whole locked pool into a NUL terminated buffer, NULL if it cannot be read
+static char *pool_read(int fd, uint64_t *len) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return NULL;
+    }
+    *len = (uint64_t) st.st_size;
+    char *data = (char *) malloc(*len + 1);
+    uint64_t done = 0;
+    while (done < *len) {
+        ssize_t got = pread(fd, data + done, *len - done, (off_t) done);
+        if (got <= 0) {
+            explicit_bzero(data, done);
+            free(data);
+            return NULL;
+        }
+        done += (uint64_t) got;
+    }
+    data[*len] = '\0';
+    return data;
+}
+
+static bool pool_write(int fd, const char *data, uint64_t len, uint64_t offset) {
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t put = pwrite(fd, data + done, len - done, (off_t) (offset + done));
+        if (put <= 0) {
+            return false;
+        }
+        done += (uint64_t) put;
+    }
+    return true;
+}
+
+//parses the line starting at line into bits and prime
+//the line has to be NUL terminated, returns false for anything that is not "bits hexprime"
+static bool pool_parse(char *line, uint64_t *bits, mpz_t prime) {
+    char *end = NULL;
+    *bits = (uint64_t) strtoull(line, &end, 10);
+    if ((end == line) || (*end != ' ') || (*bits < 2)) {
+        return false;
+    }
+    return (mpz_set_str(prime, end + 1, 16) == 0) && (mpz_sizeinbase(prime, 2) == *bits);
+}
+
+//marks in dup which of the count primes already have a line in the NUL terminated pool data
+static void pool_find(char *data, mpz_ptr primes[], uint64_t count, bool dup[]) {
+    mpz_t prime;
+    mpz_init(prime);
+    for (char *line = data; *line != '\0';) {
+        char *next = strchr(line, '\n');
+        if (next != NULL) {
+            *next = '\0';
+        }
+        uint64_t bits = 0;
+        if (pool_parse(line, &bits, prime)) {
+            for (uint64_t i = 0; i < count; i++) {
+                dup[i] = dup[i] || (mpz_cmp(primes[i], prime) == 0);
+            }
+        }
+        if (next != NULL) {
+            *next = '\n';
+        }
+        line = (next != NULL) ? next + 1 : line + strlen(line);
+    }
+    mpz_clear(prime);
+    return;
+}
+
+//appends count primes to the pool at path, primes[i] is bits[i] long
+//primes the pool already holds, or that come twice in primes, are skipped
+//*added gets the number of lines written
+//the pool is created owner only if it does not exist yet
+//returns false if the pool could not be opened, locked, read or written
+bool pool_add(
+    const char *path, mpz_ptr primes[], uint64_t bits[], uint64_t count, uint64_t *added) {
+    *added = 0;
+    int fd = pool_open(path, O_RDWR | O_CREAT, LOCK_EX);
+    if (fd == -1) {
+        return false;
+    }
+    uint64_t len = 0;
+    char *data = pool_read(fd, &len);
+    if (data == NULL) {
+        close(fd);
+        return false;
+    }
+    bool *dup = (bool *) calloc(count, sizeof(bool));
+    pool_find(data, primes, count, dup);
+    explicit_bzero(data, len);
+    free(data);
+
+    FILE *file = (lseek(fd, 0, SEEK_END) == -1) ? NULL : fdopen(fd, "a");
+    if (file == NULL) {
+        free(dup);
+        close(fd);
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        for (uint64_t j = 0; (j < i) && !dup[i]; j++) {
+            dup[i] = (mpz_cmp(primes[i], primes[j]) == 0);
+        }
+        if (!dup[i]) {
+            gmp_fprintf(file, "%" PRIu64 " %Zx\n", bits[i], primes[i]);
+            *added += 1;
+        }
+    }
+    bool ok = (fflush(file) == 0) && (fsync(fd) == 0);
+    fclose(file);
+    free(dup);
+    return ok;
+}
+
+//takes primes for a key out of the pool at path, primes[i] has to be bits[i] long
+//taken[i] is set for every prime found, the rest are left for the caller to generate
+//every prime taken is different from the others, has gcd(e, p - 1) = 1 when e is given and is
+//tested again with iters and st, lines that fail the test are dropped from the pool
+//every other line holding a prime that was taken is dropped as well, so a pool filled before
+//pool_add skipped duplicates cannot hand the same prime to a second key
+//the newest primes at the end of the file go first, so taking usually only shortens the file
+//returns false if the pool could not be read or rewritten, nothing is taken then
+bool pool_take(const char *path, mpz_ptr primes[], uint64_t bits[], bool taken[], uint64_t count,
+    mpz_ptr e, uint64_t iters, gmp_randstate_t st) {
+    for (uint64_t i = 0; i < count; i++) {
+        taken[i] = false;
+    }
+    int fd = pool_open(path, O_RDWR, LOCK_EX);
+    if (fd == -1) {
+        return false;
+    }
+    uint64_t len = 0;
+    char *data = pool_read(fd, &len);
+    if (data == NULL) {
+        close(fd);
+        return false;
+    }
+
+    mpz_t prime, g;
+    mpz_init(prime);
+    mpz_init(g);
+    uint64_t found = 0;
+    uint64_t first_removed = len;
+    uint64_t end = len;
+    while ((end > 0) && (found < count)) {
+        //a line runs from just past the previous newline up to end
+        uint64_t start = end;
+        while ((start > 0) && (data[start - 1] != '\n')) {
+            start--;
+        }
+        if (start == end) {
+            end = start - 1;
+            continue;
+        }
+        char saved = data[end];
+        data[end] = '\0';
+        uint64_t line_bits = 0;
+        bool parsed = pool_parse(data + start, &line_bits, prime);
+        data[end] = saved;
+
+        //the first prime of the key still missing at this size, and not already in it
+        uint64_t slot = count;
+        for (uint64_t i = 0; parsed && (i < count); i++) {
+            if (taken[i] && (mpz_cmp(primes[i], prime) == 0)) {
+                slot = count;
+                break;
+            }
+            if (!taken[i] && (bits[i] == line_bits) && (slot == count)) {
+                slot = i;
+            }
+        }
+        if (slot < count) {
+            mpz_sub_ui(g, prime, 1);
+            if (e != NULL) {
+                gcd(g, g, e);
+            }
+            if ((e == NULL) || (mpz_cmp_ui(g, 1) == 0)) {
+                if (is_prime_r(prime, iters, st)) {
+                    mpz_set(primes[slot], prime);
+                    taken[slot] = true;
+                    found++;
+                    stats_add(&stats.pooled, 1);
+                }
+                //taken or not a prime, either way it leaves the pool, wiped with its newline
+                uint64_t stop = (end < len) ? end + 1 : end;
+                memset(data + start, 0, stop - start);
+                first_removed = start;
+            }
+        }
+        end = (start > 0) ? start - 1 : 0;
+    }
+
+    //the rest of the file is searched for copies of the primes taken, wiped like them
+    for (uint64_t i = 0; (found > 0) && (i < len);) {
+        if ((data[i] == '\0') || (data[i] == '\n')) {
+            i++;
+            continue;
+        }
+        uint64_t stop = i;
+        while ((stop < len) && (data[stop] != '\n') && (data[stop] != '\0')) {
+            stop++;
+        }
+        char saved = data[stop];
+        data[stop] = '\0';
+        uint64_t line_bits = 0;
+        bool copy = pool_parse(data + i, &line_bits, prime);
+        data[stop] = saved;
+        bool dup = false;
+        for (uint64_t k = 0; copy && (k < count); k++) {
+            dup = dup || (taken[k] && (mpz_cmp(primes[k], prime) == 0));
+        }
+        stop = (saved == '\n') ? stop + 1 : stop;
+        if (dup) {
+            memset(data + i, 0, stop - i);
+            first_removed = (i < first_removed) ? i : first_removed;
+        }
+        i = stop;
+    }
+    mpz_clear(prime);
+    mpz_clear(g);
+
+    //the lines left are moved up over the removed ones and the old tail is zeroed on disk
+    //before the file is cut short, so no prime handed out is left in the file
+    bool ok = true;
+    if (first_removed < len) {
+        uint64_t kept = first_removed;
+        for (uint64_t i = first_removed; i < len; i++) {
+            if (data[i] != '\0') {
+                data[kept++] = data[i];
+            }
+        }
+        memset(data + kept, 0, len - kept);
+        ok = pool_write(fd, data + first_removed, len - first_removed, first_removed)
+             && (fdatasync(fd) == 0) && (ftruncate(fd, (off_t) kept) == 0) && (fsync(fd) == 0);
+    }
+    explicit_bzero(data, len);
+    free(data);
+    close(fd);
+    if (!ok) {
+        for (uint64_t i = 0; i < count; i++) {
+            taken[i] = false;
+        }
+    }
+    return ok;
+}
+
+//prints how many primes of each size the pool at path holds
+//returns false if the pool could not be read
+bool pool_list(const char *path, FILE *file) {
+    int fd = pool_open(path, O_RDONLY, LOCK_SH);
+    if (fd == -1) {
+        return false;
+    }
+    uint64_t len = 0;
+    char *data = pool_read(fd, &len);
+    close(fd);
+    if (data == NULL) {
+        return false;
+    }
+
+    //sizes in the order they first show up
+    uint64_t sizes = 0;
+    uint64_t cap = 8;
+    uint64_t *size_bits = (uint64_t *) malloc(cap * sizeof(uint64_t));
+    uint64_t *size_count = (uint64_t *) malloc(cap * sizeof(uint64_t));
+    uint64_t bad = 0;
+    mpz_t prime;
+    mpz_init(prime);
+    for (char *line = data; *line != '\0';) {
+        char *next = strchr(line, '\n');
+        if (next != NULL) {
+            *next = '\0';
+        }
+        uint64_t bits = 0;
+        if (*line == '\0') {
+            //empty lines are skipped
+        } else if (!pool_parse(line, &bits, prime)) {
+            bad++;
+        } else {
+            uint64_t i = 0;
+            while ((i < sizes) && (size_bits[i] != bits)) {
+                i++;
+            }
+            if (i == sizes) {
+                if (sizes == cap) {
+                    cap *= 2;
+                    size_bits = (uint64_t *) realloc(size_bits, cap * sizeof(uint64_t));
+                    size_count = (uint64_t *) realloc(size_count, cap * sizeof(uint64_t));
+                }
+                size_bits[sizes] = bits;
+                size_count[sizes++] = 0;
+            }
+            size_count[i]++;
+        }
+        line = (next != NULL) ? next + 1 : line + strlen(line);
+    }
+    for (uint64_t i = 0; i < sizes; i++) {
+        fprintf(file, "%" PRIu64 " bits: %" PRIu64 " primes\n", size_bits[i], size_count[i]);
+    }
+    if (bad > 0) {
+        fprintf(file, "unreadable lines: %" PRIu64 "\n", bad);
+    }
+    mpz_clear(prime);
+    explicit_bzero(data, len);
+    free(data);
+    free(size_bits);
+    free(size_count);
+    return true;
+}
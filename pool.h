@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+//prime pool
+//a text file of primes made ahead of time so keygen only has to read them, one per line as
+//  bits hexprime
+//every access holds an exclusive flock on the file, so several keygens and fillers can share it
+//primes taken out are overwritten on disk before the file is cut short, they never stay behind
+//in the pool for a second key
+//a prime is only ever in the pool once, adding one it already holds is skipped and taking one
+//removes every copy, so two keys never share a prime
+
+bool pool_add(
+    const char *path, mpz_ptr primes[], uint64_t bits[], uint64_t count, uint64_t *added);
+
+bool pool_take(const char *path, mpz_ptr primes[], uint64_t bits[], bool taken[], uint64_t count,
+    mpz_ptr e, uint64_t iters, gmp_randstate_t st);
+
+bool pool_list(const char *path, FILE *file);
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <gmp.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/random.h>
+
+#include "randstate.h"
+#include "numtheory.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "rsa.h"
+#include "stats.h"
+
+#define ITEMS "b:i:e:k:c:f:s:t:lvh"
+
+char *help_message
+    = "SYNOPSIS\n"
+      "   Fills a prime pool that keygen takes its primes from.\n\n"
+      "USAGE\n"
+      "   ./primepool [-hlv] [-b bits] [-e exponent] [-k primes] [-c keys] [-t threads]\n"
+      "               [-f poolfile]\n\n"
+      "OPTIONS\n"
+      "   -h              Display program help and usage.\n"
+      "   -v              Display verbose program output.\n"
+      "   -l              List the primes in the pool instead of adding any.\n"
+      "   -b bits         Minimum bits of the keys the primes are for (default: 256).\n"
+      "   -i confidence   Primes are wrong with odds below 4^-confidence (default: 50).\n"
+      "   -e exponent     Odd public exponent of at least 65537, 0 for random (default: 65537).\n"
+      "   -k primes       Primes in each key, 2 to 4 (default: 2).\n"
+      "   -c keys         Keys worth of primes to add (default: 16).\n"
+      "   -f poolfile     Prime pool file (default: rsa.pool).\n"
+      "   -s seed         Random seed for testing.\n"
+      "   -t threads      Threads searching for the primes (default: 1).\n"
+      "   --stats[=file]  Print counters and phase times (default: stderr).\n";
+
+//long options, --stats takes an optional file to write the counters to
+static struct option long_options[] = {
+    { "stats", optional_argument, NULL, 'S' },
+    { NULL, 0, NULL, 0 },
+};
+
+int main(int argc, char **argv) {
+
+    int opt = 0;
+
+    uint64_t modulus_bits = 256;
+    bool verbose = false;
+    bool list = false;
+    uint64_t iters = 50;
+    uint64_t pub_exp = 65537;
+    uint64_t threads = 1;
+    uint64_t primes = 2;
+    uint64_t keys = 16;
+    char *pool_path = "rsa.pool";
+    uint64_t seed = 0;
+    bool seeded = false;
+    bool show_stats = false;
+    char *stats_path = NULL;
+
+    while ((opt = getopt_long(argc, argv, ITEMS, long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'b': modulus_bits = (uint64_t) atoi(optarg); break;
+        case 'i': iters = (uint64_t) atoi(optarg); break;
+        case 'e': pub_exp = (uint64_t) strtoull(optarg, NULL, 10); break;
+        case 'k': primes = (uint64_t) atoi(optarg); break;
+        case 'c': keys = (uint64_t) strtoull(optarg, NULL, 10); break;
+        case 'f': pool_path = optarg; break;
+        case 's':
+            seed = (uint64_t) atoi(optarg);
+            seeded = true;
+            break;
+        case 't': threads = pipeline_parse_threads(optarg); break;
+        case 'l': list = true; break;
+        case 'v': verbose = true; break;
+        case 'S':
+            show_stats = true;
+            stats_path = optarg;
+            break;
+        default:
+        case 'h': fprintf(stderr, "%s", help_message); return 0;
+        }
+    }
+
+    if (list == true) {
+        if (pool_list(pool_path, stdout) != true) {
+            fprintf(stderr, "ERROR: unable to read prime pool - %d\n", errno);
+        }
+        return 0;
+    }
+
+    //the same exponents keygen takes, the pool is only any use for those
+    if ((pub_exp != 0) && ((pub_exp < 65537) || (pub_exp % 2 == 0))) {
+        fprintf(stderr, "ERROR: public exponent must be odd and at least 65537\n");
+        return 0;
+    }
+
+    if ((primes < 2) || (primes > RSA_MAX_PRIMES)) {
+        fprintf(stderr, "ERROR: number of primes must be between 2 and %d\n", RSA_MAX_PRIMES);
+        return 0;
+    }
+
+    if (threads == 0) {
+        fprintf(stderr, "ERROR: threads must be between 1 and %d\n", PIPELINE_MAX_THREADS);
+        return 0;
+    }
+
+    //without -s every run draws its own seed, two runs seeded from the clock in the same second
+    //would fill the pool with the same primes
+    if ((seeded != true) && (getrandom(&seed, sizeof(seed), 0) != sizeof(seed))) {
+        fprintf(stderr, "ERROR: unable to seed from getrandom - %d\n", errno);
+        return 0;
+    }
+    randstate_init(seed);
+
+    //the primes are made the way keygen would make them for the same options
+    uint64_t bits[RSA_MAX_PRIMES];
+    rsa_prime_bits(bits, modulus_bits, primes);
+    mpz_t made[RSA_MAX_PRIMES];
+    mpz_ptr made_ptrs[RSA_MAX_PRIMES];
+    for (uint64_t i = 0; i < primes; i++) {
+        mpz_init(made[i]);
+        made_ptrs[i] = made[i];
+    }
+    mpz_t e;
+    mpz_init_set_ui(e, pub_exp);
+
+    //one key at a time goes into the pool, so keygen can take from it while it fills
+    uint64_t start = stats_now();
+    uint64_t added = 0;
+    for (uint64_t k = 0; k < keys; k++) {
+        make_primes_parallel(
+            made_ptrs, bits, primes, (pub_exp != 0) ? e : NULL, iters, threads, state);
+        uint64_t written = 0;
+        if (pool_add(pool_path, made_ptrs, bits, primes, &written) != true) {
+            fprintf(stderr, "ERROR: unable to write prime pool - %d\n", errno);
+            break;
+        }
+        added += written;
+    }
+    stats_phase(STATS_KEYGEN, start);
+
+    if (verbose == true) {
+        fprintf(stdout, "added %" PRIu64 " primes in %.3f s\n", added,
+            (double) (stats_now() - start) / 1e9);
+        pool_list(pool_path, stdout);
+    }
+
+    if ((show_stats == true) && (stats_write(stats_path) != true)) {
+        fprintf(stderr, "ERROR: unable to open stats file - %d\n", errno);
+    }
+
+    randstate_clear();
+    for (uint64_t i = 0; i < primes; i++) {
+        mpz_clear(made[i]);
+    }
+    mpz_clear(e);
+    return 0;
+}
@@ -16,3 +16,15 @@ void randstate_clear(void) {
     gmp_randclear(state); //deallocates the random variable
     return;
 }
+
+//initializes child as an independent random state seeded from parent
+//threads each get their own child, splitting in a fixed order keeps every child tied to the seed
+void randstate_split(gmp_randstate_t child, gmp_randstate_t parent) {
+    mpz_t seed;
+    mpz_init(seed);
+    mpz_urandomb(seed, parent, 128);
+    gmp_randinit_mt(child);
+    gmp_randseed(child, seed);
+    mpz_clear(seed);
+    return;
+}
@@ -8,3 +8,5 @@ extern gmp_randstate_t state;
 void randstate_init(uint64_t seed);
 
 void randstate_clear(void);
+
+void randstate_split(gmp_randstate_t child, gmp_randstate_t parent);
@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define RINGIO_URING
+#endif
+
+#include "ringio.h"
+
+#ifdef RINGIO_URING
+
+//liburing is not a dependency, the three system calls are all the ring needs
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned count) {
+    return (int) syscall(__NR_io_uring_register, fd, op, arg, count);
+}
+
+//unmaps and closes what ring_init set up
+static void ring_clear(ringio_ring_t *r) {
+    if (r->sqe_map != NULL) {
+        munmap(r->sqe_map, r->sqe_size);
+    }
+    if ((r->cq_map != NULL) && (r->cq_map != r->sq_map)) {
+        munmap(r->cq_map, r->cq_size);
+    }
+    if (r->sq_map != NULL) {
+        munmap(r->sq_map, r->sq_size);
+    }
+    if (r->fd != -1) {
+        close(r->fd);
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    return;
+}
+
+//maps a ring of the kernel, NULL if it could not be
+static uint8_t *ring_map(int fd, uint64_t size, uint64_t offset) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        (off_t) offset);
+    return (map == MAP_FAILED) ? NULL : (uint8_t *) map;
+}
+
+//sets up an io_uring for RINGIO_DEPTH requests on the buffers at mem
+//registering the buffers lets the kernel pin them once instead of on every request, without
+//the locked memory for that the plain read and write ops are used
+//returns false, with r->fd -1, if the kernel has no io_uring or refuses one
+static bool ring_init(ringio_ring_t *r, uint8_t *mem) {
+    memset(r, 0, sizeof(*r));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = uring_setup(RINGIO_DEPTH, &p);
+    if (r->fd < 0) {
+        r->fd = -1;
+        return false;
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        r->sq_size = (r->sq_size > r->cq_size) ? r->sq_size : r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+    r->sq_map = ring_map(r->fd, r->sq_size, IORING_OFF_SQ_RING);
+    r->cq_map = single ? r->sq_map : ring_map(r->fd, r->cq_size, IORING_OFF_CQ_RING);
+    r->sqe_map = ring_map(r->fd, r->sqe_size, IORING_OFF_SQES);
+    if ((r->sq_map == NULL) || (r->cq_map == NULL) || (r->sqe_map == NULL)) {
+        ring_clear(r);
+        return false;
+    }
+
+    r->sq_tail = (unsigned *) (r->sq_map + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (r->sq_map + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (r->sq_map + p.sq_off.array);
+    r->cq_head = (unsigned *) (r->cq_map + p.cq_off.head);
+    r->cq_tail = (unsigned *) (r->cq_map + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (r->cq_map + p.cq_off.ring_mask);
+    r->sqes = r->sqe_map;
+    r->cqes = r->cq_map + p.cq_off.cqes;
+
+    struct iovec iov[RINGIO_DEPTH];
+    for (uint64_t i = 0; i < RINGIO_DEPTH; i++) {
+        iov[i].iov_base = mem + i * RINGIO_CHUNK;
+        iov[i].iov_len = RINGIO_CHUNK;
+    }
+    r->fixed = (uring_register(r->fd, IORING_REGISTER_BUFFERS, iov, RINGIO_DEPTH) == 0);
+    return true;
+}
+
+//queues one request on buffer idx and hands it to the kernel
+static void ring_submit(ringio_t *io, uint64_t idx, uint8_t *addr, uint64_t len, uint64_t off) {
+    ringio_ring_t *r = &io->ring;
+    unsigned tail = *r->sq_tail;
+    unsigned slot = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *) r->sqes)[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    if (io->writing) {
+        sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    } else {
+        sqe->opcode = r->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    }
+    sqe->fd = io->fd;
+    sqe->addr = (uint64_t) (uintptr_t) addr;
+    sqe->len = (uint32_t) len;
+    sqe->off = off;
+    sqe->buf_index = (uint16_t) idx;
+    sqe->user_data = idx;
+    r->sq_array[slot] = slot;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while ((uring_enter(r->fd, 1, 0, 0) < 0) && (errno == EINTR)) {
+    }
+    return;
+}
+
+#else
+
+static bool ring_init(ringio_ring_t *r, uint8_t *mem) {
+    (void) mem;
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    return false;
+}
+
+static void ring_clear(ringio_ring_t *r) {
+    r->fd = -1;
+    return;
+}
+
+#endif
+
+static void start(ringio_t *io, uint64_t idx);
+
+//records the result res of the request on buffer idx
+//interrupted requests are made again, as is the rest of a short write
+//the kernel cancels a blocked request when the thread that submitted it exits, and the file
+//loops submit from their worker threads, so a cancelled request is made again as well
+static void complete(ringio_t *io, uint64_t idx, int64_t res) {
+    if ((res == -EINTR) || (res == -EAGAIN) || (res == -ECANCELED)) {
+        start(io, idx);
+        return;
+    }
+    io->busy[idx] = false;
+    if (!io->writing) {
+        io->res[idx] = res;
+        return;
+    }
+    if (res <= 0) {
+        io->failed = true;
+        return;
+    }
+    io->head[idx] += (uint64_t) res;
+    if (io->head[idx] < io->fill[idx]) {
+        start(io, idx);
+    }
+    return;
+}
+
+//makes a request with a plain system call, or through stdio when there is no descriptor
+//returns the bytes moved or -errno
+static int64_t request_sync(ringio_t *io, uint8_t *addr, uint64_t len, uint64_t off) {
+    if (io->fd == -1) {
+        size_t got = io->writing ? fwrite(addr, 1, len, io->file) : fread(addr, 1, len, io->file);
+        return ferror(io->file) ? -EIO : (int64_t) got;
+    }
+    ssize_t got = 0;
+    if (io->writing) {
+        got = io->seekable ? pwrite(io->fd, addr, len, (off_t) off) : write(io->fd, addr, len);
+    } else {
+        got = io->seekable ? pread(io->fd, addr, len, (off_t) off) : read(io->fd, addr, len);
+    }
+    return (got < 0) ? -errno : got;
+}
+
+//starts the request on buffer idx, a read of a whole buffer or the unwritten rest of a write
+//without a ring it is made right away
+static void start(ringio_t *io, uint64_t idx) {
+    io->busy[idx] = true;
+    uint64_t done = io->writing ? io->head[idx] : 0;
+    uint8_t *addr = io->mem + idx * RINGIO_CHUNK + done;
+    uint64_t len = io->writing ? io->fill[idx] - done : RINGIO_CHUNK;
+    uint64_t off = io->seekable ? io->off[idx] + done : (uint64_t) -1;
+#ifdef RINGIO_URING
+    if (io->ring.fd != -1) {
+        ring_submit(io, idx, addr, len, off);
+        return;
+    }
+#endif
+    complete(io, idx, request_sync(io, addr, len, off));
+    return;
+}
+
+//waits for the request on buffer idx, recording the others that complete before it
+static void wait_buf(ringio_t *io, uint64_t idx) {
+#ifdef RINGIO_URING
+    ringio_ring_t *r = &io->ring;
+    while (io->busy[idx]) {
+        unsigned head = *r->cq_head;
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            if ((uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) && (errno != EINTR)) {
+                //the ring is unusable, give up on everything in flight
+                io->failed = true;
+                for (uint64_t i = 0; i < RINGIO_DEPTH; i++) {
+                    io->busy[i] = false;
+                    io->res[i] = -EIO;
+                }
+            }
+            continue;
+        }
+        struct io_uring_cqe *cqe = &((struct io_uring_cqe *) r->cqes)[head & *r->cq_mask];
+        uint64_t done = cqe->user_data;
+        int64_t res = cqe->res;
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+        complete(io, done, res);
+    }
+#else
+    (void) io;
+    (void) idx;
+#endif
+    return;
+}
+
+//waits for every request in flight
+static void wait_all(ringio_t *io) {
+    for (uint64_t i = 0; i < RINGIO_DEPTH; i++) {
+        wait_buf(io, i);
+    }
+    return;
+}
+
+//sets up io on the descriptor of FILE from where stdio left off
+static void ringio_open(ringio_t *io, FILE *file, bool writing) {
+    memset(io, 0, sizeof(*io));
+    io->file = file;
+    io->writing = writing;
+    io->fd = fileno(file);
+
+    //offsets only work on regular files, appends land at the end whatever the offset
+    struct stat st;
+    long pos = ftell(file);
+    io->seekable = (io->fd != -1) && (fstat(io->fd, &st) == 0) && S_ISREG(st.st_mode)
+                   && (pos >= 0) && ((fcntl(io->fd, F_GETFL) & O_APPEND) == 0);
+    io->offset = io->seekable ? (uint64_t) pos : 0;
+
+    void *mem = NULL;
+    if (posix_memalign(&mem, 4096, RINGIO_DEPTH * RINGIO_CHUNK) != 0) {
+        mem = NULL;
+    }
+    io->mem = (uint8_t *) mem;
+    io->ring.fd = -1;
+    if (io->fd != -1) {
+        ring_init(&io->ring, io->mem);
+    }
+    return;
+}
+
+//issues reads into every buffer but the one being consumed
+//a stream only gets its next read once the one before it has completed, so at most the
+//buffer being consumed and the one after it are in use
+static void issue_reads(ringio_t *io) {
+    uint64_t limit = (io->next > 0) ? io->next - 1 + RINGIO_DEPTH : RINGIO_DEPTH;
+    while (!io->eof && !io->failed && (io->issued < limit)) {
+        if (!io->seekable && (io->issued > 0) && io->busy[(io->issued - 1) % RINGIO_DEPTH]) {
+            break;
+        }
+        uint64_t idx = io->issued % RINGIO_DEPTH;
+        io->issued++;
+        io->off[idx] = io->offset;
+        io->offset += io->seekable ? RINGIO_CHUNK : 0;
+        start(io, idx);
+    }
+    return;
+}
+
+//sets up io to read FILE from where stdio left off, with the first reads already issued
+//stdio must not hold any of a stream that cannot seek, it would be skipped
+void ringio_open_read(ringio_t *io, FILE *file) {
+    ringio_open(io, file, false);
+    io->off[0] = io->offset;
+    issue_reads(io);
+    return;
+}
+
+//sets up io to write FILE from where stdio left off, whatever stdio holds is flushed first
+void ringio_open_write(ringio_t *io, FILE *file) {
+    fflush(file);
+    ringio_open(io, file, true);
+    return;
+}
+
+//moves on to the next read once the current buffer is used up
+//returns its first byte, or EOF at the end of the input or after an error
+int ringio_refill(ringio_t *io) {
+    while (!io->eof && !io->failed) {
+        uint64_t read = io->next++;
+        io->cur = read % RINGIO_DEPTH;
+        io->pos = 0;
+        io->fill[io->cur] = 0;
+        issue_reads(io);
+        wait_buf(io, io->cur);
+
+        int64_t res = io->res[io->cur];
+        if (res < 0) {
+            io->failed = true;
+            break;
+        }
+        if (res == 0) {
+            io->eof = true;
+            break;
+        }
+        io->fill[io->cur] = (uint64_t) res;
+        issue_reads(io);
+
+        //a short read of a regular file leaves the reads issued after it at the wrong
+        //offsets, they are made again from where it ended
+        if (io->seekable && ((uint64_t) res < RINGIO_CHUNK)) {
+            wait_all(io);
+            io->issued = io->next;
+            io->offset = io->off[io->cur] + (uint64_t) res;
+            issue_reads(io);
+        }
+        io->pos = 1;
+        return io->mem[io->cur * RINGIO_CHUNK];
+    }
+    io->pos = 0;
+    io->fill[io->cur] = 0;
+    return EOF;
+}
+
+//reads up to len bytes into buf, fewer only at the end of the input
+//returns the bytes read
+uint64_t ringio_read(ringio_t *io, void *buf, uint64_t len) {
+    uint8_t *out = (uint8_t *) buf;
+    uint64_t done = 0;
+    while (done < len) {
+        uint64_t avail = io->fill[io->cur] - io->pos;
+        if (avail == 0) {
+            int ch = ringio_refill(io);
+            if (ch == EOF) {
+                break;
+            }
+            out[done++] = (uint8_t) ch;
+            continue;
+        }
+        uint64_t take = (avail < len - done) ? avail : len - done;
+        memcpy(out + done, io->mem + io->cur * RINGIO_CHUNK + io->pos, take);
+        io->pos += take;
+        done += take;
+    }
+    return done;
+}
+
+//starts writing the current buffer and moves on to the next one
+//a stream waits for the write before it, so its writes reach the file in order
+static void flush_cur(ringio_t *io) {
+    uint64_t idx = io->cur;
+    if (io->fill[idx] == 0) {
+        return;
+    }
+    if (!io->seekable) {
+        wait_all(io);
+    }
+    if (!io->failed) {
+        io->off[idx] = io->offset;
+        io->offset += io->fill[idx];
+        io->head[idx] = 0;
+        start(io, idx);
+    }
+
+    io->cur = (idx + 1) % RINGIO_DEPTH;
+    wait_buf(io, io->cur);
+    io->fill[io->cur] = 0;
+    return;
+}
+
+//queues the len bytes at buf, full buffers are written behind the caller
+//returns false once a write has failed
+bool ringio_write(ringio_t *io, const void *buf, uint64_t len) {
+    const uint8_t *in = (const uint8_t *) buf;
+    while (len > 0) {
+        uint64_t room = RINGIO_CHUNK - io->fill[io->cur];
+        uint64_t take = (room < len) ? room : len;
+        memcpy(io->mem + io->cur * RINGIO_CHUNK + io->fill[io->cur], in, take);
+        io->fill[io->cur] += take;
+        in += take;
+        len -= take;
+        if (io->fill[io->cur] == RINGIO_CHUNK) {
+            flush_cur(io);
+        }
+    }
+    return !io->failed;
+}
+
+//writes out what is queued, waits for every request and frees io
+//a regular file's stream is left after the last byte read or written
+//returns false if a request failed
+bool ringio_close(ringio_t *io) {
+    if (io->writing) {
+        flush_cur(io);
+    }
+    wait_all(io);
+    if (io->seekable) {
+        uint64_t end = io->writing ? io->offset : io->off[io->cur] + io->pos;
+        fseek(io->file, (long) end, SEEK_SET);
+    }
+    ring_clear(&io->ring);
+    free(io->mem);
+    io->mem = NULL;
+    return !io->failed;
+}
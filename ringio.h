@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//asynchronous sequential I/O for the file loops on streams that are not memory mapped
+//reads are issued ahead of the caller and writes complete behind it, in RINGIO_DEPTH buffers
+//of RINGIO_CHUNK bytes, so the device or pipe stays busy while the workers compute
+//requests go through an io_uring with the buffers registered once, kernels without io_uring
+//fall back to plain read and write calls made in turn
+//regular files keep every buffer in flight at its own offset, pipes and files opened for
+//appending one at a time since their requests could complete out of order
+
+#define RINGIO_CHUNK ((uint64_t) 1 << 20) //bytes per request
+#define RINGIO_DEPTH 4 //buffers, and so requests in flight at most
+
+//kernel side of an io_uring, fd is -1 when requests are made with plain system calls
+typedef struct {
+    int fd;
+    bool fixed; //the buffers are registered with the ring
+    uint8_t *sq_map, *cq_map, *sqe_map; //mappings of the rings, cq_map may be sq_map
+    uint64_t sq_size, cq_size, sqe_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *sqes, *cqes;
+} ringio_ring_t;
+
+typedef struct {
+    int fd;
+    bool writing;
+    bool seekable; //requests carry offsets and may all be in flight at once
+    ringio_ring_t ring;
+    uint8_t *mem; //the buffers, one after the other
+    uint64_t offset; //file offset of the next request
+    uint64_t off[RINGIO_DEPTH]; //file offset of each buffer's request
+    uint64_t fill[RINGIO_DEPTH]; //bytes in each buffer, of a read buffer once it is consumed
+    uint64_t head[RINGIO_DEPTH]; //bytes of each write buffer already written
+    bool busy[RINGIO_DEPTH]; //a request on the buffer has not completed yet
+    int64_t res[RINGIO_DEPTH]; //bytes the last read on each buffer got, -errno on failure
+    uint64_t cur; //buffer being consumed or filled
+    uint64_t pos; //bytes of cur consumed by the reader
+    uint64_t issued; //reads issued so far, read k goes into buffer k % RINGIO_DEPTH
+    uint64_t next; //next read to consume
+    FILE *file; //read and written through stdio when it has no descriptor
+    bool eof; //the input ended, nothing more is read
+    bool failed; //a request failed, nothing more is read or written
+} ringio_t;
+
+void ringio_open_read(ringio_t *io, FILE *file);
+
+void ringio_open_write(ringio_t *io, FILE *file);
+
+uint64_t ringio_read(ringio_t *io, void *buf, uint64_t len);
+
+int ringio_refill(ringio_t *io);
+
+bool ringio_write(ringio_t *io, const void *buf, uint64_t len);
+
+bool ringio_close(ringio_t *io);
+
+//next byte of the input, EOF at its end, the byte at a time counterpart of ringio_read
+static inline int ringio_getc(ringio_t *io) {
+    if (io->pos < io->fill[io->cur]) {
+        return io->mem[io->cur * RINGIO_CHUNK + io->pos++];
+    }
+    return ringio_refill(io);
+}
+
+//next byte of the input without taking it, EOF at its end
+static inline int ringio_peek(ringio_t *io) {
+    int ch = ringio_getc(io);
+    if (ch != EOF) {
+        io->pos--;
+    }
+    return ch;
+}
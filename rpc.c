@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "rpc.h"
+
+//stores the low bytes of value big-endian in buf
+static void put_be(uint8_t *buf, uint64_t value, uint64_t bytes) {
+    for (uint64_t i = 0; i < bytes; i++) {
+        buf[bytes - 1 - i] = (uint8_t) (value >> (8 * i));
+    }
+    return;
+}
+
+//reads a big-endian value of bytes bytes from buf
+static uint64_t get_be(uint8_t *buf, uint64_t bytes) {
+    uint64_t value = 0;
+    for (uint64_t i = 0; i < bytes; i++) {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+//serializes hdr into the RPC_HEADER_SIZE bytes at buf
+void rpc_encode(uint8_t *buf, rpc_header_t *hdr) {
+    memcpy(buf, hdr->response ? RPC_RESPONSE_MAGIC : RPC_REQUEST_MAGIC, 4);
+    buf[4] = hdr->code;
+    buf[5] = hdr->flags;
+    put_be(buf + 6, hdr->key, 2);
+    put_be(buf + 8, hdr->len, 8);
+    return;
+}
+
+//parses the RPC_HEADER_SIZE bytes at buf into hdr
+//returns false if they are not a header or the payload is larger than RPC_MAX_PAYLOAD
+bool rpc_decode(uint8_t *buf, rpc_header_t *hdr) {
+    hdr->response = (memcmp(buf, RPC_RESPONSE_MAGIC, 4) == 0);
+    if (!hdr->response && (memcmp(buf, RPC_REQUEST_MAGIC, 4) != 0)) {
+        return false;
+    }
+    hdr->code = buf[4];
+    hdr->flags = buf[5];
+    hdr->key = (uint16_t) get_be(buf + 6, 2);
+    hdr->len = get_be(buf + 8, 8);
+    return hdr->len <= RPC_MAX_PAYLOAD;
+}
+
+//reads exactly len bytes from fd into buf, false at the end of the stream or on an error
+bool rpc_read(int fd, void *buf, uint64_t len) {
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t got = read(fd, (uint8_t *) buf + done, len - done);
+        if ((got < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        done += (uint64_t) got;
+    }
+    return true;
+}
+
+//writes all len bytes at buf to the socket fd
+//a peer that went away is an error rather than a SIGPIPE
+bool rpc_write(int fd, const void *buf, uint64_t len) {
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t put = send(fd, (const uint8_t *) buf + done, len - done, MSG_NOSIGNAL);
+        if ((put < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (put <= 0) {
+            return false;
+        }
+        done += (uint64_t) put;
+    }
+    return true;
+}
+
+//sends hdr followed by its hdr->len payload bytes
+bool rpc_send(int fd, rpc_header_t *hdr, const uint8_t *payload) {
+    uint8_t buf[RPC_HEADER_SIZE];
+    rpc_encode(buf, hdr);
+    return rpc_write(fd, buf, RPC_HEADER_SIZE)
+           && ((hdr->len == 0) || rpc_write(fd, payload, hdr->len));
+}
+
+//fills addr with path, false if the path does not fit a socket address
+static bool socket_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+//creates a listening socket at path that only its owner can connect to
+//a socket left behind by a daemon that is gone is replaced, one that still answers is not
+//returns the socket, -1 with errno set if it could not be created
+int rpc_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (!socket_addr(&addr, path)) {
+        return -1;
+    }
+    int running = rpc_connect(path);
+    if (running != -1) {
+        close(running);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    struct stat st;
+    if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    mode_t mask = umask(0077);
+    int bound = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+    if ((bound != 0) || (listen(fd, SOMAXCONN) != 0)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+//connects to the daemon listening at path, -1 with errno set if it could not
+int rpc_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (!socket_addr(&addr, path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+//sends the request req with its payload in and waits for the response
+//resp gets the response header and *out a malloced copy of its payload, NULL when empty
+//returns false if the connection failed or the answer was not a response
+bool rpc_call(int fd, rpc_header_t *req, const uint8_t *in, rpc_header_t *resp, uint8_t **out) {
+    uint8_t buf[RPC_HEADER_SIZE];
+    *out = NULL;
+    req->response = false;
+    if (!rpc_send(fd, req, in) || !rpc_read(fd, buf, RPC_HEADER_SIZE) || !rpc_decode(buf, resp)
+        || !resp->response) {
+        return false;
+    }
+    if (resp->len == 0) {
+        return true;
+    }
+    *out = (uint8_t *) malloc(resp->len);
+    if (!rpc_read(fd, *out, resp->len)) {
+        free(*out);
+        *out = NULL;
+        return false;
+    }
+    return true;
+}
+
+//text for a response status as printed by the tools
+const char *rpc_status_name(uint8_t status) {
+    switch (status) {
+    case RPC_OK: return "ok";
+    case RPC_BAD_REQUEST: return "malformed request";
+    case RPC_BAD_KEY: return "no such key for this operation";
+    case RPC_BAD_INPUT: return "input does not fit this key or is damaged";
+    case RPC_NOT_VERIFIED: return "could not verify signature";
+    case RPC_FAILED: return "key too small for a session key or no randomness available";
+    default: return "unknown status";
+    }
+}
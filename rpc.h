@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//request protocol of the rsad key daemon
+//clients connect to a Unix domain socket and send requests, the daemon answers each one in
+//order on the same connection, every message is a fixed size header followed by its payload
+//
+//header layout, all fields big-endian:
+//  0  magic "RSAQ" for requests, "RSAR" for responses
+//  4  op of a request, status of a response
+//  5  flags
+//  6  key, the index of a loaded key in the order the daemon was given them
+//  8  payload bytes
+//
+//payloads:
+//  RPC_ENCRYPT  plaintext in, binary container out, hybrid with RPC_FLAG_HYBRID
+//  RPC_DECRYPT  binary or hybrid container in, plaintext out
+//  RPC_SIGN     message in, a big-endian number below n, signature out in as many bytes as n
+//  RPC_VERIFY   signature in as many bytes as n followed by the message in, nothing out
+
+#define RPC_REQUEST_MAGIC  "RSAQ"
+#define RPC_RESPONSE_MAGIC "RSAR"
+#define RPC_HEADER_SIZE    16
+#define RPC_MAX_PAYLOAD    ((uint64_t) 1 << 28) //largest payload either side accepts
+
+//operations a request asks for
+typedef enum {
+    RPC_ENCRYPT = 1,
+    RPC_DECRYPT,
+    RPC_SIGN,
+    RPC_VERIFY,
+} rpc_op_t;
+
+#define RPC_FLAG_HYBRID 1 //encrypt under a wrapped ChaCha20 session key
+
+//outcome of a request
+typedef enum {
+    RPC_OK,
+    RPC_BAD_REQUEST, //unknown op or a payload over RPC_MAX_PAYLOAD, the connection is closed
+    RPC_BAD_KEY, //no such key, or a key of the wrong kind for the op
+    RPC_BAD_INPUT, //not a container for this key or a damaged one, or a number not below n
+    RPC_NOT_VERIFIED, //the signature does not match the message
+    RPC_FAILED, //no randomness for a session key, or the key is too small for one
+} rpc_status_t;
+
+typedef struct {
+    bool response; //a response rather than a request
+    uint8_t code; //rpc_op_t of a request, rpc_status_t of a response
+    uint8_t flags;
+    uint16_t key;
+    uint64_t len; //payload bytes following the header
+} rpc_header_t;
+
+void rpc_encode(uint8_t *buf, rpc_header_t *hdr);
+
+bool rpc_decode(uint8_t *buf, rpc_header_t *hdr);
+
+bool rpc_read(int fd, void *buf, uint64_t len);
+
+bool rpc_write(int fd, const void *buf, uint64_t len);
+
+bool rpc_send(int fd, rpc_header_t *hdr, const uint8_t *payload);
+
+int rpc_listen(const char *path);
+
+int rpc_connect(const char *path);
+
+bool rpc_call(int fd, rpc_header_t *req, const uint8_t *in, rpc_header_t *resp, uint8_t **out);
+
+const char *rpc_status_name(uint8_t status);
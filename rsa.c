@@ -3,40 +3,148 @@
 #include <gmp.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <inttypes.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <unistd.h>
 
+#include "chacha.h"
+#include "container.h"
+#include "mapfile.h"
 #include "numtheory.h"
+#include "pipeline.h"
+#include "pool.h"
 #include "randstate.h"
+#include "ringio.h"
+#include "lz.h"
+#include "rsa.h"
+#include "stats.h"
 
-//creates a new RSA public key
-void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
-    //figure out how many bits go in p and how many go in q
-    uint64_t p_bits, q_bits;
-    //perhaps use the gmp random
-    p_bits = (random() % ((3 * nbits) / 4) - (nbits / 4) + 1) + (nbits / 4);
-    q_bits = nbits - p_bits;
+//sets up an empty set of extra primes
+void rsa_extra_init(rsa_extra_t *extra) {
+    extra->count = 0;
+    for (uint64_t i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        mpz_init(extra->r[i]);
+        mpz_init(extra->d[i]);
+        mpz_init(extra->t[i]);
+    }
+    return;
+}
 
-    p_bits++;
+//frees the extra primes
+void rsa_extra_clear(rsa_extra_t *extra) {
+    for (uint64_t i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        mpz_clear(extra->r[i]);
+        mpz_clear(extra->d[i]);
+        mpz_clear(extra->t[i]);
+    }
+    extra->count = 0;
+    return;
+}
 
-    make_prime(p, p_bits, iters);
-    make_prime(q, q_bits, iters);
+//number of primes in a key with the given extra primes, extra may be NULL
+static uint64_t prime_count(rsa_extra_t *extra) {
+    return 2 + ((extra != NULL) ? extra->count : 0);
+}
 
-    //n = p * q
-    mpz_mul(n, p, q);
+//true when no two of the count primes are equal
+static bool primes_distinct(mpz_ptr primes[], uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        for (uint64_t j = i + 1; j < count; j++) {
+            if (mpz_cmp(primes[i], primes[j]) == 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
 
-    //totient = (p - 1)(q - 1)
-    mpz_t totient, p_minus_1, q_minus_1;
-    mpz_init(p_minus_1);
-    mpz_init(p_minus_1);
-    mpz_init(totient);
+//how many bits go in each of the count primes of a key with an nbits long modulus
+//the primes are kept balanced so every CRT exponentiation costs the same, a product of
+//count primes can be up to count - 1 bits shorter than their sizes added up, so that
+//many bits go on top to keep n at least nbits long
+void rsa_prime_bits(uint64_t bits[], uint64_t nbits, uint64_t count) {
+    uint64_t total = nbits + count - 1;
+    for (uint64_t i = 0; i < count; i++) {
+        bits[i] = (total / count) + ((i < total % count) ? 1 : 0);
+    }
+    return;
+}
 
-    mpz_sub_ui(p_minus_1, p, 1);
-    mpz_sub_ui(q_minus_1, q, 1);
+//creates a new RSA public key
+//pub_exp is the fixed public exponent to use, 0 picks a random nbits long exponent
+//extra->count more primes are made beyond p and q when extra is given, NULL for two primes
+//the primes are searched for at the same time by threads workers
+void rsa_make_pub(mpz_t p, mpz_t q, rsa_extra_t *extra, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, uint64_t pub_exp, uint64_t threads) {
+    rsa_make_pub_pool(p, q, extra, n, e, nbits, iters, pub_exp, threads, NULL, state);
+    return;
+}
 
-    mpz_mul(totient, p_minus_1, q_minus_1);
+//rsa_make_pub, with the primes taken from the prime pool file at pool first
+//only the primes the pool cannot supply are searched for, NULL searches for all of them
+//every random number comes from st, so keys can be made on several threads at once
+void rsa_make_pub_pool(mpz_t p, mpz_t q, rsa_extra_t *extra, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, uint64_t pub_exp, uint64_t threads, const char *pool, gmp_randstate_t st) {
+    uint64_t start = stats_now();
+    uint64_t count = prime_count(extra);
+    mpz_ptr primes[RSA_MAX_PRIMES] = { p, q };
+    for (uint64_t i = 2; i < count; i++) {
+        primes[i] = extra->r[i - 2];
+    }
+    uint64_t bits[RSA_MAX_PRIMES];
+    rsa_prime_bits(bits, nbits, count);
 
-    mpz_clear(p_minus_1);
-    mpz_clear(q_minus_1);
+    //a fixed e has the primes retried until it is coprime with the totient
+    //gcd(e, (p - 1)(q - 1)...) = 1 exactly when e shares no factor with any p - 1
+    mpz_ptr coprime_with = NULL;
+    if (pub_exp != 0) {
+        mpz_set_ui(e, pub_exp);
+        coprime_with = e;
+    }
+    bool taken[RSA_MAX_PRIMES] = { false };
+    if (pool != NULL) {
+        pool_take(pool, primes, bits, taken, count, coprime_with, iters, st);
+    }
+    do {
+        //the pooled primes are already distinct, only the missing ones are searched for again
+        mpz_ptr missing[RSA_MAX_PRIMES];
+        uint64_t missing_bits[RSA_MAX_PRIMES];
+        uint64_t missing_count = 0;
+        for (uint64_t i = 0; i < count; i++) {
+            if (!taken[i]) {
+                missing[missing_count] = primes[i];
+                missing_bits[missing_count++] = bits[i];
+            }
+        }
+        if (missing_count > 0) {
+            make_primes_parallel(
+                missing, missing_bits, missing_count, coprime_with, iters, threads, st);
+        }
+    } while (!primes_distinct(primes, count));
+
+    //n = p * q * ...
+    mpz_set(n, p);
+    for (uint64_t i = 1; i < count; i++) {
+        mpz_mul(n, n, primes[i]);
+    }
+    if (pub_exp != 0) {
+        stats_phase(STATS_KEYGEN, start);
+        return;
+    }
+
+    //totient = (p - 1)(q - 1)...
+    mpz_t totient, prime_minus_1;
+    mpz_init_set_ui(totient, 1);
+    mpz_init(prime_minus_1);
+    for (uint64_t i = 0; i < count; i++) {
+        mpz_sub_ui(prime_minus_1, primes[i], 1);
+        mpz_mul(totient, totient, prime_minus_1);
+    }
+    mpz_clear(prime_minus_1);
 
     //finding plublic exponent e
     //stop loop when random num coprime with phi/totient, aka gcd = 1
@@ -44,12 +152,13 @@ void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t i
     mpz_init(d);
 
     do {
-        mpz_urandomb(e, state, nbits);
+        mpz_urandomb(e, st, nbits);
         gcd(d, e, totient);
     } while (mpz_cmp_ui(d, 1) != 0);
 
     mpz_clear(d);
     mpz_clear(totient);
+    stats_phase(STATS_KEYGEN, start);
     return;
 }
 
@@ -64,43 +173,446 @@ void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
 
 //reads a public key file
 void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
+    uint64_t start = stats_now();
     gmp_fscanf(pbfile, "%Zx %Zx %Zx %s", n, e, s, username);
+    stats_phase(STATS_KEY_LOAD, start);
     return;
 }
 
 //create a new RSA private key d
-void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q) {
-    mpz_t n, p_minus_1, q_minus_1;
+//extra holds the primes of the key beyond p and q, NULL for two-prime keys
+void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q, rsa_extra_t *extra) {
+    uint64_t start = stats_now();
+    mpz_t n, prime_minus_1;
     mpz_init(n);
+    mpz_init(prime_minus_1);
 
-    //creation of (p - 1) and (q - 1)
-    mpz_init(p_minus_1);
-    mpz_init(q_minus_1);
-    mpz_sub_ui(p_minus_1, p, 1);
-    mpz_sub_ui(q_minus_1, q, 1);
-
-    //creation of n = (p - 1)(n - 1)
-    mpz_mul(n, p_minus_1, q_minus_1);
+    //creation of n = (p - 1)(q - 1), times (r - 1) for every extra prime
+    mpz_sub_ui(n, p, 1);
+    mpz_sub_ui(prime_minus_1, q, 1);
+    mpz_mul(n, n, prime_minus_1);
+    for (uint64_t i = 0; i + 2 < prime_count(extra); i++) {
+        mpz_sub_ui(prime_minus_1, extra->r[i], 1);
+        mpz_mul(n, n, prime_minus_1);
+    }
 
     //calculation of d
     mod_inverse(d, e, n);
 
     mpz_clear(n);
-    mpz_clear(p_minus_1);
-    mpz_clear(q_minus_1);
+    mpz_clear(prime_minus_1);
+    stats_phase(STATS_KEYGEN, start);
+    return;
+}
+
+//computes the CRT values dp = d % (p - 1), dq = d % (q - 1) and qinv = q^-1 % p
+//every extra prime r gets d % (r - 1) and the inverse of the primes before it modulo r
+void rsa_make_crt(
+    mpz_t dp, mpz_t dq, mpz_t qinv, mpz_t d, mpz_t p, mpz_t q, rsa_extra_t *extra) {
+    uint64_t start = stats_now();
+    mpz_t prime_minus_1, before;
+    mpz_init(prime_minus_1);
+    mpz_init(before);
+
+    mpz_sub_ui(prime_minus_1, p, 1);
+    mpz_mod(dp, d, prime_minus_1);
+    mpz_sub_ui(prime_minus_1, q, 1);
+    mpz_mod(dq, d, prime_minus_1);
+    mod_inverse(qinv, q, p);
+
+    //before = p * q * the extra primes handled so far
+    mpz_mul(before, p, q);
+    for (uint64_t i = 0; i + 2 < prime_count(extra); i++) {
+        mpz_sub_ui(prime_minus_1, extra->r[i], 1);
+        mpz_mod(extra->d[i], d, prime_minus_1);
+        mod_inverse(extra->t[i], before, extra->r[i]);
+        mpz_mul(before, before, extra->r[i]);
+    }
+
+    mpz_clear(prime_minus_1);
+    mpz_clear(before);
+    stats_phase(STATS_KEYGEN, start);
     return;
 }
 
 //writes out a RSA private key to the file pvfile
-void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile) {
+//each extra prime follows the CRT values as its prime, exponent and coefficient
+void rsa_write_priv(mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *extra, FILE *pvfile) {
     gmp_fprintf(pvfile, "%Zx\n", n);
     gmp_fprintf(pvfile, "%Zx\n", d);
+    gmp_fprintf(pvfile, "%Zx\n", p);
+    gmp_fprintf(pvfile, "%Zx\n", q);
+    gmp_fprintf(pvfile, "%Zx\n", dp);
+    gmp_fprintf(pvfile, "%Zx\n", dq);
+    gmp_fprintf(pvfile, "%Zx\n", qinv);
+    for (uint64_t i = 0; i + 2 < prime_count(extra); i++) {
+        gmp_fprintf(pvfile, "%Zx\n", extra->r[i]);
+        gmp_fprintf(pvfile, "%Zx\n", extra->d[i]);
+        gmp_fprintf(pvfile, "%Zx\n", extra->t[i]);
+    }
     return;
 }
 
 //reads in an RSA private key from file pvfile
-void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile) {
+//extra gets the primes beyond p and q, a multi-prime key read without extra only has n and d
+//returns false if the file has no usable CRT values (old n/d only key files)
+bool rsa_read_priv(mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *extra, FILE *pvfile) {
+    uint64_t start = stats_now();
     gmp_fscanf(pvfile, "%Zx\n%Zx\n", n, d);
+
+    //the CRT values are optional, check that they actually belong to n
+    if (gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n", p, q, dp, dq, qinv) == 5) {
+        mpz_t product;
+        mpz_init(product);
+        mpz_mul(product, p, q);
+        if (extra != NULL) {
+            extra->count = 0;
+            while ((extra->count < RSA_MAX_PRIMES - 2)
+                   && (gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n", extra->r[extra->count],
+                           extra->d[extra->count], extra->t[extra->count])
+                       == 3)) {
+                mpz_mul(product, product, extra->r[extra->count]);
+                extra->count++;
+            }
+        }
+        bool valid = (mpz_cmp(product, n) == 0);
+        mpz_clear(product);
+        if (valid) {
+            stats_phase(STATS_KEY_LOAD, start);
+            return true;
+        }
+    }
+
+    mpz_set_ui(p, 0);
+    mpz_set_ui(q, 0);
+    mpz_set_ui(dp, 0);
+    mpz_set_ui(dq, 0);
+    mpz_set_ui(qinv, 0);
+    if (extra != NULL) {
+        extra->count = 0;
+    }
+    stats_phase(STATS_KEY_LOAD, start);
+    return false;
+}
+
+//combines res[i] = base ^ d % prime i, for p, q and the extra primes in that order, into
+//out = base ^ d % n (Garner's recombination), temporaries come from scratch
+static void crt_combine(mpz_t out, mpz_ptr res[], mpz_t p, mpz_t q, mpz_t qinv,
+    rsa_extra_t *extra, nt_ctx_t *scratch) {
+    mpz_ptr h = scratch->t[2];
+    mpz_ptr m = scratch->t[3]; //result modulo the primes combined so far
+    mpz_ptr before = scratch->t[4]; //product of the primes combined so far
+
+    //h = qinv * (m1 - m2) % p
+    mpz_sub(h, res[0], res[1]);
+    mpz_mul(h, h, qinv);
+    mpz_mod(h, h, p);
+
+    //m = m2 + h * q
+    mpz_mul(h, h, q);
+    mpz_add(m, res[1], h);
+
+    //fold in each extra prime r: m += before * ((base ^ d_r % r - m) * t_r % r)
+    if (prime_count(extra) > 2) {
+        mpz_mul(before, p, q);
+    }
+    for (uint64_t i = 0; i + 2 < prime_count(extra); i++) {
+        mpz_sub(h, res[2 + i], m);
+        mpz_mul(h, h, extra->t[i]);
+        mpz_mod(h, h, extra->r[i]);
+        mpz_mul(h, h, before);
+        mpz_add(m, m, h);
+        mpz_mul(before, before, extra->r[i]);
+    }
+
+    mpz_set(out, m);
+    return;
+}
+
+//computes out = base ^ d % n from the CRT values of d
+//mont_p, mont_q and mont_r are the Montgomery contexts of p, q and the extra primes, rec has
+//dp, dq and the exponents of the extra primes recoded in that order
+//temporaries come from scratch
+static void crt_pow(mpz_t out, mpz_t base, mpz_t p, mpz_t q, mpz_t qinv, rsa_extra_t *extra,
+    mont_t *mont_p, mont_t *mont_q, mont_t *mont_r, nt_recoding_t *rec, nt_ctx_t *scratch) {
+    mpz_ptr res[RSA_MAX_PRIMES] = { scratch->t[0], scratch->t[1], scratch->t[5], scratch->t[6] };
+
+    //m1 = base ^ dp % p, m2 = base ^ dq % q, and base ^ d_r % r for every extra prime
+    mpz_mod(res[0], base, p);
+    pow_mod_mont_rec(res[0], res[0], &rec[0], mont_p, scratch);
+    mpz_mod(res[1], base, q);
+    pow_mod_mont_rec(res[1], res[1], &rec[1], mont_q, scratch);
+    for (uint64_t i = 0; i + 2 < prime_count(extra); i++) {
+        mpz_mod(res[2 + i], base, extra->r[i]);
+        pow_mod_mont_rec(res[2 + i], res[2 + i], &rec[2 + i], &mont_r[i], scratch);
+    }
+
+    crt_combine(out, res, p, q, qinv, extra, scratch);
+    return;
+}
+
+//crt_pow for a single operation, sets up the contexts and scratch it needs and drops them
+static void crt_pow_once(mpz_t out, mpz_t base, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq,
+    mpz_t qinv, rsa_extra_t *extra) {
+    mont_t mont_p, mont_q, mont_r[RSA_MAX_PRIMES - 2];
+    nt_recoding_t rec[RSA_MAX_PRIMES];
+    nt_ctx_t scratch;
+    uint64_t bits = mpz_sizeinbase(p, 2) + mpz_sizeinbase(q, 2);
+    mont_init(&mont_p, p);
+    mont_init(&mont_q, q);
+    nt_recode(&rec[0], dp);
+    nt_recode(&rec[1], dq);
+    for (uint64_t i = 0; i + 2 < prime_count(extra); i++) {
+        mont_init(&mont_r[i], extra->r[i]);
+        nt_recode(&rec[2 + i], extra->d[i]);
+        bits += mpz_sizeinbase(extra->r[i], 2);
+    }
+    nt_ctx_init(&scratch, bits);
+    crt_pow(out, base, p, q, qinv, extra, &mont_p, &mont_q, mont_r, rec, &scratch);
+    mont_clear(&mont_p);
+    mont_clear(&mont_q);
+    for (uint64_t i = 0; i < prime_count(extra); i++) {
+        if (i >= 2) {
+            mont_clear(&mont_r[i - 2]);
+        }
+        nt_recoding_clear(&rec[i]);
+    }
+    nt_ctx_clear(&scratch);
+    return;
+}
+
+//heap allocations made by GMP since rsa_count_allocs was called
+static _Atomic uint64_t gmp_allocs;
+
+static void *count_alloc(size_t size) {
+    gmp_allocs++;
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        abort();
+    }
+    return ptr;
+}
+
+static void *count_realloc(void *ptr, size_t old_size, size_t new_size) {
+    (void) old_size;
+    gmp_allocs++;
+    ptr = realloc(ptr, new_size);
+    if (ptr == NULL) {
+        abort();
+    }
+    return ptr;
+}
+
+static void count_free(void *ptr, size_t size) {
+    (void) size;
+    free(ptr);
+    return;
+}
+
+//routes GMP's heap allocations through a counter, call before any integer is set up
+void rsa_count_allocs(void) {
+    mp_set_memory_functions(count_alloc, count_realloc, count_free);
+    return;
+}
+
+//heap allocations made by GMP since rsa_count_allocs, 0 when counting is off
+uint64_t rsa_allocs(void) {
+    return gmp_allocs;
+}
+
+//sets up the parts of a key context public and private keys share
+static void ctx_init(rsa_ctx_t *ctx, mpz_t n, uint64_t workers) {
+    uint64_t start = stats_now();
+    mpz_init_set(ctx->n, n);
+    mpz_init(ctx->e);
+    mpz_init(ctx->d);
+    mpz_init(ctx->p);
+    mpz_init(ctx->q);
+    mpz_init(ctx->dp);
+    mpz_init(ctx->dq);
+    mpz_init(ctx->qinv);
+    rsa_extra_init(&ctx->extra);
+    ctx->crt = false;
+    ctx->allocs = 0;
+    ctx->lanes = 0;
+    ctx->batch = NULL;
+
+    //every operation works modulo n, or modulo p and q, scratch is sized for n
+    mont_init(&ctx->mont_n, n);
+    ctx->workers = (workers > 1) ? workers : 1;
+    ctx->scratch = (nt_ctx_t *) malloc(ctx->workers * sizeof(nt_ctx_t));
+    for (uint64_t i = 0; i < ctx->workers; i++) {
+        nt_ctx_init(&ctx->scratch[i], mpz_sizeinbase(n, 2));
+    }
+    stats_phase(STATS_KEY_LOAD, start);
+    return;
+}
+
+//recodes every exponent of the context, the ones a key does not have are 0
+static void ctx_recode(rsa_ctx_t *ctx) {
+    nt_recode(&ctx->rec_e, ctx->e);
+    nt_recode(&ctx->rec_d, ctx->d);
+    nt_recode(&ctx->rec_crt[0], ctx->dp);
+    nt_recode(&ctx->rec_crt[1], ctx->dq);
+    for (uint64_t i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        nt_recode(&ctx->rec_crt[2 + i], ctx->extra.d[i]);
+    }
+    return;
+}
+
+//sets up a context for the public key (n, e) used by up to workers threads
+void rsa_ctx_init_pub(rsa_ctx_t *ctx, mpz_t n, mpz_t e, uint64_t workers) {
+    ctx_init(ctx, n, workers);
+    mpz_set(ctx->e, e);
+    ctx_recode(ctx);
+    rsa_ctx_batch(ctx);
+    return;
+}
+
+//sets up a context for a private key used by up to workers threads
+//p is NULL or 0 for keys without CRT values, those use d
+//extra holds the primes beyond p and q, NULL for two-prime keys
+void rsa_ctx_init_priv(rsa_ctx_t *ctx, mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq,
+    mpz_t qinv, rsa_extra_t *extra, uint64_t workers) {
+    ctx_init(ctx, n, workers);
+    mpz_set(ctx->d, d);
+    if ((p != NULL) && (mpz_sgn(p) != 0)) {
+        ctx->crt = true;
+        mpz_set(ctx->p, p);
+        mpz_set(ctx->q, q);
+        mpz_set(ctx->dp, dp);
+        mpz_set(ctx->dq, dq);
+        mpz_set(ctx->qinv, qinv);
+        mont_init(&ctx->mont_p, p);
+        mont_init(&ctx->mont_q, q);
+        for (uint64_t i = 0; i + 2 < prime_count(extra); i++) {
+            mpz_set(ctx->extra.r[i], extra->r[i]);
+            mpz_set(ctx->extra.d[i], extra->d[i]);
+            mpz_set(ctx->extra.t[i], extra->t[i]);
+            mont_init(&ctx->mont_r[i], extra->r[i]);
+            ctx->extra.count++;
+        }
+    }
+    ctx_recode(ctx);
+    rsa_ctx_batch(ctx);
+    return;
+}
+
+//sets up the multi-buffer kernel of every modulus of the key in ctx and the batch scratch of
+//each worker, once the moduli and workers are in place
+//the kernel is picked per modulus, the file functions only batch blocks when one of them
+//beats GMP on this CPU
+void rsa_ctx_batch(rsa_ctx_t *ctx) {
+    uint64_t count = ctx->crt ? prime_count(&ctx->extra) : 0;
+    mbexp_t *mb[RSA_MAX_PRIMES] = { &ctx->mb_p, &ctx->mb_q, &ctx->mb_r[0], &ctx->mb_r[1] };
+    mpz_ptr primes[RSA_MAX_PRIMES] = { ctx->p, ctx->q, ctx->extra.r[0], ctx->extra.r[1] };
+
+    mbexp_init(&ctx->mb_n, ctx->n, mbexp_select(mpz_sizeinbase(ctx->n, 2)));
+    uint64_t ws_size = mbexp_ws_size(&ctx->mb_n);
+    for (uint64_t i = 0; i < count; i++) {
+        mbexp_init(mb[i], primes[i], mbexp_select(mpz_sizeinbase(primes[i], 2)));
+        if (mbexp_ws_size(mb[i]) > ws_size) {
+            ws_size = mbexp_ws_size(mb[i]);
+        }
+    }
+    ctx->lanes = (ws_size > 0) ? MBEXP_LANES : 1;
+    if (ctx->lanes == 1) {
+        return;
+    }
+
+    //the residues of a batch are sized like the cypher text blocks
+    ctx->batch = (rsa_batch_t *) malloc(ctx->workers * sizeof(rsa_batch_t));
+    for (uint64_t w = 0; w < ctx->workers; w++) {
+        ctx->batch[w].ws = mbexp_ws_alloc(ws_size);
+        for (uint64_t i = 0; i < count; i++) {
+            for (uint64_t l = 0; l < MBEXP_LANES; l++) {
+                mpz_init2(ctx->batch[w].res[i][l], mpz_sizeinbase(ctx->n, 2) + GMP_NUMB_BITS);
+            }
+        }
+    }
+    return;
+}
+
+//drops the kernels and batch scratch set up by rsa_ctx_batch
+//a context dropped before rsa_ctx_batch ran has none
+static void ctx_batch_clear(rsa_ctx_t *ctx) {
+    if (ctx->lanes == 0) {
+        return;
+    }
+    uint64_t count = ctx->crt ? prime_count(&ctx->extra) : 0;
+    mbexp_t *mb[RSA_MAX_PRIMES] = { &ctx->mb_p, &ctx->mb_q, &ctx->mb_r[0], &ctx->mb_r[1] };
+    mbexp_clear(&ctx->mb_n);
+    for (uint64_t i = 0; i < count; i++) {
+        mbexp_clear(mb[i]);
+    }
+    for (uint64_t w = 0; (ctx->batch != NULL) && (w < ctx->workers); w++) {
+        mbexp_ws_free(ctx->batch[w].ws);
+        for (uint64_t i = 0; i < count; i++) {
+            for (uint64_t l = 0; l < MBEXP_LANES; l++) {
+                mpz_clear(ctx->batch[w].res[i][l]);
+            }
+        }
+    }
+    free(ctx->batch);
+    ctx->batch = NULL;
+    ctx->lanes = 0;
+    return;
+}
+
+//frees everything held by the context
+void rsa_ctx_clear(rsa_ctx_t *ctx) {
+    mpz_clear(ctx->n);
+    mpz_clear(ctx->e);
+    mpz_clear(ctx->d);
+    mpz_clear(ctx->p);
+    mpz_clear(ctx->q);
+    mpz_clear(ctx->dp);
+    mpz_clear(ctx->dq);
+    mpz_clear(ctx->qinv);
+    mont_clear(&ctx->mont_n);
+    if (ctx->crt) {
+        mont_clear(&ctx->mont_p);
+        mont_clear(&ctx->mont_q);
+        for (uint64_t i = 0; i < ctx->extra.count; i++) {
+            mont_clear(&ctx->mont_r[i]);
+        }
+    }
+    ctx_batch_clear(ctx);
+    rsa_extra_clear(&ctx->extra);
+    nt_recoding_clear(&ctx->rec_e);
+    nt_recoding_clear(&ctx->rec_d);
+    for (uint64_t i = 0; i < RSA_MAX_PRIMES; i++) {
+        nt_recoding_clear(&ctx->rec_crt[i]);
+    }
+    for (uint64_t i = 0; i < ctx->workers; i++) {
+        nt_ctx_clear(&ctx->scratch[i]);
+    }
+    free(ctx->scratch);
+    ctx->scratch = NULL;
+    return;
+}
+
+//out[i] = base[i] ^ exponent % modulus for count bases on the scratch of worker
+//runs of up to mb->lanes bases go through the multi-buffer kernel, a single base left over or
+//a run with a base out of range is done one at a time with mont
+static void batch_pow(mpz_ptr out[], mpz_ptr base[], uint64_t count, nt_recoding_t *rec,
+    mbexp_t *mb, mont_t *mont, rsa_ctx_t *ctx, uint64_t worker) {
+    for (uint64_t i = 0; i < count; i += mb->lanes) {
+        uint64_t run = (count - i < mb->lanes) ? count - i : mb->lanes;
+        bool vector = (mb->isa != MBEXP_SCALAR) && (run > 1);
+        for (uint64_t j = 0; vector && (j < run); j++) {
+            vector = (mpz_sgn(base[i + j]) >= 0) && (mpz_cmp(base[i + j], mb->modulus) < 0);
+        }
+        if (vector) {
+            mbexp_pow(mb, out + i, base + i, run, rec, ctx->batch[worker].ws);
+            continue;
+        }
+        for (uint64_t j = 0; j < run; j++) {
+            pow_mod_mont_rec(out[i + j], base[i + j], rec, mont, &ctx->scratch[worker]);
+        }
+    }
     return;
 }
 
@@ -110,75 +622,1587 @@ void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n) {
     return;
 }
 
+//encrypts message m with the key in ctx on the scratch of worker, stores the cypher text in c
+void rsa_encrypt_ctx(mpz_t c, mpz_t m, rsa_ctx_t *ctx, uint64_t worker) {
+    pow_mod_mont_rec(c, m, &ctx->rec_e, &ctx->mont_n, &ctx->scratch[worker]);
+    return;
+}
+
+//encrypts the count messages m[i] into c[i] with the key in ctx on the scratch of worker
+//count is at most ctx->lanes, the blocks share the kernel's vector lanes when it has one
+void rsa_encrypt_batch_ctx(
+    mpz_ptr c[], mpz_ptr m[], uint64_t count, rsa_ctx_t *ctx, uint64_t worker) {
+    if (ctx->lanes == 1) {
+        for (uint64_t i = 0; i < count; i++) {
+            rsa_encrypt_ctx(c[i], m[i], ctx, worker);
+        }
+        return;
+    }
+    batch_pow(c, m, count, &ctx->rec_e, &ctx->mb_n, &ctx->mont_n, ctx, worker);
+    return;
+}
+
+//blocks kept in flight per thread by the file pipelines
+#define BLOCKS_PER_THREAD 4
+
+//input of a file pipeline, a regular file is mapped and anything else is read ahead through
+//a ringio
+typedef struct {
+    mapfile_t map; //mapping of a regular file, base is NULL for streams
+    uint64_t pos; //next byte of the mapping
+    ringio_t io;
+} file_in_t;
+
+//maps INFILE from where stdio left off, or starts reading it ahead when it cannot be mapped
+static void input_open(file_in_t *in, FILE *infile) {
+    long pos = ftell(infile);
+    in->pos = (pos > 0) ? (uint64_t) pos : 0;
+    if (mapfile_open_read(infile, &in->map) && (pos >= 0) && (in->pos <= in->map.size)) {
+        return;
+    }
+    mapfile_close(&in->map);
+    ringio_open_read(&in->io, infile);
+    return;
+}
+
+//copies up to len bytes of the input into buf, fewer only at its end
+//returns the bytes copied
+static uint64_t input_read(file_in_t *in, uint8_t *buf, uint64_t len) {
+    if (in->map.base == NULL) {
+        return ringio_read(&in->io, buf, len);
+    }
+    uint64_t left = in->map.size - in->pos;
+    len = (left < len) ? left : len;
+    memcpy(buf, in->map.base + in->pos, len);
+    in->pos += len;
+    return len;
+}
+
+//next byte of the input without taking it, EOF at its end
+static int input_peek(file_in_t *in) {
+    if (in->map.base == NULL) {
+        return ringio_peek(&in->io);
+    }
+    return (in->pos < in->map.size) ? in->map.base[in->pos] : EOF;
+}
+
+//unmaps the input or stops reading it ahead
+static void input_close(file_in_t *in) {
+    if (in->map.base != NULL) {
+        mapfile_close(&in->map);
+    } else {
+        ringio_close(&in->io);
+    }
+    return;
+}
+
+//one block of a file being encrypted
+typedef struct {
+    uint8_t *block; //data read from a stream
+    uint8_t *src; //the block's data, in block or straight in the input mapping
+    uint64_t bytes; //data bytes in the block
+    uint64_t seq; //position of the block in the file
+    mpz_t m, c; //message and cypher text of the block
+    uint8_t *out; //fixed width cypher text for the binary container
+    char *text; //hex line of the cypher text
+    size_t len; //bytes in text
+} enc_block_t;
+
+//consecutive blocks encrypted together, up to ctx->lanes of them
+typedef struct {
+    enc_block_t *blocks;
+    uint64_t count;
+} enc_slot_t;
+
+//everything the encryption pipeline stages share
+typedef struct {
+    FILE *infile, *outfile;
+    rsa_ctx_t *ctx;
+    uint64_t block_size;
+    bool binary; //write a binary container instead of hex lines
+    uint64_t width; //bytes per binary cypher text block
+    file_in_t in;
+    mapfile_t out_map; //mapping of a regular output, base is NULL when out_io writes it
+    ringio_t out_io;
+    uint64_t read; //blocks read so far
+    uint64_t written; //blocks written so far
+    enc_slot_t *slots;
+    bool compress; //the input is compressed into lz frames that the blocks are taken from
+    lz_t *lz;
+    uint8_t *raw; //input of the frame being compressed
+    uint8_t *frame; //bytes the next blocks are taken from, NULL when they come from the input
+    uint64_t frame_len, frame_pos; //bytes in frame and bytes of them already taken
+} enc_job_t;
+
+//sets m to the bytes data bytes at src with the 0xFF padding byte right above them
+static void pad_block(mpz_t m, const uint8_t *src, uint64_t bytes) {
+    mpz_import(m, bytes, 1, 1, 1, 0, src);
+    for (uint64_t b = 0; b < 8; b++) {
+        mpz_setbit(m, 8 * bytes + b);
+    }
+    return;
+}
+
+//encrypts the bytes data bytes at src, padded as by pad_block, into c
+//m is the scratch for the padded message
+static void encrypt_block(mpz_t c, mpz_t m, const uint8_t *src, uint64_t bytes, rsa_ctx_t *ctx,
+    uint64_t worker) {
+    pad_block(m, src, bytes);
+    rsa_encrypt_ctx(c, m, ctx, worker);
+    return;
+}
+
+//stores c right aligned in the width bytes at out, the layout of a binary container block
+static void export_block(uint8_t *out, mpz_t c, uint64_t width) {
+    uint64_t len = (mpz_sgn(c) != 0) ? mpz_sizeinbase(c, 256) : 0;
+    memset(out, 0, width - len);
+    mpz_export(out + (width - len), NULL, 1, 1, 1, 0, c);
+    return;
+}
+
+//fills buf with up to len bytes of the framed input, fewer only at its end
+//frames are compressed one at a time as the blocks reach them, once compression was turned
+//off the frame buffer only passes on the input
+static uint64_t enc_read_frames(enc_job_t *job, uint8_t *buf, uint64_t len) {
+    uint64_t got = 0;
+    while (got < len) {
+        if (job->frame_pos == job->frame_len) {
+            job->frame_pos = 0;
+            if (!job->compress) {
+                job->frame_len = input_read(&job->in, job->frame, LZ_FRAME_SIZE);
+            } else {
+                uint64_t raw = input_read(&job->in, job->raw, LZ_FRAME_SIZE);
+                job->frame_len = (raw > 0) ? lz_compress(job->lz, job->frame, job->raw, raw) : 0;
+                stats_add(&stats.lz_plain, raw);
+                stats_add(&stats.lz_packed, job->frame_len);
+            }
+            if (job->frame_len == 0) {
+                break;
+            }
+        }
+        uint64_t take = job->frame_len - job->frame_pos;
+        take = (take < len - got) ? take : len - got;
+        memcpy(buf + got, job->frame + job->frame_pos, take);
+        job->frame_pos += take;
+        got += take;
+    }
+    return got;
+}
+
+//sets up compression and compresses the first frame of the input to see whether it pays
+//if that frame does not get smaller compression is turned off for the whole file: a mapped
+//input is taken from where it was, a stream from the frame already read
+static void enc_start_frames(enc_job_t *job) {
+    job->lz = (lz_t *) malloc(sizeof(lz_t));
+    job->raw = (uint8_t *) malloc(LZ_FRAME_SIZE);
+    job->frame = (uint8_t *) malloc(LZ_FRAME_BOUND);
+    job->frame_pos = 0;
+    job->frame_len = 0;
+
+    uint64_t pos = job->in.pos;
+    uint64_t raw = input_read(&job->in, job->raw, LZ_FRAME_SIZE);
+    if (raw > 0) {
+        job->frame_len = lz_compress(job->lz, job->frame, job->raw, raw);
+        if (lz_compressed(job->frame)) {
+            stats_add(&stats.lz_plain, raw);
+            stats_add(&stats.lz_packed, job->frame_len);
+            return;
+        }
+    }
+    job->compress = false;
+    if (job->in.map.base != NULL) {
+        job->in.pos = pos;
+        free(job->frame);
+        job->frame = NULL;
+    } else {
+        memcpy(job->frame, job->raw, raw);
+        job->frame_len = raw;
+    }
+    return;
+}
+
+//takes the next block from the frames, the input mapping or reads it from the stream
+static bool enc_read_block(enc_job_t *job, enc_block_t *b) {
+    if (job->frame != NULL) {
+        b->bytes = enc_read_frames(job, b->block, job->block_size - 1);
+        b->src = b->block;
+    } else if (job->in.map.base != NULL) {
+        uint64_t left = job->in.map.size - job->in.pos;
+        b->bytes = (left < job->block_size - 1) ? left : job->block_size - 1;
+        b->src = job->in.map.base + job->in.pos;
+        job->in.pos += b->bytes;
+    } else {
+        b->bytes = ringio_read(&job->in.io, b->block, job->block_size - 1);
+        b->src = b->block;
+    }
+    b->seq = job->read;
+    return b->bytes > 0;
+}
+
+//reader stage, fills the slot with up to ctx->lanes blocks
+static bool enc_read(void *arg, uint64_t slot) {
+    enc_job_t *job = (enc_job_t *) arg;
+    enc_slot_t *s = &job->slots[slot];
+    s->count = 0;
+    while ((s->count < job->ctx->lanes) && enc_read_block(job, &s->blocks[s->count])) {
+        s->count++;
+        job->read++;
+    }
+    return s->count > 0;
+}
+
+//worker stage, encrypts the blocks of a slot as one batch
+static void enc_work(void *arg, uint64_t slot, uint64_t worker) {
+    enc_job_t *job = (enc_job_t *) arg;
+    enc_slot_t *s = &job->slots[slot];
+    mpz_ptr m[MBEXP_LANES], c[MBEXP_LANES];
+    for (uint64_t i = 0; i < s->count; i++) {
+        pad_block(s->blocks[i].m, s->blocks[i].src, s->blocks[i].bytes);
+        m[i] = s->blocks[i].m;
+        c[i] = s->blocks[i].c;
+    }
+    rsa_encrypt_batch_ctx(c, m, s->count, job->ctx, worker);
+
+    for (uint64_t i = 0; i < s->count; i++) {
+        enc_block_t *b = &s->blocks[i];
+
+        //hex lines are formatted here so the writer only copies them out
+        if (!job->binary) {
+            mpz_get_str(b->text, 16, b->c);
+            b->len = strlen(b->text);
+            b->text[b->len++] = '\n';
+            continue;
+        }
+
+        //binary blocks are right aligned in width bytes, in place when the output is mapped
+        uint8_t *out = b->out;
+        if (job->out_map.base != NULL) {
+            out = job->out_map.base + CONTAINER_HEADER_SIZE + b->seq * job->width;
+        }
+        export_block(out, b->c, job->width);
+    }
+    return;
+}
+
+//writer stage, prints the encrypted blocks in order
+static void enc_write(void *arg, uint64_t slot) {
+    enc_job_t *job = (enc_job_t *) arg;
+    enc_slot_t *s = &job->slots[slot];
+    for (uint64_t i = 0; i < s->count; i++) {
+        enc_block_t *b = &s->blocks[i];
+        if (!job->binary) {
+            ringio_write(&job->out_io, b->text, b->len);
+        } else if (job->out_map.base == NULL) {
+            ringio_write(&job->out_io, b->out, job->width);
+        }
+        job->written++;
+        stats_add(&stats.blocks, 1);
+        stats_add(&stats.bytes_in, b->bytes);
+        stats_add(&stats.bytes_out, job->binary ? job->width : b->len);
+    }
+    return;
+}
+
+//number of blocks INFILE will split into, CONTAINER_UNKNOWN_COUNT unless it is a regular file
+static uint64_t count_blocks(FILE *infile, uint64_t block_size) {
+    struct stat st;
+    long pos = ftell(infile);
+    if ((fstat(fileno(infile), &st) != 0) || !S_ISREG(st.st_mode) || (pos < 0)) {
+        return CONTAINER_UNKNOWN_COUNT;
+    }
+    uint64_t remaining = (st.st_size > pos) ? (uint64_t) (st.st_size - pos) : 0;
+    return (remaining + (block_size - 2)) / (block_size - 1);
+}
+
 //encrypt the file INFILE, outputs to OUTFILE
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
+//threads workers encrypt blocks in parallel, the output is the same for any thread count
+//binary writes a container of fixed width blocks instead of hex lines
+void rsa_encrypt_file(
+    FILE *infile, FILE *outfile, mpz_t n, mpz_t e, uint64_t threads, bool binary) {
+    rsa_ctx_t ctx;
+    rsa_ctx_init_pub(&ctx, n, e, threads);
+    rsa_encrypt_file_ctx(infile, outfile, &ctx, binary, false);
+    rsa_ctx_clear(&ctx);
+    return;
+}
+
+//encrypt the file INFILE with the public key in ctx, outputs to OUTFILE
+//one worker per scratch context of ctx encrypts blocks in parallel
+//regular files are memory mapped: blocks are imported straight from the input and binary
+//blocks exported straight into the output, anything else is read ahead and written behind
+//through a ringio
+//compress packs the data into lz frames first so there are fewer blocks to encrypt, unless
+//its start does not compress; only a binary container can record it, hex lines are never
+//compressed
+//every buffer is set up before the first block, ctx->allocs counts what GMP allocates after
+void rsa_encrypt_file_ctx(
+    FILE *infile, FILE *outfile, rsa_ctx_t *ctx, bool binary, bool compress) {
+    uint64_t start = stats_now();
+    mpz_ptr n = ctx->n;
+    uint64_t threads = ctx->workers;
+    enc_job_t job;
+    job.infile = infile;
+    job.outfile = outfile;
+    job.ctx = ctx;
+    job.binary = binary;
+    job.width = mpz_sizeinbase(n, 256);
+    job.read = 0;
+    job.written = 0;
+
     //encryption must be done in blocks n - 1
-    uint64_t block_size = (mpz_sizeinbase(n, 2) - 1) / 8; //block in bytes
+    job.block_size = (mpz_sizeinbase(n, 2) - 1) / 8; //block in bytes
 
-    //array allocation
-    uint8_t *block = (uint8_t *) malloc(block_size);
-    block[0] = 0xFF; //padding
+    input_open(&job.in, infile);
+    job.out_map.base = NULL;
+    job.compress = compress && binary;
+    job.lz = NULL;
+    job.raw = NULL;
+    job.frame = NULL;
+    if (job.compress) {
+        enc_start_frames(&job);
+    }
 
-    //begin reading file while there are still items to read
-    uint64_t bytes_read = 0;
-    while ((bytes_read = fread((block + 1), 1, block_size - 1, infile)) > 0) {
-        mpz_t m;
-        mpz_init(m);
-        mpz_import(m, bytes_read + 1, 1, 1, 1, 0, block);
+    container_t hdr;
+    long hdr_pos = ftell(outfile);
+    if (binary) {
+        hdr.hybrid = false;
+        hdr.version = CONTAINER_VERSION;
+        hdr.flags = job.compress ? CONTAINER_FLAG_LZ : 0;
+        hdr.modulus_bits = (uint32_t) mpz_sizeinbase(n, 2);
+        hdr.block_width = (uint32_t) job.width;
+        //how far compressed data shrinks is only known once it has all been read
+        hdr.block_count = job.compress ? CONTAINER_UNKNOWN_COUNT
+                                       : count_blocks(infile, job.block_size);
 
-        //encryption
-        mpz_t c;
-        mpz_init(c);
-        rsa_encrypt(c, m, e, n);
+        //with the block count known the whole output can be laid out in a mapping
+        uint64_t size = CONTAINER_HEADER_SIZE + hdr.block_count * job.width;
+        if ((job.in.map.base != NULL) && (hdr.block_count != CONTAINER_UNKNOWN_COUNT)
+            && mapfile_open_write(outfile, &job.out_map, size)) {
+            container_encode(job.out_map.base, &hdr);
+        }
+    }
+    if (job.out_map.base == NULL) {
+        ringio_open_write(&job.out_io, outfile);
+        if (binary) {
+            uint8_t buf[CONTAINER_HEADER_SIZE];
+            container_encode(buf, &hdr);
+            ringio_write(&job.out_io, buf, CONTAINER_HEADER_SIZE);
+        }
+    }
+
+    //the slots bound how much of the file is held in memory at once
+    uint64_t depth = (threads > 1) ? threads * BLOCKS_PER_THREAD : 1;
+    job.slots = (enc_slot_t *) malloc(depth * sizeof(enc_slot_t));
+    for (uint64_t i = 0; i < depth; i++) {
+        job.slots[i].blocks = (enc_block_t *) malloc(ctx->lanes * sizeof(enc_block_t));
+        for (uint64_t j = 0; j < ctx->lanes; j++) {
+            enc_block_t *b = &job.slots[i].blocks[j];
+            b->block = (uint8_t *) malloc(job.block_size);
+            mpz_init2(b->m, mpz_sizeinbase(n, 2) + GMP_NUMB_BITS);
+            mpz_init2(b->c, mpz_sizeinbase(n, 2) + GMP_NUMB_BITS);
+            b->out = (uint8_t *) malloc(job.width);
+            b->text = (char *) malloc(2 * job.width + 2);
+        }
+    }
+
+    uint64_t allocs = rsa_allocs();
+    pipeline_run(threads, depth, enc_read, enc_work, enc_write, &job);
+    ctx->allocs = rsa_allocs() - allocs;
+
+    bool mapped = (job.out_map.base != NULL);
+    if (mapped) {
+        mapfile_finish(&job.out_map, outfile, CONTAINER_HEADER_SIZE + job.written * job.width);
+    } else {
+        ringio_close(&job.out_io);
+    }
+    if (!mapped && binary && (hdr.block_count != job.written) && (hdr_pos >= 0)) {
+        //fix up the block count when it was not known up front and the output can seek back
+        hdr.block_count = job.written;
+        if (fseek(outfile, hdr_pos, SEEK_SET) == 0) {
+            container_write(outfile, &hdr);
+            fseek(outfile, 0, SEEK_END);
+        }
+    }
+    input_close(&job.in);
+
+    for (uint64_t i = 0; i < depth; i++) {
+        for (uint64_t j = 0; j < ctx->lanes; j++) {
+            enc_block_t *b = &job.slots[i].blocks[j];
+            free(b->block);
+            free(b->out);
+            free(b->text);
+            mpz_clear(b->m);
+            mpz_clear(b->c);
+        }
+        free(job.slots[i].blocks);
+    }
+    free(job.slots);
+    free(job.lz);
+    free(job.raw);
+    free(job.frame);
+    stats_phase(STATS_ENCRYPT, start);
+    return;
+}
+
+//session key material wrapped in a hybrid container, the ChaCha20 key followed by its nonce
+#define SESSION_SIZE (CHACHA_KEY_SIZE + CHACHA_NONCE_SIZE)
+
+//fewest random bytes ahead of the session key material in its block
+#define SESSION_MIN_PAD 8
 
-        //writing encrypted values
-        gmp_fprintf(outfile, "%Zx\n", c);
+//payload bytes per hybrid pipeline slot, a whole number of cipher blocks
+#define HYBRID_CHUNK (1 << 16)
 
-        //clearing/reset bytes_read
+//keystream block the payload starts at, block 0 keys its Poly1305 tag
+#define HYBRID_PAYLOAD_BLOCK 1
+
+//one chunk of a hybrid payload
+typedef struct {
+    uint8_t *buf; //chunk read from a stream, or its output when the output is not mapped
+    uint8_t *src; //the chunk's data, in buf or straight in the input mapping
+    uint64_t bytes; //data bytes in the chunk
+    uint64_t seq; //position of the chunk in the payload
+} hy_slot_t;
+
+//everything the hybrid pipeline stages share
+typedef struct {
+    FILE *infile, *outfile;
+    rsa_ctx_t *ctx;
+    bool encrypt; //false when decrypting
+    chacha_t cipher; //keyed with the session key, encrypting and decrypting are the same xor
+    poly1305_t mac; //tag of the payload, taken over its cypher text in order
+    uint64_t width; //bytes of the wrapped session key
+    file_in_t *in; //input, already past the container header when decrypting
+    uint64_t end; //end of the payload in the input mapping, ahead of the tag when decrypting
+    uint8_t tail[POLY1305_TAG_SIZE]; //last bytes read from a stream, its tag once it ends
+    uint64_t tail_len; //bytes in tail
+    uint64_t payload; //payload bytes read so far
+    mapfile_t out_map; //mapping of a regular output, base is NULL when out_io writes it
+    ringio_t out_io;
+    uint64_t out_base; //where the payload starts in the output mapping
+    uint64_t read; //chunks read so far
+    hy_slot_t *slots;
+} hy_job_t;
+
+//fills buf with len bytes from the kernel's random source
+//the seeded random state of the key tools is reproducible, so it cannot make session keys
+static bool session_random(uint8_t *buf, uint64_t len) {
+    uint64_t got = 0;
+    while (got < len) {
+        ssize_t r = getrandom(buf + got, len - got, 0);
+        if ((r < 0) && (errno != EINTR)) {
+            return false;
+        }
+        got += (r > 0) ? (uint64_t) r : 0;
+    }
+    return true;
+}
+
+//data bytes of a block under the key in ctx, below its 0xFF padding byte
+static uint64_t session_block_bytes(rsa_ctx_t *ctx) {
+    uint64_t block_size = (mpz_sizeinbase(ctx->n, 2) - 1) / 8;
+    return (block_size > 0) ? block_size - 1 : 0;
+}
+
+//encrypts the session key material under the public key in ctx on the scratch of worker into
+//the width bytes at out
+//the material alone would be a short number that a small e does not wrap around n, so it fills
+//a whole block: the 0xFF padding byte, random nonzero bytes, a zero byte and the material
+//returns false if the key is too small for that or no randomness is available
+static bool session_wrap(
+    uint8_t *out, uint8_t *session, rsa_ctx_t *ctx, uint64_t worker, uint64_t width) {
+    uint64_t bytes = session_block_bytes(ctx);
+    if (bytes < SESSION_MIN_PAD + 1 + SESSION_SIZE) {
+        return false;
+    }
+    uint64_t pad = bytes - SESSION_SIZE - 1;
+    uint8_t *block = (uint8_t *) malloc(bytes);
+    bool wrapped = session_random(block, pad);
+    for (uint64_t i = 0; wrapped && (i < pad); i++) {
+        while (wrapped && (block[i] == 0)) {
+            wrapped = session_random(block + i, 1);
+        }
+    }
+    block[pad] = 0;
+    memcpy(block + pad + 1, session, SESSION_SIZE);
+    if (wrapped) {
+        mpz_t m, c;
+        mpz_init(m);
+        mpz_init(c);
+        encrypt_block(c, m, block, bytes, ctx, worker);
+        export_block(out, c, width);
         mpz_clear(m);
         mpz_clear(c);
-        bytes_read = 0;
     }
+    explicit_bzero(block, bytes);
+    free(block);
+    return wrapped;
+}
 
+//recovers the session key material from the width bytes at in with the private key in ctx on
+//the scratch of worker
+//returns false unless they decrypt to a whole block laid out as session_wrap makes it, which
+//is what a container made for another key almost never does
+static bool session_unwrap(
+    uint8_t *session, const uint8_t *in, rsa_ctx_t *ctx, uint64_t worker, uint64_t width) {
+    uint64_t bytes = session_block_bytes(ctx);
+    if (bytes < SESSION_MIN_PAD + 1 + SESSION_SIZE) {
+        return false;
+    }
+    uint64_t pad = bytes - SESSION_SIZE - 1;
+    uint8_t *block = (uint8_t *) malloc(bytes + 1);
+    mpz_t m, c;
+    mpz_init(m);
+    mpz_init(c);
+    mpz_import(c, width, 1, 1, 1, 0, in);
+    bool unwrapped = false;
+    if (mpz_cmp(c, ctx->n) < 0) {
+        rsa_decrypt_ctx(m, c, ctx, worker);
+        if (mpz_sizeinbase(m, 256) == bytes + 1) {
+            mpz_export(block, NULL, 1, 1, 1, 0, m);
+            unwrapped = (block[0] == 0xFF) && (block[pad + 1] == 0);
+            for (uint64_t i = 1; i <= pad; i++) {
+                unwrapped = unwrapped && (block[i] != 0);
+            }
+            memcpy(session, block + pad + 2, SESSION_SIZE);
+        }
+    }
+    explicit_bzero(block, bytes + 1);
     free(block);
+    mpz_clear(m);
+    mpz_clear(c);
+    return unwrapped;
+}
+
+//zero bytes that take tagged data of len bytes up to a multiple of 16
+static void hybrid_mac_pad(poly1305_t *mac, uint64_t len) {
+    static const uint8_t zero[16] = { 0 };
+    if (len % 16 != 0) {
+        poly1305_update(mac, zero, 16 - len % 16);
+    }
+    return;
+}
+
+//keys mac with keystream block 0 of cipher and starts it on the container header at header,
+//up to its count, and the width bytes of the wrapped session key at wrapped
+//the tag is taken as by the ChaCha20-Poly1305 AEAD of RFC 8439, with those two as the
+//additional data and the payload cypher text as the message, so the payload starts at
+//keystream block HYBRID_PAYLOAD_BLOCK
+static void hybrid_mac_start(poly1305_t *mac, chacha_t *cipher, const uint8_t *header,
+    const uint8_t *wrapped, uint64_t width) {
+    uint8_t key[CHACHA_BLOCK_SIZE] = { 0 };
+    chacha_xor(cipher, key, key, CHACHA_BLOCK_SIZE, 0);
+    poly1305_init(mac, key);
+    explicit_bzero(key, sizeof(key));
+    poly1305_update(mac, header, CONTAINER_COUNT_OFFSET);
+    poly1305_update(mac, wrapped, width);
+    hybrid_mac_pad(mac, CONTAINER_COUNT_OFFSET + width);
+    return;
+}
+
+//ends mac, started for a wrapped session key of width bytes, on a payload of payload bytes
+//and writes the tag to tag
+static void hybrid_mac_finish(poly1305_t *mac, uint64_t width, uint64_t payload, uint8_t *tag) {
+    uint8_t lengths[16];
+    uint64_t extra = CONTAINER_COUNT_OFFSET + width;
+    for (int i = 0; i < 8; i++) {
+        lengths[i] = (uint8_t) (extra >> (8 * i));
+        lengths[8 + i] = (uint8_t) (payload >> (8 * i));
+    }
+    hybrid_mac_pad(mac, payload);
+    poly1305_update(mac, lengths, sizeof(lengths));
+    poly1305_final(mac, tag);
+    return;
+}
+
+//reader stage, takes the next chunk from the input mapping or reads it from the stream
+//decrypting holds the last POLY1305_TAG_SIZE bytes of a stream back from every read, as they
+//may be its tag, and takes each chunk into the tag before the workers get it
+static bool hy_read(void *arg, uint64_t slot) {
+    hy_job_t *job = (hy_job_t *) arg;
+    hy_slot_t *s = &job->slots[slot];
+    file_in_t *in = job->in;
+    if (in->map.base != NULL) {
+        uint64_t left = job->end - in->pos;
+        s->bytes = (left < HYBRID_CHUNK) ? left : HYBRID_CHUNK;
+        s->src = in->map.base + in->pos;
+        in->pos += s->bytes;
+    } else if (job->encrypt) {
+        s->bytes = ringio_read(&in->io, s->buf, HYBRID_CHUNK);
+        s->src = s->buf;
+    } else {
+        memcpy(s->buf, job->tail, job->tail_len);
+        uint64_t got = job->tail_len
+                       + ringio_read(&in->io, s->buf + job->tail_len,
+                           HYBRID_CHUNK + POLY1305_TAG_SIZE - job->tail_len);
+        job->tail_len = (got < POLY1305_TAG_SIZE) ? got : POLY1305_TAG_SIZE;
+        s->bytes = got - job->tail_len;
+        memcpy(job->tail, s->buf + s->bytes, job->tail_len);
+        s->src = s->buf;
+    }
+    if (!job->encrypt) {
+        poly1305_update(&job->mac, s->src, s->bytes);
+    }
+    job->payload += s->bytes;
+    s->seq = job->read++;
+    return s->bytes > 0;
+}
+
+//worker stage, xors one chunk with its part of the keystream
+//the keystream of a chunk only depends on its position, so chunks need no ordering here
+static void hy_work(void *arg, uint64_t slot, uint64_t worker) {
+    hy_job_t *job = (hy_job_t *) arg;
+    hy_slot_t *s = &job->slots[slot];
+    (void) worker;
+    uint8_t *out = s->buf;
+    if (job->out_map.base != NULL) {
+        out = job->out_map.base + job->out_base + s->seq * HYBRID_CHUNK;
+    }
+    chacha_xor(&job->cipher, out, s->src, s->bytes,
+        HYBRID_PAYLOAD_BLOCK + s->seq * (HYBRID_CHUNK / CHACHA_BLOCK_SIZE));
+    return;
+}
+
+//writer stage, takes the encrypted chunks into the tag and writes out the chunks in order
+//unless the workers wrote them into the mapping
+static void hy_write(void *arg, uint64_t slot) {
+    hy_job_t *job = (hy_job_t *) arg;
+    hy_slot_t *s = &job->slots[slot];
+    uint8_t *out = s->buf;
+    if (job->out_map.base != NULL) {
+        out = job->out_map.base + job->out_base + s->seq * HYBRID_CHUNK;
+    }
+    if (job->encrypt) {
+        poly1305_update(&job->mac, out, s->bytes);
+    }
+    if (job->out_map.base == NULL) {
+        ringio_write(&job->out_io, s->buf, s->bytes);
+    }
+    stats_add(&stats.blocks, 1);
+    stats_add(&stats.bytes_in, s->bytes);
+    stats_add(&stats.bytes_out, s->bytes);
     return;
 }
 
+//streams the rest of the input through the cipher of job into OUTFILE, after the prefix_len
+//bytes at prefix
+//encrypting appends the tag of the payload, decrypting takes the last POLY1305_TAG_SIZE bytes
+//of the input as the tag and checks it once the payload is through, along with count, the
+//payload bytes the header announced
+//with a mapped input the whole output size is known, so a regular output is mapped as well
+//and the workers xor straight from one mapping into the other
+//returns false if the tag or the length do not match, a regular output is cut back to where
+//it started then, a pipe has already passed the payload on
+static bool hy_stream(hy_job_t *job, uint8_t *prefix, uint64_t prefix_len, uint64_t count) {
+    uint64_t threads = job->ctx->workers;
+    uint64_t tag_out = job->encrypt ? POLY1305_TAG_SIZE : 0;
+    uint64_t tag_in = job->encrypt ? 0 : POLY1305_TAG_SIZE;
+    file_in_t *in = job->in;
+    job->read = 0;
+    job->payload = 0;
+    job->tail_len = 0;
+    job->out_base = prefix_len;
+
+    uint64_t size = prefix_len;
+    job->out_map.base = NULL;
+    if (in->map.base != NULL) {
+        if (in->map.size - in->pos < tag_in) {
+            explicit_bzero(&job->cipher, sizeof(job->cipher));
+            explicit_bzero(&job->mac, sizeof(job->mac));
+            return false;
+        }
+        job->end = in->map.size - tag_in;
+        size += job->end - in->pos + tag_out;
+        mapfile_open_write(job->outfile, &job->out_map, size);
+    }
+    long out_start = ftell(job->outfile);
+    if (job->out_map.base == NULL) {
+        ringio_open_write(&job->out_io, job->outfile);
+        ringio_write(&job->out_io, prefix, prefix_len);
+    } else if (prefix_len > 0) {
+        memcpy(job->out_map.base, prefix, prefix_len);
+    }
+
+    uint64_t depth = (threads > 1) ? threads * BLOCKS_PER_THREAD : 1;
+    job->slots = (hy_slot_t *) malloc(depth * sizeof(hy_slot_t));
+    for (uint64_t i = 0; i < depth; i++) {
+        job->slots[i].buf = (uint8_t *) malloc(HYBRID_CHUNK + POLY1305_TAG_SIZE);
+    }
+
+    uint64_t allocs = rsa_allocs();
+    pipeline_run(threads, depth, hy_read, hy_work, hy_write, job);
+    job->ctx->allocs = rsa_allocs() - allocs;
+
+    uint8_t tag[POLY1305_TAG_SIZE];
+    hybrid_mac_finish(&job->mac, job->width, job->payload, tag);
+    bool valid = true;
+    if (job->encrypt && (job->out_map.base != NULL)) {
+        memcpy(job->out_map.base + size - POLY1305_TAG_SIZE, tag, POLY1305_TAG_SIZE);
+    } else if (job->encrypt) {
+        ringio_write(&job->out_io, tag, POLY1305_TAG_SIZE);
+    } else {
+        const uint8_t *want = (in->map.base != NULL) ? in->map.base + job->end : job->tail;
+        valid = ((in->map.base != NULL) || (job->tail_len == POLY1305_TAG_SIZE))
+                && poly1305_equal(tag, want)
+                && ((count == CONTAINER_UNKNOWN_COUNT) || (count == job->payload));
+    }
+
+    if (job->out_map.base != NULL) {
+        mapfile_finish(&job->out_map, job->outfile, valid ? size : 0);
+    } else {
+        ringio_close(&job->out_io);
+        if (!valid && (out_start >= 0) && (ftruncate(fileno(job->outfile), out_start) == 0)) {
+            fseek(job->outfile, out_start, SEEK_SET);
+        }
+    }
+
+    for (uint64_t i = 0; i < depth; i++) {
+        free(job->slots[i].buf);
+    }
+    free(job->slots);
+    explicit_bzero(&job->cipher, sizeof(job->cipher));
+    return valid;
+}
+
+//encrypts the file INFILE with the public key in ctx into a hybrid container on OUTFILE
+//only a random session key goes through RSA, the payload is streamed through ChaCha20 by the
+//workers of ctx, so large files move at close to memory speed instead of a modexp per block
+//the header records the payload length, filled in afterwards when the input is a stream and
+//the output can seek back, and a Poly1305 tag follows the payload
+//returns false if the key is too small to wrap a session key or no randomness is available
+bool rsa_encrypt_file_hybrid(FILE *infile, FILE *outfile, rsa_ctx_t *ctx) {
+    uint64_t start = stats_now();
+    uint64_t width = mpz_sizeinbase(ctx->n, 256);
+    uint8_t session[SESSION_SIZE];
+    if (!session_random(session, SESSION_SIZE)) {
+        stats_phase(STATS_ENCRYPT, start);
+        return false;
+    }
+    file_in_t in;
+    input_open(&in, infile);
+
+    //the header and the wrapped session key go ahead of the payload
+    uint64_t prefix_len = CONTAINER_HEADER_SIZE + width;
+    uint8_t *prefix = (uint8_t *) malloc(prefix_len);
+    container_t hdr;
+    hdr.hybrid = true;
+    hdr.version = CONTAINER_VERSION;
+    hdr.flags = 0;
+    hdr.modulus_bits = (uint32_t) mpz_sizeinbase(ctx->n, 2);
+    hdr.block_width = (uint32_t) width;
+    hdr.block_count = (in.map.base != NULL) ? in.map.size - in.pos : CONTAINER_UNKNOWN_COUNT;
+    container_encode(prefix, &hdr);
+    if (!session_wrap(prefix + CONTAINER_HEADER_SIZE, session, ctx, 0, width)) {
+        explicit_bzero(session, sizeof(session));
+        input_close(&in);
+        free(prefix);
+        stats_phase(STATS_ENCRYPT, start);
+        return false;
+    }
+
+    hy_job_t job;
+    job.infile = infile;
+    job.outfile = outfile;
+    job.ctx = ctx;
+    job.encrypt = true;
+    job.width = width;
+    job.in = &in;
+    chacha_init(&job.cipher, session, session + CHACHA_KEY_SIZE);
+    explicit_bzero(session, sizeof(session));
+    hybrid_mac_start(&job.mac, &job.cipher, prefix, prefix + CONTAINER_HEADER_SIZE, width);
+    long hdr_pos = ftell(outfile);
+    hy_stream(&job, prefix, prefix_len, hdr.block_count);
+    input_close(&in);
+    if ((hdr.block_count == CONTAINER_UNKNOWN_COUNT) && (hdr_pos >= 0)) {
+        //fill in the payload length when it was not known up front and the output can seek back
+        hdr.block_count = job.payload;
+        if (fseek(outfile, hdr_pos, SEEK_SET) == 0) {
+            container_write(outfile, &hdr);
+            fseek(outfile, 0, SEEK_END);
+        }
+    }
+
+    free(prefix);
+    stats_phase(STATS_ENCRYPT, start);
+    return true;
+}
+
+//decrypts the payload of a hybrid container whose header was just taken from in, header is
+//its raw bytes and count the payload length it announces
+//returns false if the session key was not wrapped for the private key in ctx, or the payload
+//does not match its tag or its length
+static bool dec_hybrid(file_in_t *in, FILE *infile, FILE *outfile, rsa_ctx_t *ctx,
+    uint64_t width, const uint8_t *header, uint64_t count) {
+    uint8_t session[SESSION_SIZE];
+    uint8_t *wrapped = (uint8_t *) malloc(width);
+    bool unwrapped = (input_read(in, wrapped, width) == width)
+                     && session_unwrap(session, wrapped, ctx, 0, width);
+    if (!unwrapped) {
+        explicit_bzero(session, sizeof(session));
+        free(wrapped);
+        return false;
+    }
+
+    hy_job_t job;
+    job.infile = infile;
+    job.outfile = outfile;
+    job.in = in;
+    job.ctx = ctx;
+    job.encrypt = false;
+    job.width = width;
+    chacha_init(&job.cipher, session, session + CHACHA_KEY_SIZE);
+    explicit_bzero(session, sizeof(session));
+    hybrid_mac_start(&job.mac, &job.cipher, header, wrapped, width);
+    free(wrapped);
+    return hy_stream(&job, NULL, 0, count);
+}
+
 //decrypts cyphertext c into message m
 void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
     pow_mod(m, c, d, n);
     return;
 }
 
-//encrypt an entire
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
-    //decryption must be done in blocks n - 1
+//decrypts cyphertext c into message m using the CRT values of the private key
+void rsa_decrypt_crt(mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *extra) {
+    crt_pow_once(m, c, p, q, dp, dq, qinv, extra);
+    return;
+}
+
+//decrypts cyphertext c into message m with the key in ctx on the scratch of worker
+void rsa_decrypt_ctx(mpz_t m, mpz_t c, rsa_ctx_t *ctx, uint64_t worker) {
+    nt_ctx_t *scratch = &ctx->scratch[worker];
+    if (ctx->crt) {
+        crt_pow(m, c, ctx->p, ctx->q, ctx->qinv, &ctx->extra, &ctx->mont_p, &ctx->mont_q,
+            ctx->mont_r, ctx->rec_crt, scratch);
+    } else {
+        pow_mod_mont_rec(m, c, &ctx->rec_d, &ctx->mont_n, scratch);
+    }
+    return;
+}
+
+//decrypts the count cypher texts c[i] into m[i] with the key in ctx on the scratch of worker
+//count is at most ctx->lanes, with CRT every prime's exponentiations run as one batch and the
+//results are recombined block by block
+void rsa_decrypt_batch_ctx(
+    mpz_ptr m[], mpz_ptr c[], uint64_t count, rsa_ctx_t *ctx, uint64_t worker) {
+    if (ctx->lanes == 1) {
+        for (uint64_t i = 0; i < count; i++) {
+            rsa_decrypt_ctx(m[i], c[i], ctx, worker);
+        }
+        return;
+    }
+    if (!ctx->crt) {
+        batch_pow(m, c, count, &ctx->rec_d, &ctx->mb_n, &ctx->mont_n, ctx, worker);
+        return;
+    }
+
+    rsa_batch_t *batch = &ctx->batch[worker];
+    mbexp_t *mb[RSA_MAX_PRIMES] = { &ctx->mb_p, &ctx->mb_q, &ctx->mb_r[0], &ctx->mb_r[1] };
+    mont_t *mont[RSA_MAX_PRIMES] = { &ctx->mont_p, &ctx->mont_q, &ctx->mont_r[0], &ctx->mont_r[1] };
+    mpz_ptr primes[RSA_MAX_PRIMES] = { ctx->p, ctx->q, ctx->extra.r[0], ctx->extra.r[1] };
+    for (uint64_t i = 0; i < prime_count(&ctx->extra); i++) {
+        mpz_ptr res[MBEXP_LANES];
+        for (uint64_t l = 0; l < count; l++) {
+            res[l] = batch->res[i][l];
+            mpz_mod(res[l], c[l], primes[i]);
+        }
+        batch_pow(res, res, count, &ctx->rec_crt[i], mb[i], mont[i], ctx, worker);
+    }
+    for (uint64_t l = 0; l < count; l++) {
+        mpz_ptr res[RSA_MAX_PRIMES]
+            = { batch->res[0][l], batch->res[1][l], batch->res[2][l], batch->res[3][l] };
+        crt_combine(m[l], res, ctx->p, ctx->q, ctx->qinv, &ctx->extra, &ctx->scratch[worker]);
+    }
+    return;
+}
+
+//one block of a file being decrypted
+typedef struct {
+    char *text; //hex digits of the cypher text, or the raw block of a binary container
+    size_t len, cap; //bytes in text and room for them
+    uint8_t *src; //the block straight in the input mapping, NULL when it was read into text
+    mpz_t c, m; //cypher text and message of the block
+    uint8_t *block; //exported message, the 0xFF padding byte followed by the data
+    size_t bytes; //bytes exported into block
+} dec_block_t;
+
+//consecutive blocks decrypted together, up to ctx->lanes of them
+typedef struct {
+    dec_block_t *blocks;
+    uint64_t count;
+} dec_slot_t;
+
+//everything the decryption pipeline stages share
+typedef struct {
+    FILE *infile, *outfile;
+    rsa_ctx_t *ctx;
+    bool binary; //the input is a binary container
+    uint64_t width; //bytes per binary cypher text block
+    uint64_t remaining; //binary blocks left to read
+    file_in_t in;
+    mapfile_t out_map; //mapping of a regular output, base is NULL when out_io writes it
+    ringio_t out_io;
+    uint64_t out_pos; //next byte of the output mapping
+    bool eof; //a block could not be read, nothing after it is
+    dec_slot_t *slots;
+    bool compressed; //the blocks hold lz frames, expanded before they are written
+    uint8_t *frame; //frame being collected from the blocks
+    uint64_t frame_len; //bytes of it collected
+    uint8_t *data; //the frame expanded
+    bool corrupt; //a frame did not expand, nothing after it is written
+} dec_job_t;
+
+//splits the next whitespace separated hex block off the input mapping
+static bool dec_read_map(dec_job_t *job, dec_block_t *s) {
+    uint8_t *base = job->in.map.base;
+    uint64_t size = job->in.map.size;
+    while ((job->in.pos < size) && isspace(base[job->in.pos])) {
+        job->in.pos++;
+    }
+    s->src = base + job->in.pos;
+    while ((job->in.pos < size) && isxdigit(base[job->in.pos])) {
+        job->in.pos++;
+    }
+    s->len = (size_t) (base + job->in.pos - s->src);
+    return s->len > 0;
+}
+
+//splits the next whitespace separated hex block off the input
+//stops at the end of the input or at anything that is not a hex digit
+static bool dec_read_block(dec_job_t *job, dec_block_t *s) {
+    s->src = NULL;
+
+    //binary blocks sit at fixed offsets, no scanning needed
+    if (job->binary) {
+        if (job->remaining == 0) {
+            return false;
+        }
+        job->remaining--;
+        if (job->in.map.base != NULL) {
+            if (job->in.map.size - job->in.pos < job->width) {
+                return false;
+            }
+            s->src = job->in.map.base + job->in.pos;
+            job->in.pos += job->width;
+            return true;
+        }
+        s->len = ringio_read(&job->in.io, s->text, job->width);
+        return s->len == job->width;
+    }
+
+    if (job->in.map.base != NULL) {
+        return dec_read_map(job, s);
+    }
+
+    int ch;
+    do {
+        ch = ringio_getc(&job->in.io);
+    } while (isspace(ch));
+
+    s->len = 0;
+    while ((ch != EOF) && isxdigit(ch)) {
+        if (s->len + 1 >= s->cap) {
+            s->cap *= 2;
+            s->text = (char *) realloc(s->text, s->cap);
+        }
+        s->text[s->len++] = (char) ch;
+        ch = ringio_getc(&job->in.io);
+    }
+    s->text[s->len] = '\0';
+
+    return s->len > 0;
+}
+
+//reader stage, fills the slot with up to ctx->lanes blocks
+static bool dec_read(void *arg, uint64_t slot) {
+    dec_job_t *job = (dec_job_t *) arg;
+    dec_slot_t *s = &job->slots[slot];
+    s->count = 0;
+    while (!job->eof && (s->count < job->ctx->lanes)) {
+        if (!dec_read_block(job, &s->blocks[s->count])) {
+            job->eof = true;
+            break;
+        }
+        s->count++;
+    }
+    return s->count > 0;
+}
+
+//parses the cypher text of one block into s->c
+static void dec_parse(dec_job_t *job, dec_block_t *s) {
+    if (job->binary) {
+        mpz_import(s->c, job->width, 1, 1, 1, 0, (s->src != NULL) ? (void *) s->src : s->text);
+    } else {
+        //mpz_set_str needs the digits terminated, copy them out of the mapping
+        if (s->src != NULL) {
+            if (s->len + 1 > s->cap) {
+                s->cap = s->len + 1;
+                s->text = (char *) realloc(s->text, s->cap);
+            }
+            memcpy(s->text, s->src, s->len);
+            s->text[s->len] = '\0';
+        }
+        mpz_set_str(s->c, s->text, 16);
+    }
+    return;
+}
+
+//worker stage, parses and decrypts the blocks of a slot as one batch
+static void dec_work(void *arg, uint64_t slot, uint64_t worker) {
+    dec_job_t *job = (dec_job_t *) arg;
+    dec_slot_t *s = &job->slots[slot];
+    mpz_ptr c[MBEXP_LANES], m[MBEXP_LANES];
+    for (uint64_t i = 0; i < s->count; i++) {
+        dec_parse(job, &s->blocks[i]);
+        c[i] = s->blocks[i].c;
+        m[i] = s->blocks[i].m;
+    }
+    rsa_decrypt_batch_ctx(m, c, s->count, job->ctx, worker);
+
+    for (uint64_t i = 0; i < s->count; i++) {
+        s->blocks[i].bytes = 0;
+        mpz_export(s->blocks[i].block, &s->blocks[i].bytes, 1, 1, 1, 0, s->blocks[i].m);
+    }
+    return;
+}
+
+//writes len bytes of plaintext at buf to the output
+//a mapped output grows as needed, if that fails the rest is written through out_io
+static void dec_emit(dec_job_t *job, const uint8_t *buf, uint64_t len) {
+    stats_add(&stats.bytes_out, len);
+    if ((job->out_map.base != NULL) && (job->out_pos + len > job->out_map.size)) {
+        uint64_t size = 2 * job->out_map.size;
+        if (size < job->out_pos + len) {
+            size = job->out_pos + len;
+        }
+        if (!mapfile_grow(&job->out_map, size)) {
+            mapfile_finish(&job->out_map, job->outfile, job->out_pos);
+            ringio_open_write(&job->out_io, job->outfile);
+        }
+    }
+    if (job->out_map.base != NULL) {
+        memcpy(job->out_map.base + job->out_pos, buf, len);
+        job->out_pos += len;
+    } else {
+        ringio_write(&job->out_io, buf, len);
+    }
+    return;
+}
+
+//collects the lz frames in the len decrypted bytes at buf, writing out the data of each one
+//as soon as it is complete
+static void dec_inflate(dec_job_t *job, const uint8_t *buf, uint64_t len) {
+    while ((len > 0) && !job->corrupt) {
+        uint64_t need = LZ_HEADER_SIZE;
+        uint64_t data = 0;
+        uint64_t stored = 0;
+        if (job->frame_len >= LZ_HEADER_SIZE) {
+            if (!lz_frame_header(job->frame, &data, &stored)) {
+                job->corrupt = true;
+                return;
+            }
+            need += stored;
+        }
+        uint64_t take = need - job->frame_len;
+        take = (take < len) ? take : len;
+        memcpy(job->frame + job->frame_len, buf, take);
+        job->frame_len += take;
+        buf += take;
+        len -= take;
+        if ((job->frame_len == need) && (stored > 0)) {
+            if (!lz_decompress(job->data, job->frame)) {
+                job->corrupt = true;
+                return;
+            }
+            stats_add(&stats.lz_plain, data);
+            stats_add(&stats.lz_packed, need);
+            dec_emit(job, job->data, data);
+            job->frame_len = 0;
+        }
+    }
+    return;
+}
+
+//writes out one decrypted block without its padding byte
+static void dec_write_block(dec_job_t *job, dec_block_t *s) {
+    stats_add(&stats.blocks, 1);
+    stats_add(&stats.bytes_in, job->binary ? job->width : s->len);
+    if (s->bytes <= 1) {
+        return;
+    }
+    if (job->compressed) {
+        dec_inflate(job, s->block + 1, s->bytes - 1);
+    } else {
+        dec_emit(job, s->block + 1, s->bytes - 1);
+    }
+    return;
+}
+
+//writer stage, writes out the decrypted blocks in order
+static void dec_write(void *arg, uint64_t slot) {
+    dec_job_t *job = (dec_job_t *) arg;
+    dec_slot_t *s = &job->slots[slot];
+    for (uint64_t i = 0; i < s->count; i++) {
+        dec_write_block(job, &s->blocks[i]);
+    }
+    return;
+}
+
+//decrypts the file INFILE with the private key in ctx, outputs to OUTFILE
+//one worker per scratch context of ctx decrypts blocks while the reader splits off the next
+//hex text and binary containers are told apart by the first byte of the input, hybrid
+//containers are handed to the symmetric stream once their session key is unwrapped, and the
+//lz frames of compressed containers are expanded by the writer
+//regular files are memory mapped, blocks are parsed straight from the input and the
+//plaintext is placed straight into the output, anything else is read ahead and written
+//behind through a ringio
+//every buffer is set up before the first block, ctx->allocs counts what GMP allocates after
+//returns false if the input is a container that was not made for this key
+bool rsa_decrypt_file_ctx(FILE *infile, FILE *outfile, rsa_ctx_t *ctx) {
+    uint64_t start = stats_now();
+    mpz_ptr n = ctx->n;
+    uint64_t threads = ctx->workers;
+    dec_job_t job;
+
+    //the header is taken from the mapping or the reader like the blocks, stdio reads nothing
+    input_open(&job.in, infile);
+    job.binary = (input_peek(&job.in) == CONTAINER_MAGIC[0]);
+    job.width = mpz_sizeinbase(n, 256);
+    job.remaining = 0;
+    job.compressed = false;
+    if (job.binary) {
+        uint8_t buf[CONTAINER_HEADER_SIZE];
+        container_t hdr;
+        if ((input_read(&job.in, buf, CONTAINER_HEADER_SIZE) != CONTAINER_HEADER_SIZE)
+            || !container_decode(buf, &hdr) || (hdr.modulus_bits != mpz_sizeinbase(n, 2))
+            || (hdr.block_width != job.width) || (hdr.hybrid && (hdr.flags != 0))) {
+            input_close(&job.in);
+            stats_phase(STATS_DECRYPT, start);
+            return false;
+        }
+        if (hdr.hybrid) {
+            bool decrypted
+                = dec_hybrid(&job.in, infile, outfile, ctx, job.width, buf, hdr.block_count);
+            input_close(&job.in);
+            stats_phase(STATS_DECRYPT, start);
+            return decrypted;
+        }
+        job.remaining = hdr.block_count;
+        job.compressed = (hdr.flags & CONTAINER_FLAG_LZ) != 0;
+    }
+
+    job.infile = infile;
+    job.outfile = outfile;
+    job.ctx = ctx;
+    job.eof = false;
+    job.frame = NULL;
+    job.frame_len = 0;
+    job.data = NULL;
+    job.corrupt = false;
+    if (job.compressed) {
+        job.frame = (uint8_t *) malloc(LZ_FRAME_BOUND);
+        job.data = (uint8_t *) malloc(LZ_FRAME_SIZE);
+    }
+
+    //guess the plaintext size, every block but the last is full and hex doubles the size
     uint64_t block_size = (mpz_sizeinbase(n, 2) - 1) / 8;
+    uint64_t guess = 1 << 20;
+    if (job.binary && (job.remaining != CONTAINER_UNKNOWN_COUNT)) {
+        guess = job.remaining * (block_size - 1);
+    } else if (job.in.map.base != NULL) {
+        guess = (job.in.map.size - job.in.pos) / 2;
+    }
+    job.out_pos = 0;
+    if (!mapfile_open_write(outfile, &job.out_map, guess)) {
+        ringio_open_write(&job.out_io, outfile);
+    }
 
-    //array allocation
-    uint8_t *block = (uint8_t *) malloc(block_size);
+    //a decrypted block is below n, so it never takes more bytes than n
+    uint64_t n_bytes = mpz_sizeinbase(n, 256);
+    uint64_t depth = (threads > 1) ? threads * BLOCKS_PER_THREAD : 1;
+    job.slots = (dec_slot_t *) malloc(depth * sizeof(dec_slot_t));
+    for (uint64_t i = 0; i < depth; i++) {
+        job.slots[i].blocks = (dec_block_t *) malloc(ctx->lanes * sizeof(dec_block_t));
+        for (uint64_t j = 0; j < ctx->lanes; j++) {
+            dec_block_t *s = &job.slots[i].blocks[j];
+            s->cap = 2 * n_bytes + 2;
+            s->text = (char *) malloc(s->cap);
+            s->block = (uint8_t *) malloc(n_bytes);
+            mpz_init2(s->c, mpz_sizeinbase(n, 2) + GMP_NUMB_BITS);
+            mpz_init2(s->m, mpz_sizeinbase(n, 2) + GMP_NUMB_BITS);
+        }
+    }
 
-    mpz_t c;
-    mpz_init(c);
-    while (gmp_fscanf(infile, "%Zx", c) != EOF) {
+    uint64_t allocs = rsa_allocs();
+    pipeline_run(threads, depth, dec_read, dec_work, dec_write, &job);
+    ctx->allocs = rsa_allocs() - allocs;
 
-        uint64_t j = 0; //bytes read by export
+    if (job.out_map.base != NULL) {
+        mapfile_finish(&job.out_map, outfile, job.out_pos);
+    } else {
+        ringio_close(&job.out_io);
+    }
+    input_close(&job.in);
 
-        //decryption
-        mpz_t m;
-        mpz_init(m);
-        rsa_decrypt(m, c, d, n);
+    for (uint64_t i = 0; i < depth; i++) {
+        for (uint64_t j = 0; j < ctx->lanes; j++) {
+            dec_block_t *s = &job.slots[i].blocks[j];
+            free(s->text);
+            free(s->block);
+            mpz_clear(s->c);
+            mpz_clear(s->m);
+        }
+        free(job.slots[i].blocks);
+    }
+    free(job.slots);
+    free(job.frame);
+    free(job.data);
+    stats_phase(STATS_DECRYPT, start);
 
-        mpz_export(block, &j, 1, 1, 1, 0, m);
+    //frames that do not expand or stop part way mean the blocks were not made with this key
+    return !job.corrupt && (job.frame_len == 0);
+}
 
-        //write out decrypted version
-        fwrite((block + 1), 1, j - 1, outfile);
+//decrypts an entire file with the plain private exponent d
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, uint64_t threads) {
+    rsa_ctx_t ctx;
+    rsa_ctx_init_priv(&ctx, n, d, NULL, NULL, NULL, NULL, NULL, NULL, threads);
+    bool decrypted = rsa_decrypt_file_ctx(infile, outfile, &ctx);
+    rsa_ctx_clear(&ctx);
+    return decrypted;
+}
 
-        mpz_clear(m);
-        j = 0;
+//decrypts an entire file with the CRT values of the private key
+bool rsa_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t n, mpz_t p, mpz_t q, mpz_t dp,
+    mpz_t dq, mpz_t qinv, rsa_extra_t *extra, uint64_t threads) {
+    mpz_t d;
+    mpz_init(d); //unused, the CRT values stand in for it
+    rsa_ctx_t ctx;
+    rsa_ctx_init_priv(&ctx, n, d, p, q, dp, dq, qinv, extra, threads);
+    bool decrypted = rsa_decrypt_file_ctx(infile, outfile, &ctx);
+    rsa_ctx_clear(&ctx);
+    mpz_clear(d);
+    return decrypted;
+}
+
+//sets up the parts of a stream encrypting and decrypting share
+static void stream_init(rsa_stream_t *st, rsa_ctx_t *ctx, uint64_t worker, bool encrypt) {
+    uint64_t bits = mpz_sizeinbase(ctx->n, 2);
+    st->ctx = ctx;
+    st->worker = worker;
+    st->encrypt = encrypt;
+    st->hybrid = false;
+    st->state = RSA_STREAM_HEADER;
+    st->width = mpz_sizeinbase(ctx->n, 256);
+    st->data_size = (bits - 1) / 8 - 1;
+    st->remaining = 0;
+    st->pending = (uint8_t *) malloc(st->width + CONTAINER_HEADER_SIZE);
+    st->pending_len = 0;
+    st->block = (uint8_t *) malloc(st->width);
+    mpz_init2(st->m, bits + GMP_NUMB_BITS);
+    mpz_init2(st->c, bits + GMP_NUMB_BITS);
+    st->offset = 0;
+    return;
+}
+
+//sets up st to encrypt with the public key in ctx on the scratch of worker
+//hybrid wraps a random session key and streams the data through ChaCha20 like
+//rsa_encrypt_file_hybrid, otherwise every block is encrypted like a binary container
+//returns false if the key is too small to wrap a session key or no randomness is available,
+//st has to be cleared either way
+bool rsa_stream_init_encrypt(rsa_stream_t *st, rsa_ctx_t *ctx, uint64_t worker, bool hybrid) {
+    stream_init(st, ctx, worker, true);
+    st->hybrid = hybrid;
+    if (!hybrid) {
+        return true;
     }
-    mpz_clear(c);
-    free(block);
+
+    //the wrapped session key waits in pending until the first output goes out
+    uint8_t session[SESSION_SIZE];
+    if (!session_random(session, SESSION_SIZE)
+        || !session_wrap(st->pending, session, ctx, worker, st->width)) {
+        explicit_bzero(session, sizeof(session));
+        st->state = RSA_STREAM_DONE;
+        return false;
+    }
+    st->pending_len = st->width;
+    chacha_init(&st->cipher, session, session + CHACHA_KEY_SIZE);
+    explicit_bzero(session, sizeof(session));
+    return true;
+}
+
+//sets up st to decrypt a binary or hybrid container with the private key in ctx on the
+//scratch of worker, hex text and compressed containers are only taken by the file functions
+void rsa_stream_init_decrypt(rsa_stream_t *st, rsa_ctx_t *ctx, uint64_t worker) {
+    stream_init(st, ctx, worker, false);
+    return;
+}
+
+//most bytes rsa_stream_update can write for in_len more bytes of input, with in_len 0 the
+//most rsa_stream_final can write
+uint64_t rsa_stream_bound(rsa_stream_t *st, uint64_t in_len) {
+    //decrypting never writes more than it takes in, the header and padding are dropped
+    if (!st->encrypt) {
+        return st->pending_len + in_len;
+    }
+    uint64_t prefix = 0;
+    if (st->state == RSA_STREAM_HEADER) {
+        prefix = CONTAINER_HEADER_SIZE + (st->hybrid ? st->width : 0);
+    }
+    if (st->hybrid) {
+        return prefix + in_len + POLY1305_TAG_SIZE;
+    }
+    uint64_t blocks = (st->pending_len + in_len + st->data_size - 1) / st->data_size;
+    return prefix + blocks * st->width;
+}
+
+//tops pending up to want bytes from the in_len bytes at in, returns how many were taken
+static uint64_t stream_fill(rsa_stream_t *st, const uint8_t *in, uint64_t in_len, uint64_t want) {
+    uint64_t take = want - st->pending_len;
+    if (take > in_len) {
+        take = in_len;
+    }
+    if (take > 0) {
+        memcpy(st->pending + st->pending_len, in, take);
+        st->pending_len += take;
+    }
+    return take;
+}
+
+//writes the container header, and the wrapped session key of a hybrid stream, to out
+//neither the block count nor the payload length is known ahead of the data, a hybrid stream
+//starts its tag on them here
+static uint64_t stream_prefix(rsa_stream_t *st, uint8_t *out) {
+    container_t hdr;
+    hdr.hybrid = st->hybrid;
+    hdr.version = CONTAINER_VERSION;
+    hdr.flags = 0;
+    hdr.modulus_bits = (uint32_t) mpz_sizeinbase(st->ctx->n, 2);
+    hdr.block_width = (uint32_t) st->width;
+    hdr.block_count = CONTAINER_UNKNOWN_COUNT;
+    container_encode(out, &hdr);
+    uint64_t len = CONTAINER_HEADER_SIZE;
+    if (st->hybrid) {
+        memcpy(out + len, st->pending, st->width);
+        hybrid_mac_start(&st->mac, &st->cipher, out, out + len, st->width);
+        len += st->width;
+        st->pending_len = 0;
+    }
+    st->state = RSA_STREAM_BODY;
+    return len;
+}
+
+//encrypts the bytes data bytes at src into one block at out, returns the bytes written
+static uint64_t stream_encrypt_block(rsa_stream_t *st, uint8_t *out, const uint8_t *src,
+    uint64_t bytes) {
+    encrypt_block(st->c, st->m, src, bytes, st->ctx, st->worker);
+    export_block(out, st->c, st->width);
+    stats_add(&stats.blocks, 1);
+    return st->width;
+}
+
+//decrypts the block at src into out without its padding byte, returns the bytes written
+static uint64_t stream_decrypt_block(rsa_stream_t *st, uint8_t *out, const uint8_t *src) {
+    mpz_import(st->c, st->width, 1, 1, 1, 0, src);
+    rsa_decrypt_ctx(st->m, st->c, st->ctx, st->worker);
+    size_t bytes = 0;
+    mpz_export(st->block, &bytes, 1, 1, 1, 0, st->m);
+    stats_add(&stats.blocks, 1);
+    if (bytes <= 1) {
+        return 0;
+    }
+    memcpy(out, st->block + 1, bytes - 1);
+    return bytes - 1;
+}
+
+//encrypting half of rsa_stream_update
+static uint64_t stream_encrypt(rsa_stream_t *st, uint8_t *out, const uint8_t *in,
+    uint64_t in_len) {
+    uint64_t len = 0;
+    if (st->state == RSA_STREAM_HEADER) {
+        len += stream_prefix(st, out);
+    }
+    if (st->hybrid) {
+        chacha_xor_at(&st->cipher, out + len, in, in_len,
+            HYBRID_PAYLOAD_BLOCK * CHACHA_BLOCK_SIZE + st->offset);
+        poly1305_update(&st->mac, out + len, in_len);
+        st->offset += in_len;
+        return len + in_len;
+    }
+
+    //finish the block left over from the last call, then take whole blocks straight from in
+    if (st->pending_len > 0) {
+        uint64_t take = stream_fill(st, in, in_len, st->data_size);
+        in += take;
+        in_len -= take;
+        if (st->pending_len == st->data_size) {
+            len += stream_encrypt_block(st, out + len, st->pending, st->data_size);
+            st->pending_len = 0;
+        }
+    }
+    while (in_len >= st->data_size) {
+        len += stream_encrypt_block(st, out + len, in, st->data_size);
+        in += st->data_size;
+        in_len -= st->data_size;
+    }
+    stream_fill(st, in, in_len, st->data_size);
+    return len;
+}
+
+//decrypts the n hybrid payload bytes at src into out, taking them into the tag first
+static void stream_payload(rsa_stream_t *st, uint8_t *out, const uint8_t *src, uint64_t n) {
+    poly1305_update(&st->mac, src, n);
+    chacha_xor_at(&st->cipher, out, src, n, HYBRID_PAYLOAD_BLOCK * CHACHA_BLOCK_SIZE + st->offset);
+    st->offset += n;
+    return;
+}
+
+//decrypting half of rsa_stream_update, false if the input is not a container for the key
+static bool stream_decrypt(rsa_stream_t *st, uint8_t *out, uint64_t *out_len,
+    const uint8_t *in, uint64_t in_len) {
+    uint64_t len = 0;
+    while (in_len > 0) {
+        uint64_t take = 0;
+        if (st->state == RSA_STREAM_HEADER) {
+            take = stream_fill(st, in, in_len, CONTAINER_HEADER_SIZE);
+            container_t hdr;
+            if (st->pending_len == CONTAINER_HEADER_SIZE) {
+                if (!container_decode(st->pending, &hdr)
+                    || (hdr.modulus_bits != mpz_sizeinbase(st->ctx->n, 2))
+                    || (hdr.block_width != st->width) || (hdr.flags != 0)) {
+                    return false;
+                }
+                st->hybrid = hdr.hybrid;
+                st->remaining = hdr.block_count;
+                //a hybrid header stays in pending, it goes into the tag with the session key
+                st->pending_len = hdr.hybrid ? CONTAINER_HEADER_SIZE : 0;
+                st->state = hdr.hybrid ? RSA_STREAM_KEY : RSA_STREAM_BODY;
+            }
+        } else if (st->state == RSA_STREAM_KEY) {
+            take = stream_fill(st, in, in_len, CONTAINER_HEADER_SIZE + st->width);
+            if (st->pending_len == CONTAINER_HEADER_SIZE + st->width) {
+                uint8_t session[SESSION_SIZE];
+                uint8_t *wrapped = st->pending + CONTAINER_HEADER_SIZE;
+                if (!session_unwrap(session, wrapped, st->ctx, st->worker, st->width)) {
+                    explicit_bzero(session, sizeof(session));
+                    return false;
+                }
+                chacha_init(&st->cipher, session, session + CHACHA_KEY_SIZE);
+                explicit_bzero(session, sizeof(session));
+                hybrid_mac_start(&st->mac, &st->cipher, st->pending, wrapped, st->width);
+                st->pending_len = 0;
+                st->state = RSA_STREAM_BODY;
+            }
+        } else if (st->hybrid) {
+            //the last POLY1305_TAG_SIZE bytes so far wait in pending, they may be the tag
+            uint64_t total = st->pending_len + in_len;
+            uint64_t pass = (total > POLY1305_TAG_SIZE) ? total - POLY1305_TAG_SIZE : 0;
+            uint64_t held = (pass < st->pending_len) ? pass : st->pending_len;
+            stream_payload(st, out + len, st->pending, held);
+            memmove(st->pending, st->pending + held, st->pending_len - held);
+            st->pending_len -= held;
+            stream_payload(st, out + len + held, in, pass - held);
+            memcpy(st->pending + st->pending_len, in + pass - held, in_len - (pass - held));
+            st->pending_len += in_len - (pass - held);
+            len += pass;
+            take = in_len;
+        } else if (st->remaining == 0) {
+            take = in_len; //past the blocks the header announced
+        } else if ((st->pending_len > 0) || (in_len < st->width)) {
+            take = stream_fill(st, in, in_len, st->width);
+            if (st->pending_len == st->width) {
+                len += stream_decrypt_block(st, out + len, st->pending);
+                st->pending_len = 0;
+                st->remaining--;
+            }
+        } else {
+            len += stream_decrypt_block(st, out + len, in);
+            take = st->width;
+            st->remaining--;
+        }
+        in += take;
+        in_len -= take;
+    }
+    *out_len = len;
+    return true;
+}
+
+//feeds the in_len bytes at in through the stream, the output goes to out
+//*out_len holds the room in out on entry and the bytes written on return, out needs
+//rsa_stream_bound(st, in_len) bytes of room and must not overlap in
+//returns false if out is too small, or when decrypting, if the input is not a container made
+//for this key, a stream that failed that way only takes rsa_stream_clear
+bool rsa_stream_update(
+    rsa_stream_t *st, uint8_t *out, uint64_t *out_len, const uint8_t *in, uint64_t in_len) {
+    if ((st->state == RSA_STREAM_DONE) || (*out_len < rsa_stream_bound(st, in_len))) {
+        *out_len = 0;
+        return false;
+    }
+    stats_add(&stats.bytes_in, in_len);
+    if (st->encrypt) {
+        *out_len = stream_encrypt(st, out, in, in_len);
+    } else if (!stream_decrypt(st, out, out_len, in, in_len)) {
+        st->state = RSA_STREAM_DONE;
+        *out_len = 0;
+        return false;
+    }
+    stats_add(&stats.bytes_out, *out_len);
+    return true;
+}
+
+//ends the stream, encrypting writes the last partial block, or the tag of a hybrid payload,
+//to out
+//*out_len holds the room in out on entry and the bytes written on return
+//returns false if out is too small, or when decrypting, if the input stopped partway
+//through the header, the session key or a block, or a hybrid payload does not match its tag
+//or the length in its header
+bool rsa_stream_final(rsa_stream_t *st, uint8_t *out, uint64_t *out_len) {
+    if ((st->state == RSA_STREAM_DONE) || (*out_len < rsa_stream_bound(st, 0))) {
+        *out_len = 0;
+        return false;
+    }
+
+    bool finished = true;
+    uint64_t len = 0;
+    if (st->encrypt) {
+        //an empty input still makes a container, the same as the file functions
+        if (st->state == RSA_STREAM_HEADER) {
+            len += stream_prefix(st, out);
+        }
+        if (st->hybrid) {
+            hybrid_mac_finish(&st->mac, st->width, st->offset, out + len);
+            len += POLY1305_TAG_SIZE;
+        } else if (st->pending_len > 0) {
+            len += stream_encrypt_block(st, out + len, st->pending, st->pending_len);
+        }
+    } else if (st->hybrid && (st->state == RSA_STREAM_BODY)) {
+        uint8_t tag[POLY1305_TAG_SIZE];
+        hybrid_mac_finish(&st->mac, st->width, st->offset, tag);
+        finished = (st->pending_len == POLY1305_TAG_SIZE) && poly1305_equal(tag, st->pending)
+                   && ((st->remaining == CONTAINER_UNKNOWN_COUNT)
+                       || (st->remaining == st->offset));
+    } else {
+        //no input at all decrypts to nothing, like an empty file
+        bool empty = (st->state == RSA_STREAM_HEADER) && (st->pending_len == 0);
+        finished = empty || ((st->state == RSA_STREAM_BODY) && (st->pending_len == 0));
+    }
+    stats_add(&stats.bytes_out, len);
+    st->pending_len = 0;
+    st->state = RSA_STREAM_DONE;
+    *out_len = len;
+    return finished;
+}
+
+//frees everything held by the stream and wipes its session key
+void rsa_stream_clear(rsa_stream_t *st) {
+    free(st->pending);
+    free(st->block);
+    mpz_clear(st->m);
+    mpz_clear(st->c);
+    explicit_bzero(&st->cipher, sizeof(st->cipher));
+    explicit_bzero(&st->mac, sizeof(st->mac));
     return;
 }
 
@@ -189,17 +2213,34 @@ void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n) {
     return;
 }
 
+//sign a message m using the CRT values of the private key
+void rsa_sign_crt(mpz_t s, mpz_t m, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *extra) {
+    crt_pow_once(s, m, p, q, dp, dq, qinv, extra);
+    return;
+}
+
+//sign a message m with the key in ctx on the scratch of worker
+void rsa_sign_ctx(mpz_t s, mpz_t m, rsa_ctx_t *ctx, uint64_t worker) {
+    rsa_decrypt_ctx(s, m, ctx, worker);
+    return;
+}
+
 //verify a username
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
     mpz_t t;
     mpz_init(t);
     pow_mod(t, s, e, n);
 
-    //if t and m are not equal, return 0
-    if (mpz_cmp(t, m) != 0) {
-        return false;
-    }
+    //true when t and m are equal
+    bool verified = (mpz_cmp(t, m) == 0);
+    mpz_clear(t);
+    return verified;
+}
 
-    //otherwise, return true
-    return true;
+//verify a username with the public key in ctx on the scratch of worker
+bool rsa_verify_ctx(mpz_t m, mpz_t s, rsa_ctx_t *ctx, uint64_t worker) {
+    mpz_ptr t = ctx->scratch[worker].t[6];
+    pow_mod_mont_rec(t, s, &ctx->rec_e, &ctx->mont_n, &ctx->scratch[worker]);
+    return mpz_cmp(t, m) == 0;
 }
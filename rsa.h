@@ -5,26 +5,172 @@
 #include <stdio.h>
 #include <gmp.h>
 
-void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters);
+#include "chacha.h"
+#include "mbexp.h"
+#include "numtheory.h"
+#include "poly1305.h"
+
+//most primes a key can have, p and q included
+#define RSA_MAX_PRIMES 4
+
+//the primes of a multi-prime key beyond p and q with their CRT values, as in RFC 8017
+typedef struct {
+    uint64_t count; //primes beyond p and q, 0 for two-prime keys
+    mpz_t r[RSA_MAX_PRIMES - 2]; //the primes
+    mpz_t d[RSA_MAX_PRIMES - 2]; //d % (r - 1)
+    mpz_t t[RSA_MAX_PRIMES - 2]; //(p * q * the earlier primes)^-1 % r
+} rsa_extra_t;
+
+//per-worker scratch of the multi-buffer kernels
+typedef struct {
+    uint64_t *ws; //mbexp_pow workspace
+    mpz_t res[RSA_MAX_PRIMES][MBEXP_LANES]; //a batch of blocks modulo each prime of a CRT key
+} rsa_batch_t;
+
+//an RSA key with everything its operations need set up once: the Montgomery contexts of
+//its moduli, its recoded exponents and a scratch context for each worker, so the per-block
+//work of the file functions runs without allocating
+typedef struct {
+    mpz_t n, e, d, p, q, dp, dq, qinv; //key values, 0 when not part of the key
+    rsa_extra_t extra; //primes beyond p and q
+    bool crt; //private operations use p, q, dp, dq, qinv and extra instead of d
+    mont_t mont_n, mont_p, mont_q;
+    mont_t mont_r[RSA_MAX_PRIMES - 2]; //contexts of the extra primes
+    nt_recoding_t rec_e, rec_d; //e and d split into their windows once
+    nt_recoding_t rec_crt[RSA_MAX_PRIMES]; //dp, dq and the exponents of the extra primes
+    mbexp_t mb_n, mb_p, mb_q; //multi-buffer kernels of the moduli
+    mbexp_t mb_r[RSA_MAX_PRIMES - 2];
+    uint64_t lanes; //blocks the file functions hand over at once, 1 when no kernel beats GMP
+    rsa_batch_t *batch; //one per worker when lanes is above 1
+    uint64_t workers; //threads used by the file functions
+    nt_ctx_t *scratch; //one scratch context per worker
+    uint64_t allocs; //GMP heap allocations made by the last file operation after its setup
+} rsa_ctx_t;
+
+//where a stream is in its container
+typedef enum {
+    RSA_STREAM_HEADER, //the container header has not gone through yet
+    RSA_STREAM_KEY, //decrypting a hybrid container, its wrapped session key is next
+    RSA_STREAM_BODY, //blocks or the symmetric payload
+    RSA_STREAM_DONE, //finished or failed, the stream only takes rsa_stream_clear
+} rsa_stream_state_t;
+
+//incremental encryption or decryption of caller buffers into caller buffers, the in-memory
+//counterpart of the file functions that produces and takes the same binary and hybrid
+//containers
+//partial blocks are carried over between calls, whole blocks are read straight from the
+//caller's input and written straight into its output
+typedef struct {
+    rsa_ctx_t *ctx;
+    uint64_t worker; //scratch context of ctx the stream runs on
+    bool encrypt; //false when decrypting
+    bool hybrid; //the payload goes through ChaCha20 under a wrapped session key
+    rsa_stream_state_t state;
+    uint64_t width; //bytes per cypher text block
+    uint64_t data_size; //plaintext bytes per block
+    uint64_t remaining; //blocks left, or payload bytes of a hybrid container, being decrypted
+    uint8_t *pending; //partial header or block carried over to the next call, or the bytes of
+                      //a hybrid payload held back as they may be its tag
+    uint64_t pending_len; //bytes in pending
+    uint8_t *block; //exported message of a decrypted block
+    mpz_t m, c; //message and cypher text of the current block
+    chacha_t cipher; //keyed with the session key of a hybrid stream
+    poly1305_t mac; //tag of a hybrid stream, keyed from the cipher
+    uint64_t offset; //payload bytes of a hybrid stream processed so far
+} rsa_stream_t;
+
+void rsa_extra_init(rsa_extra_t *extra);
+
+void rsa_extra_clear(rsa_extra_t *extra);
+
+void rsa_prime_bits(uint64_t bits[], uint64_t nbits, uint64_t count);
+
+void rsa_make_pub(mpz_t p, mpz_t q, rsa_extra_t *extra, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, uint64_t pub_exp, uint64_t threads);
+
+void rsa_make_pub_pool(mpz_t p, mpz_t q, rsa_extra_t *extra, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, uint64_t pub_exp, uint64_t threads, const char *pool, gmp_randstate_t st);
 
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
 void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
-void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q);
+void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q, rsa_extra_t *extra);
+
+void rsa_make_crt(
+    mpz_t dp, mpz_t dq, mpz_t qinv, mpz_t d, mpz_t p, mpz_t q, rsa_extra_t *extra);
+
+void rsa_write_priv(mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *extra, FILE *pvfile);
+
+bool rsa_read_priv(mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *extra, FILE *pvfile);
+
+void rsa_ctx_init_pub(rsa_ctx_t *ctx, mpz_t n, mpz_t e, uint64_t workers);
+
+void rsa_ctx_init_priv(rsa_ctx_t *ctx, mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq,
+    mpz_t qinv, rsa_extra_t *extra, uint64_t workers);
+
+void rsa_ctx_batch(rsa_ctx_t *ctx);
+
+void rsa_ctx_clear(rsa_ctx_t *ctx);
 
-void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile);
+void rsa_count_allocs(void);
 
-void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile);
+uint64_t rsa_allocs(void);
 
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n);
 
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+void rsa_encrypt_ctx(mpz_t c, mpz_t m, rsa_ctx_t *ctx, uint64_t worker);
+
+void rsa_encrypt_batch_ctx(
+    mpz_ptr c[], mpz_ptr m[], uint64_t count, rsa_ctx_t *ctx, uint64_t worker);
+
+void rsa_encrypt_file(
+    FILE *infile, FILE *outfile, mpz_t n, mpz_t e, uint64_t threads, bool binary);
+
+void rsa_encrypt_file_ctx(
+    FILE *infile, FILE *outfile, rsa_ctx_t *ctx, bool binary, bool compress);
+
+bool rsa_encrypt_file_hybrid(FILE *infile, FILE *outfile, rsa_ctx_t *ctx);
 
 void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
 
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
+void rsa_decrypt_ctx(mpz_t m, mpz_t c, rsa_ctx_t *ctx, uint64_t worker);
+
+void rsa_decrypt_batch_ctx(
+    mpz_ptr m[], mpz_ptr c[], uint64_t count, rsa_ctx_t *ctx, uint64_t worker);
+
+void rsa_decrypt_crt(mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *extra);
+
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, uint64_t threads);
+
+bool rsa_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t n, mpz_t p, mpz_t q, mpz_t dp,
+    mpz_t dq, mpz_t qinv, rsa_extra_t *extra, uint64_t threads);
+
+bool rsa_decrypt_file_ctx(FILE *infile, FILE *outfile, rsa_ctx_t *ctx);
+
+bool rsa_stream_init_encrypt(rsa_stream_t *st, rsa_ctx_t *ctx, uint64_t worker, bool hybrid);
+
+void rsa_stream_init_decrypt(rsa_stream_t *st, rsa_ctx_t *ctx, uint64_t worker);
+
+uint64_t rsa_stream_bound(rsa_stream_t *st, uint64_t in_len);
+
+bool rsa_stream_update(
+    rsa_stream_t *st, uint8_t *out, uint64_t *out_len, const uint8_t *in, uint64_t in_len);
+
+bool rsa_stream_final(rsa_stream_t *st, uint8_t *out, uint64_t *out_len);
+
+void rsa_stream_clear(rsa_stream_t *st);
 
 void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n);
 
+void rsa_sign_crt(mpz_t s, mpz_t m, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *extra);
+
+void rsa_sign_ctx(mpz_t s, mpz_t m, rsa_ctx_t *ctx, uint64_t worker);
+
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n);
+
+bool rsa_verify_ctx(mpz_t m, mpz_t s, rsa_ctx_t *ctx, uint64_t worker);
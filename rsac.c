@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "rpc.h"
+#include "stats.h"
+
+#define ITEMS "i:o:s:k:r:V:edgHvh"
+
+char *help_message = "SYNOPSIS\n"
+                     "   Sends one request to the rsad key daemon.\n"
+                     "   The daemon holds the keys, the client only moves the data.\n\n"
+                     "USAGE\n"
+                     "   ./rsac [-hvedgH] [-V sigfile] [-i infile] [-o outfile] [-s socket]"
+                     " [-k key] [-r repeats]\n\n"
+                     "OPTIONS\n"
+                     "   -h              Display program help and usage.\n"
+                     "   -v              Display verbose program output.\n"
+                     "   -e              Encrypt infile into a binary container (default).\n"
+                     "   -d              Decrypt the container in infile.\n"
+                     "   -g              Sign infile, a big-endian number below n.\n"
+                     "   -V sigfile      Verify the signature in sigfile against infile.\n"
+                     "   -H              Hybrid: RSA wraps a session key, ChaCha20 the data.\n"
+                     "   -i infile       Input file of the request (default: stdin).\n"
+                     "   -o outfile      Output file of the response (default: stdout).\n"
+                     "   -s socket       Socket the daemon listens on (default: rsa.sock).\n"
+                     "   -k key          Daemon key to use, numbered from 0 (default: 0).\n"
+                     "   -r repeats      Send the request this many times and time them.\n";
+
+//reads all of file into a malloced buffer, *len gets its size
+static uint8_t *read_all(FILE *file, uint64_t *len) {
+    uint64_t size = 4096;
+    uint8_t *buf = (uint8_t *) malloc(size);
+    *len = 0;
+    size_t got = 0;
+    while ((got = fread(buf + *len, 1, size - *len, file)) > 0) {
+        *len += got;
+        if (*len == size) {
+            size *= 2;
+            buf = (uint8_t *) realloc(buf, size);
+        }
+    }
+    return buf;
+}
+
+//credit: Eugene for getopt() use
+int main(int argc, char **argv) {
+
+    int opt = 0;
+
+    //default input output files
+    FILE *infile = stdin;
+    FILE *outfile = stdout;
+    FILE *sigfile = NULL;
+
+    bool verbose = false;
+    char *socket_path = "rsa.sock";
+    rpc_header_t req = { .code = RPC_ENCRYPT };
+    uint64_t repeats = 1;
+
+    while ((opt = getopt(argc, argv, ITEMS)) != -1) {
+        switch (opt) {
+        case 'v': verbose = true; break;
+        case 'i': infile = fopen(optarg, "r"); break;
+        case 'o': outfile = fopen(optarg, "w+"); break;
+        case 's': socket_path = optarg; break;
+        case 'k': req.key = (uint16_t) atoi(optarg); break;
+        case 'r': repeats = (uint64_t) atoi(optarg); break;
+        case 'e': req.code = RPC_ENCRYPT; break;
+        case 'd': req.code = RPC_DECRYPT; break;
+        case 'g': req.code = RPC_SIGN; break;
+        case 'V':
+            req.code = RPC_VERIFY;
+            sigfile = fopen(optarg, "r");
+            if (sigfile == NULL) {
+                fprintf(stderr, "ERROR: unable to open sigfile - %d\n", errno);
+                return 1;
+            }
+            break;
+        case 'H': req.flags |= RPC_FLAG_HYBRID; break;
+        default:
+        case 'h': fprintf(stderr, "%s", help_message); return 0;
+        }
+    }
+
+    if (repeats < 1) {
+        repeats = 1;
+    }
+
+    //begin check of file--------------------------------------------------------------------------
+
+    if (infile == NULL) {
+        fprintf(stderr, "ERROR: unable to open infile - %d\n", errno);
+        return 1;
+    }
+
+    if (outfile == NULL) {
+        fprintf(stderr, "ERROR: unable to open outfile - %d\n", errno);
+        return 1;
+    }
+
+    //build the request----------------------------------------------------------------------------
+    //a verify request carries the signature ahead of the message
+    uint64_t in_len = 0;
+    uint8_t *in = read_all(infile, &in_len);
+    if (sigfile != NULL) {
+        uint64_t sig_len = 0;
+        uint8_t *sig = read_all(sigfile, &sig_len);
+        sig = (uint8_t *) realloc(sig, sig_len + in_len + 1);
+        memcpy(sig + sig_len, in, in_len);
+        free(in);
+        in = sig;
+        in_len += sig_len;
+        fclose(sigfile);
+    }
+    req.len = in_len;
+
+    int fd = rpc_connect(socket_path);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: unable to connect to %s - %d\n", socket_path, errno);
+        free(in);
+        return 1;
+    }
+
+    //send it--------------------------------------------------------------------------------------
+    rpc_header_t resp;
+    uint8_t *out = NULL;
+    bool answered = true;
+    uint64_t start = stats_now();
+    for (uint64_t i = 0; (i < repeats) && (answered == true); i++) {
+        free(out);
+        answered = rpc_call(fd, &req, in, &resp, &out);
+    }
+    uint64_t elapsed = stats_now() - start;
+
+    //the exit status tells scripts whether the daemon did what was asked
+    int status = 0;
+    if (answered != true) {
+        fprintf(stderr, "ERROR: no answer from %s - %d\n", socket_path, errno);
+        status = 1;
+    } else if (resp.code != RPC_OK) {
+        fprintf(stderr, "ERROR: %s\n", rpc_status_name(resp.code));
+        status = 1;
+    } else if (resp.len > 0) {
+        fwrite(out, 1, resp.len, outfile);
+    }
+
+    if (verbose == true) {
+        if ((answered == true) && (req.code == RPC_VERIFY) && (resp.code == RPC_OK)) {
+            fprintf(stderr, "signature verified\n");
+        }
+        fprintf(stderr, "%" PRIu64 " requests in %.6f s, %.1f us each\n", repeats,
+            (double) elapsed / 1e9, (double) elapsed / 1e3 / (double) repeats);
+    }
+
+    //clears---------------------------------------------------------------------------------------
+    close(fd);
+    free(in);
+    free(out);
+    fclose(infile);
+    fclose(outfile);
+
+    return status;
+}
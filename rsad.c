@@ -0,0 +1,652 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <gmp.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "pipeline.h"
+#include "rsa.h"
+#include "rpc.h"
+#include "stats.h"
+
+#define ITEMS "n:d:s:t:vh"
+
+char *help_message = "SYNOPSIS\n"
+                     "   Serves RSA requests for keys loaded once, over a Unix socket.\n"
+                     "   Requests are sent by the rsac program.\n\n"
+                     "USAGE\n"
+                     "   ./rsad [-hv] [-s socket] [-t threads] [-n pbfile]... [-d pvfile]...\n\n"
+                     "OPTIONS\n"
+                     "   -h              Display program help and usage.\n"
+                     "   -v              Display verbose program output.\n"
+                     "   -n pbfile       Public key to encrypt and verify with, repeatable.\n"
+                     "   -d pvfile       Private key to decrypt and sign with, repeatable.\n"
+                     "   -s socket       Socket to listen on (default: rsa.sock).\n"
+                     "   -t threads      Threads answering requests (default: 1).\n"
+                     "   --stats[=file]  Print counters on shutdown (default: stderr).\n\n"
+                     "   Keys are numbered from 0 in the order they are given.\n";
+
+//long options, --stats takes an optional file to write the counters to
+static struct option long_options[] = {
+    { "stats", optional_argument, NULL, 'S' },
+    { NULL, 0, NULL, 0 },
+};
+
+//a key loaded at startup
+typedef struct {
+    bool priv; //decrypts and signs, a public key encrypts and verifies
+    uint64_t width; //bytes of n, the size of a signature
+    rsa_ctx_t ctx;
+} loaded_key_t;
+
+//a request waiting for a worker, owned by the connection that read it
+typedef struct job {
+    rpc_header_t req;
+    uint8_t *in;
+    uint8_t status;
+    uint8_t *out;
+    uint64_t out_len;
+    bool done;
+    pthread_cond_t done_cv;
+    struct job *next;
+} job_t;
+
+//a connection being served, listed so shutdown can wake the ones waiting for a request
+typedef struct conn {
+    int fd;
+    struct conn *prev, *next;
+} conn_t;
+
+//state shared by the accept loop, the connections and the workers, guarded by lock
+typedef struct {
+    loaded_key_t *keys;
+    uint64_t key_count;
+    job_t *head, *tail; //queued requests, oldest first
+    conn_t *conns; //open connections
+    bool stop; //no new requests are queued, workers leave once the queue is empty
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv; //a request was queued or stop was set
+    pthread_cond_t conn_cv; //a connection closed
+} server_t;
+
+typedef struct {
+    server_t *srv;
+    uint64_t worker; //scratch context of every key the worker runs on
+} worker_arg_t;
+
+typedef struct {
+    server_t *srv;
+    conn_t conn;
+} conn_arg_t;
+
+//set by SIGINT and SIGTERM to end the accept loop
+static volatile sig_atomic_t stopping = 0;
+
+static void on_signal(int sig) {
+    (void) sig;
+    stopping = 1;
+    return;
+}
+
+//signs and verifies only need one exponentiation each, so they are the requests worth batching
+static bool batchable(job_t *job) {
+    return (job->req.code == RPC_SIGN) || (job->req.code == RPC_VERIFY);
+}
+
+//takes the oldest request off the queue along with queued requests of the same op and key,
+//as many as the key's kernel runs side by side, the caller holds the lock
+//returns the number of requests put in batch
+static uint64_t take_jobs(server_t *srv, job_t *batch[]) {
+    job_t *first = srv->head;
+    srv->head = first->next;
+    batch[0] = first;
+    uint64_t count = 1;
+
+    if (batchable(first)) {
+        uint64_t lanes = srv->keys[first->req.key].ctx.lanes;
+        job_t *prev = NULL;
+        for (job_t *job = srv->head; (job != NULL) && (count < lanes);) {
+            job_t *next = job->next;
+            if ((job->req.code == first->req.code) && (job->req.key == first->req.key)) {
+                if (prev == NULL) {
+                    srv->head = next;
+                } else {
+                    prev->next = next;
+                }
+                batch[count++] = job;
+            } else {
+                prev = job;
+            }
+            job = next;
+        }
+    }
+
+    //the tail may have been taken along with the rest
+    srv->tail = NULL;
+    for (job_t *job = srv->head; job != NULL; job = job->next) {
+        srv->tail = job;
+    }
+    return count;
+}
+
+//exports x right aligned into the width bytes at out
+//mpz_sizeinbase counts one digit for 0 but mpz_export writes none, so 0 takes no bytes
+static void export_fixed(uint8_t *out, uint64_t width, mpz_t x) {
+    size_t len = 0;
+    uint64_t bytes = (mpz_sgn(x) != 0) ? (mpz_sizeinbase(x, 2) + 7) / 8 : 0;
+    memset(out, 0, width - bytes);
+    mpz_export(out + (width - bytes), &len, 1, 1, 1, 0, x);
+    return;
+}
+
+//signs the message of every request in batch with one batch call on the private key
+static void run_sign(loaded_key_t *key, job_t *batch[], uint64_t count, uint64_t worker) {
+    mpz_t m[MBEXP_LANES], s[MBEXP_LANES];
+    mpz_ptr mp[MBEXP_LANES], sp[MBEXP_LANES];
+    job_t *ready[MBEXP_LANES];
+    uint64_t used = 0;
+
+    for (uint64_t i = 0; i < count; i++) {
+        mpz_init(m[i]);
+        mpz_init(s[i]);
+        mpz_import(m[i], batch[i]->req.len, 1, 1, 1, 0, batch[i]->in);
+        if (mpz_cmp(m[i], key->ctx.n) >= 0) {
+            batch[i]->status = RPC_BAD_INPUT;
+            continue;
+        }
+        mp[used] = m[i];
+        sp[used] = s[i];
+        ready[used++] = batch[i];
+    }
+
+    rsa_decrypt_batch_ctx(sp, mp, used, &key->ctx, worker);
+    for (uint64_t i = 0; i < used; i++) {
+        ready[i]->out = (uint8_t *) malloc(key->width);
+        export_fixed(ready[i]->out, key->width, sp[i]);
+        ready[i]->out_len = key->width;
+        ready[i]->status = RPC_OK;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        mpz_clear(m[i]);
+        mpz_clear(s[i]);
+    }
+    return;
+}
+
+//checks the signature of every request in batch against its message with one batch call on
+//the public key
+static void run_verify(loaded_key_t *key, job_t *batch[], uint64_t count, uint64_t worker) {
+    mpz_t m[MBEXP_LANES], s[MBEXP_LANES], t[MBEXP_LANES];
+    mpz_ptr sp[MBEXP_LANES], tp[MBEXP_LANES];
+    uint64_t index[MBEXP_LANES];
+    uint64_t used = 0;
+
+    for (uint64_t i = 0; i < count; i++) {
+        mpz_init(m[i]);
+        mpz_init(s[i]);
+        mpz_init(t[i]);
+        if (batch[i]->req.len < key->width) {
+            batch[i]->status = RPC_BAD_INPUT;
+            continue;
+        }
+        mpz_import(s[i], key->width, 1, 1, 1, 0, batch[i]->in);
+        mpz_import(m[i], batch[i]->req.len - key->width, 1, 1, 1, 0, batch[i]->in + key->width);
+        if (mpz_cmp(s[i], key->ctx.n) >= 0) {
+            batch[i]->status = RPC_NOT_VERIFIED;
+            continue;
+        }
+        sp[used] = s[i];
+        tp[used] = t[i];
+        index[used++] = i;
+    }
+
+    rsa_encrypt_batch_ctx(tp, sp, used, &key->ctx, worker);
+    for (uint64_t i = 0; i < used; i++) {
+        uint64_t j = index[i];
+        batch[j]->status = (mpz_cmp(t[j], m[j]) == 0) ? RPC_OK : RPC_NOT_VERIFIED;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        mpz_clear(m[i]);
+        mpz_clear(s[i]);
+        mpz_clear(t[i]);
+    }
+    return;
+}
+
+//encrypts or decrypts the payload of job in one pass of a stream
+static void run_stream(loaded_key_t *key, job_t *job, uint64_t worker) {
+    rsa_stream_t st;
+    bool encrypt = (job->req.code == RPC_ENCRYPT);
+    bool ok = true;
+    if (encrypt) {
+        ok = rsa_stream_init_encrypt(
+            &st, &key->ctx, worker, (job->req.flags & RPC_FLAG_HYBRID) != 0);
+    } else {
+        rsa_stream_init_decrypt(&st, &key->ctx, worker);
+    }
+
+    uint64_t len = 0, tail = 0;
+    if (ok) {
+        len = rsa_stream_bound(&st, job->req.len);
+        job->out = (uint8_t *) malloc(len + 1);
+        ok = rsa_stream_update(&st, job->out, &len, job->in, job->req.len);
+    }
+    if (ok) {
+        tail = rsa_stream_bound(&st, 0);
+        job->out = (uint8_t *) realloc(job->out, len + tail + 1);
+        ok = rsa_stream_final(&st, job->out + len, &tail);
+    }
+    rsa_stream_clear(&st);
+
+    if (!ok) {
+        free(job->out);
+        job->out = NULL;
+        job->status = encrypt ? RPC_FAILED : RPC_BAD_INPUT;
+        return;
+    }
+    job->out_len = len + tail;
+    job->status = RPC_OK;
+    return;
+}
+
+//answers the requests queued by the connections until the server stops and the queue is empty
+static void *worker_main(void *arg) {
+    worker_arg_t *wa = (worker_arg_t *) arg;
+    server_t *srv = wa->srv;
+    job_t *batch[MBEXP_LANES];
+
+    pthread_mutex_lock(&srv->lock);
+    while (true) {
+        while ((srv->head == NULL) && !srv->stop) {
+            pthread_cond_wait(&srv->work_cv, &srv->lock);
+        }
+        if (srv->head == NULL) {
+            break;
+        }
+        uint64_t count = take_jobs(srv, batch);
+        pthread_mutex_unlock(&srv->lock);
+
+        loaded_key_t *key = &srv->keys[batch[0]->req.key];
+        switch (batch[0]->req.code) {
+        case RPC_SIGN: run_sign(key, batch, count, wa->worker); break;
+        case RPC_VERIFY: run_verify(key, batch, count, wa->worker); break;
+        default: run_stream(key, batch[0], wa->worker); break;
+        }
+        stats_add(&stats.requests, count);
+        if (count > 1) {
+            stats_add(&stats.batched, count);
+        }
+
+        pthread_mutex_lock(&srv->lock);
+        for (uint64_t i = 0; i < count; i++) {
+            batch[i]->done = true;
+            pthread_cond_signal(&batch[i]->done_cv);
+        }
+    }
+    pthread_mutex_unlock(&srv->lock);
+    return NULL;
+}
+
+//status a request gets before it is queued, RPC_OK if it names a key that can serve it
+static uint8_t check_request(server_t *srv, rpc_header_t *req) {
+    if ((req->code < RPC_ENCRYPT) || (req->code > RPC_VERIFY)) {
+        return RPC_BAD_REQUEST;
+    }
+    if (req->key >= srv->key_count) {
+        return RPC_BAD_KEY;
+    }
+    bool wants_priv = (req->code == RPC_DECRYPT) || (req->code == RPC_SIGN);
+    return (srv->keys[req->key].priv == wants_priv) ? RPC_OK : RPC_BAD_KEY;
+}
+
+//queues job and waits for a worker to answer it, the caller holds the lock
+//returns false without queueing once the server is stopping
+static bool submit(server_t *srv, job_t *job) {
+    if (srv->stop) {
+        return false;
+    }
+    job->done = false;
+    job->next = NULL;
+    if (srv->tail == NULL) {
+        srv->head = job;
+    } else {
+        srv->tail->next = job;
+    }
+    srv->tail = job;
+    pthread_cond_signal(&srv->work_cv);
+    while (!job->done) {
+        pthread_cond_wait(&job->done_cv, &srv->lock);
+    }
+    return true;
+}
+
+//reads the requests of one client and answers them in order until it hangs up
+static void *conn_main(void *arg) {
+    conn_arg_t *ca = (conn_arg_t *) arg;
+    server_t *srv = ca->srv;
+    int fd = ca->conn.fd;
+    job_t job;
+    pthread_cond_init(&job.done_cv, NULL);
+
+    while (true) {
+        uint8_t buf[RPC_HEADER_SIZE];
+        if (!rpc_read(fd, buf, RPC_HEADER_SIZE)) {
+            break;
+        }
+        rpc_header_t resp = { .response = true };
+        bool valid = rpc_decode(buf, &job.req) && !job.req.response;
+        uint8_t status = valid ? check_request(srv, &job.req) : RPC_BAD_REQUEST;
+        if (status == RPC_BAD_REQUEST) {
+            //the payload cannot be skipped reliably, so the connection ends here
+            resp.code = RPC_BAD_REQUEST;
+            rpc_send(fd, &resp, NULL);
+            break;
+        }
+
+        job.in = (uint8_t *) malloc(job.req.len + 1);
+        job.out = NULL;
+        job.out_len = 0;
+        if (!rpc_read(fd, job.in, job.req.len)) {
+            free(job.in);
+            break;
+        }
+
+        if (status == RPC_OK) {
+            pthread_mutex_lock(&srv->lock);
+            bool queued = submit(srv, &job);
+            pthread_mutex_unlock(&srv->lock);
+            status = queued ? job.status : RPC_FAILED;
+        }
+
+        resp.code = status;
+        resp.len = job.out_len;
+        bool sent = rpc_send(fd, &resp, job.out);
+        free(job.in);
+        free(job.out);
+        if (!sent) {
+            break;
+        }
+    }
+
+    pthread_cond_destroy(&job.done_cv);
+
+    pthread_mutex_lock(&srv->lock);
+    if (ca->conn.prev == NULL) {
+        srv->conns = ca->conn.next;
+    } else {
+        ca->conn.prev->next = ca->conn.next;
+    }
+    if (ca->conn.next != NULL) {
+        ca->conn.next->prev = ca->conn.prev;
+    }
+    pthread_cond_signal(&srv->conn_cv);
+    pthread_mutex_unlock(&srv->lock);
+    close(fd);
+    free(ca);
+    return NULL;
+}
+
+//starts a detached thread serving the client connected on fd
+static bool serve(server_t *srv, int fd) {
+    conn_arg_t *ca = (conn_arg_t *) malloc(sizeof(conn_arg_t));
+    ca->srv = srv;
+    ca->conn.fd = fd;
+    ca->conn.prev = NULL;
+
+    pthread_mutex_lock(&srv->lock);
+    ca->conn.next = srv->conns;
+    if (srv->conns != NULL) {
+        srv->conns->prev = &ca->conn;
+    }
+    srv->conns = &ca->conn;
+    pthread_mutex_unlock(&srv->lock);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, conn_main, ca);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        //nothing runs on the connection yet, so it is taken back off the list
+        pthread_mutex_lock(&srv->lock);
+        srv->conns = ca->conn.next;
+        if (srv->conns != NULL) {
+            srv->conns->prev = NULL;
+        }
+        pthread_mutex_unlock(&srv->lock);
+        close(fd);
+        free(ca);
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+//reads the key file at path into key, public keys have their signature checked
+//returns false with an error printed if the file could not be used
+static bool load_key(loaded_key_t *key, const char *path, bool priv, uint64_t threads) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: unable to open %s - %d\n", path, errno);
+        return false;
+    }
+
+    mpz_t n, e, s, m;
+    mpz_inits(n, e, s, m, NULL);
+    bool ok = true;
+    key->priv = priv;
+    if (priv) {
+        mpz_t d, p, q, dp, dq, qinv;
+        mpz_inits(d, p, q, dp, dq, qinv, NULL);
+        rsa_extra_t extra;
+        rsa_extra_init(&extra);
+        rsa_read_priv(n, d, p, q, dp, dq, qinv, &extra, file);
+        rsa_ctx_init_priv(&key->ctx, n, d, p, q, dp, dq, qinv, &extra, threads);
+        rsa_extra_clear(&extra);
+        mpz_clears(d, p, q, dp, dq, qinv, NULL);
+    } else {
+        char username[256];
+        rsa_read_pub(n, e, s, username, file);
+        rsa_ctx_init_pub(&key->ctx, n, e, threads);
+        mpz_set_str(m, username, 62);
+        if (rsa_verify_ctx(m, s, &key->ctx, 0) != true) {
+            fprintf(stderr, "ERROR: could not verify signature of %s\n", path);
+            rsa_ctx_clear(&key->ctx);
+            ok = false;
+        }
+    }
+    key->width = (mpz_sizeinbase(n, 2) + 7) / 8;
+
+    mpz_clears(n, e, s, m, NULL);
+    fclose(file);
+    return ok;
+}
+
+//credit: Eugene for getopt() use
+int main(int argc, char **argv) {
+
+    int opt = 0;
+
+    bool verbose = false;
+    uint64_t threads = 1;
+    bool show_stats = false;
+    char *stats_path = NULL;
+    char *socket_path = "rsa.sock";
+
+    //key files in the order given, which is the order they are numbered in
+    char **key_paths = (char **) calloc((uint64_t) argc, sizeof(char *));
+    bool *key_priv = (bool *) calloc((uint64_t) argc, sizeof(bool));
+    uint64_t key_count = 0;
+
+    while ((opt = getopt_long(argc, argv, ITEMS, long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'v': verbose = true; break;
+        case 'n':
+        case 'd':
+            key_paths[key_count] = optarg;
+            key_priv[key_count++] = (opt == 'd');
+            break;
+        case 's': socket_path = optarg; break;
+        case 't': threads = pipeline_parse_threads(optarg); break;
+        case 'S':
+            show_stats = true;
+            stats_path = optarg;
+            break;
+        default:
+        case 'h':
+            fprintf(stderr, "%s", help_message);
+            free(key_paths);
+            free(key_priv);
+            return 0;
+        }
+    }
+
+    if (threads == 0) {
+        fprintf(stderr, "ERROR: threads must be between 1 and %d\n", PIPELINE_MAX_THREADS);
+        free(key_paths);
+        free(key_priv);
+        return 0;
+    }
+
+    //load keys------------------------------------------------------------------------------------
+
+    if (key_count == 0) {
+        fprintf(stderr, "ERROR: no keys to serve\n");
+        free(key_paths);
+        free(key_priv);
+        return 0;
+    }
+
+    server_t srv = { 0 };
+    srv.keys = (loaded_key_t *) calloc(key_count, sizeof(loaded_key_t));
+    for (uint64_t i = 0; i < key_count; i++) {
+        if (load_key(&srv.keys[i], key_paths[i], key_priv[i], threads) != true) {
+            for (uint64_t j = 0; j < i; j++) {
+                rsa_ctx_clear(&srv.keys[j].ctx);
+            }
+            free(srv.keys);
+            free(key_paths);
+            free(key_priv);
+            return 0;
+        }
+        srv.key_count++;
+        if (verbose == true) {
+            rsa_ctx_t *ctx = &srv.keys[i].ctx;
+            fprintf(stdout, "key %" PRIu64 " = %s, %s, %zu bits, kernel = %s\n", i,
+                key_paths[i], key_priv[i] ? "private" : "public", mpz_sizeinbase(ctx->n, 2),
+                mbexp_name(ctx->crt ? ctx->mb_p.isa : ctx->mb_n.isa));
+        }
+    }
+    free(key_paths);
+    free(key_priv);
+
+    //serve requests-------------------------------------------------------------------------------
+
+    int listen_fd = rpc_listen(socket_path);
+    if (listen_fd == -1) {
+        fprintf(stderr, "ERROR: unable to listen on %s - %d\n", socket_path, errno);
+        for (uint64_t i = 0; i < srv.key_count; i++) {
+            rsa_ctx_clear(&srv.keys[i].ctx);
+        }
+        free(srv.keys);
+        return 0;
+    }
+
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.work_cv, NULL);
+    pthread_cond_init(&srv.conn_cv, NULL);
+
+    //no SA_RESTART, so a signal interrupts accept and ends the loop
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    //threads start with the signals blocked so they are delivered to the accept loop
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    pthread_t *workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+    worker_arg_t *args = (worker_arg_t *) malloc(threads * sizeof(worker_arg_t));
+    for (uint64_t i = 0; i < threads; i++) {
+        args[i].srv = &srv;
+        args[i].worker = i;
+        pthread_create(&workers[i], NULL, worker_main, &args[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (verbose == true) {
+        fprintf(stdout, "listening on %s with %" PRIu64 " threads\n", socket_path, threads);
+        fflush(stdout);
+    }
+
+    while (stopping == 0) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if ((errno != EINTR) && (errno != ECONNABORTED)) {
+                fprintf(stderr, "ERROR: unable to accept connection - %d\n", errno);
+            }
+            continue;
+        }
+        pthread_sigmask(SIG_BLOCK, &block, &old);
+        if (serve(&srv, fd) != true) {
+            fprintf(stderr, "ERROR: unable to serve connection - %d\n", errno);
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+
+    //shut down------------------------------------------------------------------------------------
+    //queued requests are still answered, connections waiting for their next request are woken
+    close(listen_fd);
+    unlink(socket_path);
+
+    pthread_mutex_lock(&srv.lock);
+    srv.stop = true;
+    pthread_cond_broadcast(&srv.work_cv);
+    for (conn_t *conn = srv.conns; conn != NULL; conn = conn->next) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    while (srv.conns != NULL) {
+        pthread_cond_wait(&srv.conn_cv, &srv.lock);
+    }
+    pthread_mutex_unlock(&srv.lock);
+
+    for (uint64_t i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    if (verbose == true) {
+        fprintf(stdout, "%" PRIu64 " requests served\n", (uint64_t) stats.requests);
+    }
+
+    if ((show_stats == true) && (stats_write(stats_path) != true)) {
+        fprintf(stderr, "ERROR: unable to open stats file - %d\n", errno);
+    }
+
+    //clears---------------------------------------------------------------------------------------
+    for (uint64_t i = 0; i < srv.key_count; i++) {
+        rsa_ctx_clear(&srv.keys[i].ctx);
+    }
+    free(srv.keys);
+    free(workers);
+    free(args);
+    pthread_cond_destroy(&srv.conn_cv);
+    pthread_cond_destroy(&srv.work_cv);
+    pthread_mutex_destroy(&srv.lock);
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "stats.h"
+
+stats_t stats;
+
+//names of the phases as printed
+static const char *phase_names[STATS_PHASES] = { "key load", "keygen", "encrypt", "decrypt" };
+
+//nanoseconds on a monotonic clock, the start of a phase
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+//adds the time since start, taken with stats_now, to phase
+void stats_phase(stats_phase_t phase, uint64_t start) {
+    stats_add(&stats.phase_ns[phase], stats_now() - start);
+    return;
+}
+
+//sets every counter back to 0
+void stats_reset(void) {
+    stats.modmults = 0;
+    stats.modexps = 0;
+    stats.mr_rounds = 0;
+    stats.candidates = 0;
+    stats.sieved = 0;
+    stats.mr_rejected = 0;
+    stats.restarts = 0;
+    stats.found = 0;
+    stats.pooled = 0;
+    stats.blocks = 0;
+    stats.bytes_in = 0;
+    stats.bytes_out = 0;
+    stats.lz_plain = 0;
+    stats.lz_packed = 0;
+    stats.requests = 0;
+    stats.batched = 0;
+    for (int i = 0; i < STATS_PHASES; i++) {
+        stats.phase_ns[i] = 0;
+    }
+    return;
+}
+
+//prints the counters and the phases that ran to file, one per line
+void stats_print(FILE *file) {
+    fprintf(file, "modmults = %" PRIu64 "\n", (uint64_t) stats.modmults);
+    fprintf(file, "modexps = %" PRIu64 "\n", (uint64_t) stats.modexps);
+    fprintf(file, "mr rounds = %" PRIu64 "\n", (uint64_t) stats.mr_rounds);
+    fprintf(file, "candidates = %" PRIu64 "\n", (uint64_t) stats.candidates);
+    fprintf(file, "sieved = %" PRIu64 "\n", (uint64_t) stats.sieved);
+    fprintf(file, "mr rejected = %" PRIu64 "\n", (uint64_t) stats.mr_rejected);
+    fprintf(file, "restarts = %" PRIu64 "\n", (uint64_t) stats.restarts);
+    fprintf(file, "primes found = %" PRIu64 "\n", (uint64_t) stats.found);
+    fprintf(file, "primes pooled = %" PRIu64 "\n", (uint64_t) stats.pooled);
+    fprintf(file, "blocks = %" PRIu64 "\n", (uint64_t) stats.blocks);
+    fprintf(file, "bytes in = %" PRIu64 "\n", (uint64_t) stats.bytes_in);
+    fprintf(file, "bytes out = %" PRIu64 "\n", (uint64_t) stats.bytes_out);
+    fprintf(file, "lz plain bytes = %" PRIu64 "\n", (uint64_t) stats.lz_plain);
+    fprintf(file, "lz packed bytes = %" PRIu64 "\n", (uint64_t) stats.lz_packed);
+    fprintf(file, "requests = %" PRIu64 "\n", (uint64_t) stats.requests);
+    fprintf(file, "requests batched = %" PRIu64 "\n", (uint64_t) stats.batched);
+    for (int i = 0; i < STATS_PHASES; i++) {
+        if (stats.phase_ns[i] != 0) {
+            fprintf(file, "%s time = %.6f s\n", phase_names[i], (double) stats.phase_ns[i] / 1e9);
+        }
+    }
+    return;
+}
+
+//prints the stats to the file at path, or to stderr when path is NULL
+//returns false if the file could not be opened
+bool stats_write(const char *path) {
+    if (path == NULL) {
+        stats_print(stderr);
+        return true;
+    }
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    stats_print(file);
+    fclose(file);
+    return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+//phases of the tools that are timed
+typedef enum {
+    STATS_KEY_LOAD, //reading a key and setting up its contexts
+    STATS_KEYGEN, //making a key pair
+    STATS_ENCRYPT, //encrypting a file
+    STATS_DECRYPT, //decrypting a file
+    STATS_PHASES
+} stats_phase_t;
+
+//library wide performance counters
+//hot loops count into locals and add them in once per call, so leaving them on costs a
+//handful of relaxed atomic adds per modexp or block
+typedef struct {
+    _Atomic uint64_t modmults; //modular multiplications and squarings
+    _Atomic uint64_t modexps; //modular exponentiations
+    _Atomic uint64_t mr_rounds; //Miller-Rabin rounds run
+    _Atomic uint64_t candidates; //odd prime candidates stepped through
+    _Atomic uint64_t sieved; //candidates rejected by the small prime sieve
+    _Atomic uint64_t mr_rejected; //candidates rejected by the primality test
+    _Atomic uint64_t restarts; //random starts abandoned without finding a prime
+    _Atomic uint64_t found; //primes found, racing workers may find more than one per search
+    _Atomic uint64_t pooled; //primes taken from a prime pool instead of searched for
+    _Atomic uint64_t blocks; //file blocks encrypted or decrypted
+    _Atomic uint64_t bytes_in; //file bytes read by the block loops
+    _Atomic uint64_t bytes_out; //file bytes written by the block loops
+    _Atomic uint64_t lz_plain; //file bytes that went into or came out of lz frames
+    _Atomic uint64_t lz_packed; //bytes of those lz frames
+    _Atomic uint64_t requests; //daemon requests answered
+    _Atomic uint64_t batched; //daemon requests that shared an exponentiation batch with others
+    _Atomic uint64_t phase_ns[STATS_PHASES]; //time spent in each phase
+} stats_t;
+
+extern stats_t stats;
+
+//adds n to a counter, relaxed since the counters are only read once the work is done
+static inline void stats_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+uint64_t stats_now(void);
+
+void stats_phase(stats_phase_t phase, uint64_t start);
+
+void stats_reset(void);
+
+void stats_print(FILE *file);
+
+bool stats_write(const char *path);